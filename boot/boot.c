@@ -0,0 +1,185 @@
+/////////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL (see License.txt)
+// Date:    08-01-2020
+//
+/////////////////////////////////////////////////////////////////////
+//
+// V-USB bootloader, lives in the BOOT section and programs APPCODE
+//
+// Set CFG_BOOT_FUSE=0x0C and CFG_APP_ENT=0x0C00 in compile_config.sh, build
+// this with compile_boot.sh and the app with compile.sh, program this once
+// with "program.sh boot", then "usb_app -flash-app main.hex" updates the app.
+//
+// The bootloader runs after a reset when...
+//   - the reset was a software reset, the app 'J' command does this
+//   - or APPCODE is blank (its first two bytes are 0xFF)
+// otherwise it starts the app right away. usb_app erases the first app page
+// before it writes any other page and writes it last, once the rest verifies,
+// so a flash that is cut short (cable, power, host) comes back here.
+//
+// Vendor control requests (device recipient)...
+//   BOOT_RQ_INFO   in,  8 bytes, page size, app start lo/hi, flash size lo/hi, version
+//   BOOT_RQ_CRC    in,  wValue=flash address of a page, 2 bytes CRC16 per page (CRC of 'C' in the app)
+//   BOOT_RQ_WRITE  out, wValue=flash address of a page, wLength=page size, page is written after the status stage
+//   BOOT_RQ_EXIT   no data, start the app
+//
+/////////////////////////////////////////////////////////////////////
+
+//system includes
+#include <avr/pgmspace.h>   //for PROGMEM
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>		//_delay_ms() or _delay_us()
+#include <util/atomic.h>
+#include "defines.h"
+#include "usbdrv.h"
+#include "usb_osc.h"
+
+#define BOOT_VERSION     1
+#define BOOT_PAGE_SIZE   MAPPED_PROGMEM_PAGE_SIZE
+#define BOOT_FLASH_SIZE  MAPPED_PROGMEM_SIZE
+#define BOOT_APP_START   ((U16)FUSE_BOOTEND * 256) //first APPCODE byte, the BOOTEND fuse is in 256 byte blocks
+#define BOOT_RQ_INFO     0x20
+#define BOOT_RQ_CRC      0x21
+#define BOOT_RQ_WRITE    0x22
+#define BOOT_RQ_EXIT     0x23
+
+extern volatile uchar usbTxLen; //usbdrv.c, USBPID_NAK once the status stage has gone
+
+//-----------------GLOBAL VARIABLES-------------------------
+U8  g_Page[BOOT_PAGE_SIZE]; //page received from the host
+U16 g_PageAdr = 0; //flash address of the page
+U8  g_PagePos = 0; //bytes received
+U8  g_PageReady = 0; //whole page received, write it from the main loop
+U8  g_Exit = 0; //start the app from the main loop
+U8  g_Info[8]; //BOOT_RQ_INFO response
+//----------------------------------------------------------
+
+//a USB reset occured
+void usbHadReset()
+{
+	#if USB_OSC_TRIM
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+		usb_calibrate_osc();
+	}
+    #endif
+	g_PagePos = 0;
+}
+
+usbMsgLen_t usbFunctionSetup(uchar *data)
+{
+	usbRequest_t* rq = (void*)data;
+	if((rq->bmRequestType & USBRQ_TYPE_MASK) != USBRQ_TYPE_VENDOR){ return 0; }
+	g_PageAdr = rq->wValue.word;
+	switch(rq->bRequest)
+	{
+		case BOOT_RQ_INFO:
+			g_Info[0] = BOOT_PAGE_SIZE;
+			g_Info[1] = BOOT_APP_START & 0xFF; g_Info[2] = BOOT_APP_START >> 8;
+			g_Info[3] = BOOT_FLASH_SIZE & 0xFF; g_Info[4] = BOOT_FLASH_SIZE >> 8;
+			g_Info[5] = BOOT_VERSION; g_Info[6] = 0; g_Info[7] = 0;
+			usbMsgPtr = (usbMsgPtr_t)g_Info;
+			return sizeof(g_Info);
+		case BOOT_RQ_CRC:
+			return USB_NO_MSG; //usbFunctionRead() computes the CRCs
+		case BOOT_RQ_WRITE:
+			g_PagePos = 0;
+			return USB_NO_MSG; //usbFunctionWrite() collects the page
+		case BOOT_RQ_EXIT:
+			g_Exit = 1;
+			return 0;
+	}
+	return 0;
+}
+
+//CRC16 of the next pages, 2 bytes per page, pages past the end of flash read as 0
+uchar usbFunctionRead(uchar *data, uchar len)
+{
+	uchar i;
+	for(i=0; i+1<len; i+=2)
+	{
+		U16 crc = 0;
+		if(g_PageAdr < BOOT_FLASH_SIZE)
+		{ crc = usbCrc16Continue(MAPPED_PROGMEM_START + g_PageAdr,BOOT_PAGE_SIZE,0); }
+		data[i] = crc & 0xFF;
+		data[i+1] = crc >> 8;
+		g_PageAdr += BOOT_PAGE_SIZE;
+	}
+	return i;
+}
+
+//collect one page, the bootloader never writes its own section (NVMCTRL would not let it anyway)
+uchar usbFunctionWrite(uchar *data, uchar len)
+{
+	if(g_PageAdr % BOOT_PAGE_SIZE || g_PageAdr < BOOT_APP_START || g_PageAdr >= BOOT_FLASH_SIZE){ return 0xFF; } //STALL
+	for(uchar i=0; i<len && g_PagePos<BOOT_PAGE_SIZE; i++){ g_Page[g_PagePos++] = data[i]; }
+	if(g_PagePos < BOOT_PAGE_SIZE){ return 0; }
+	g_PageReady = 1;
+	return 1;
+}
+
+//write the page, the CPU halts while the flash is busy, so this waits until the status stage has
+//been sent, the host waits before its next request (BOOT_WRITE_MS in usb_app)
+static void boot_write_page()
+{
+	if(usbTxLen != USBPID_NAK){ return; } //status stage not sent yet
+	volatile U8* dst = (volatile U8*)(MAPPED_PROGMEM_START + g_PageAdr);
+	for(U8 i=0; i<BOOT_PAGE_SIZE; i++){ dst[i] = g_Page[i]; } //memory mapped stores go to the page buffer
+	_PROTECTED_WRITE_SPM(NVMCTRL.CTRLA,NVMCTRL_CMD_PAGEERASEWRITE_gc);
+	while(NVMCTRL.STATUS & NVMCTRL_FBUSY_bm);
+	g_PageReady = 0;
+}
+
+//leave the bootloader, vectors go back to the app and the app starts from its reset vector
+static void boot_start_app() __attribute__((noreturn));
+static void boot_start_app()
+{
+	cli();
+	_PROTECTED_WRITE(CPUINT_CTRLA,0); //IVSEL off, vectors at the start of APPCODE
+	void (*app)(void) = (void (*)(void))(BOOT_APP_START / 2); //word address
+	app();
+	while(1);
+}
+
+static inline void use_int_osc()
+{
+	//same as main.c, the OSCCFG fuse picks 16MHz or 20MHz, V-USB will trim to 16.5MHz, 12.8MHz or 20MHz
+	_PROTECTED_WRITE(CLKCTRL_MCLKCTRLB,0x00);            //no prescaler
+	while((CLKCTRL_MCLKSTATUS & CLKCTRL_OSC20MS_bm)==0); //pg88 wait for OSC20MS to become stable
+}
+
+void main(void) __attribute__((noreturn));  void main(void)
+{
+	//stay for a software reset or a blank app, otherwise start the app
+	U8 rst = RSTCTRL_RSTFR;
+	RSTCTRL_RSTFR = rst; //clear the flags
+	U8 blank = pgm_read_byte(BOOT_APP_START) == 0xFF && pgm_read_byte(BOOT_APP_START+1) == 0xFF;
+	if(!(rst & RSTCTRL_SWRF_bm) && !blank){ boot_start_app(); }
+
+	#if USB_OSC_TRIM
+	use_int_osc();
+	#endif
+	_PROTECTED_WRITE(CPUINT_CTRLA,CPUINT_IVSEL_bm); //our USB vector is at the start of the BOOT section
+
+	usbInit();
+    usbDeviceDisconnect();  //enforce re-enumeration
+	_delay_ms(250);
+    usbDeviceConnect();
+	sei();
+
+	for(;;)
+	{
+		usbPoll();
+		if(g_PageReady){ boot_write_page(); }
+		if(g_Exit && usbTxLen == USBPID_NAK) //status stage sent
+		{
+			usbDeviceDisconnect();
+			_delay_ms(100);
+			boot_start_app();
+		}
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef __boot_usbconfig_h_included__
+#define __boot_usbconfig_h_included__
+
+//bootloader usb config, same hardware setup as the app, see ../usbconfig.h
+//compile_boot.sh puts this directory first in the include path, so the driver picks up this file
+//the bootloader is a vendor class device with no interrupt endpoints, every request is a control transfer
+
+#include "../usbconfig.h"
+
+#undef  USB_CFG_HAVE_INTRIN_ENDPOINT
+#define USB_CFG_HAVE_INTRIN_ENDPOINT    0
+#undef  USB_CFG_HAVE_INTRIN_ENDPOINT3
+#define USB_CFG_HAVE_INTRIN_ENDPOINT3   0
+#undef  USB_CFG_SUPPRESS_INTR_CODE
+#define USB_CFG_SUPPRESS_INTR_CODE      1
+#undef  USB_CFG_IMPLEMENT_FN_WRITEOUT
+#define USB_CFG_IMPLEMENT_FN_WRITEOUT   0
+#undef  USB_CFG_HAVE_FLOWCONTROL
+#define USB_CFG_HAVE_FLOWCONTROL        0
+#undef  USB_CFG_LONG_TRANSFERS
+#define USB_CFG_LONG_TRANSFERS          0 //a flash page and 127 page CRCs fit in 254 bytes
+#undef  USB_SOF_HOOK                      //no drift tracker here, usbSofTicks is in the app
+#undef  USB_COUNT_SOF
+#define USB_COUNT_SOF                   0 //the interrupt stays on D-, it works without SOF logic too
+
+#undef  USB_CFG_DEVICE_NAME
+#define USB_CFG_DEVICE_NAME     'T', 'i', 'n', 'y', 'B', 'o', 'o', 't' //host finds the bootloader by this product string
+#undef  USB_CFG_DEVICE_NAME_LEN
+#define USB_CFG_DEVICE_NAME_LEN 8
+#undef  USB_CFG_INTERFACE_CLASS
+#define USB_CFG_INTERFACE_CLASS 0xff //vendor class, no HID driver attaches
+
+//default driver descriptors, no HID
+#undef  USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    0
+#undef  USB_CFG_DESCR_PROPS_CONFIGURATION
+#define USB_CFG_DESCR_PROPS_CONFIGURATION       0
+#undef  USB_CFG_DESCR_PROPS_HID
+#define USB_CFG_DESCR_PROPS_HID                 0
+#undef  USB_CFG_DESCR_PROPS_HID_REPORT
+#define USB_CFG_DESCR_PROPS_HID_REPORT          0
+
+#endif
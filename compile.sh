@@ -47,9 +47,11 @@ EZS="/home/$USR/dev/lib_avr/ezstack/ezstack"
 
 #options
 # -Wall -gdwarf-2 -std=gnu99                   -DF_CPU=16000000UL -Os -funsigned-char -funsigned-bitfields -fpack-struct -fshort-enums
-OPT='  -DF_CPU=12800000UL '
+OPT="  -DF_CPU=${CFG_F_CPU}UL "
+OPT+=" -DUSB_EXT_CLK=$CFG_EXT_CLK "
 OPT+=" -DBOOT_FUSE_VAR=$BFU "
 OPT+=" -DLKBITS_VAR=$LKB "
+#OPT+=' -DUSB_POLL_STATS=1 '         #usbPoll() gap histogram and deadline alarm, usb_app -polls shows it
 OPT+=' -Os '
 OPT+=' -gdwarf-2 '                 #-g2 same as -gdwarf-2 I think
 OPT+=' -DDEBUG '
@@ -72,7 +74,7 @@ OPT+=' -flto ' #can cause "error: global register variable follows a function de
 #files to compile #https://stackabuse.com/array-loops-in-bash/
 INCS=" -I $CUR/  -I $CUR/usbdrv/ "                        # custom include directories, but -I before each one
 ASMS=( usbdrv/usbdrvasm )                       # .S asm files
-FILES=( main usb usbdrv/usbdrv  usbdrv/oddebug   ) # .c files
+FILES=( main usb sched usbdrv/usbdrv  usbdrv/oddebug   ) # .c files
 #INCS="   "                        # custom include directories, but -I before each one
 #ASMS=(   )                       # .S asm files
 #FILES=( main div fgen eeprom      ) # .c files
@@ -0,0 +1,105 @@
+#!/bin/bash
+
+#####################################
+# Compile Script for the USB bootloader in ./boot
+#
+# Date:    07-09-2019
+# Author:  12oClocker
+# License: GNU GPL (see License.txt)
+#
+#####################################
+
+#  Same options as compile.sh, but...
+#  boot/ is searched first so boot/usbconfig.h replaces the app's usbconfig.h
+#  always linked at 0x0000, the BOOT section, set CFG_BOOT_FUSE so the app starts after it
+#  output goes to out_boot_$MCU/boot.hex, program it with "program.sh boot"
+
+source ./compile_config.sh
+
+clear #reset
+
+#mcu we are compiling for
+MCU=$CFG_MCU
+
+#variables
+PRE=out_boot_
+OUT=$PRE$MCU
+BFU=$CFG_BOOT_FUSE #0x0C      #boot fuse, 3K bootloader
+LKB=$CFG_LKBITS    #0xFF      #lockbits
+
+TOOLCHAIN=$TC_DIR
+GCC="$TOOLCHAIN/bin"
+PAC="$TOOLCHAIN/PACKS/Atmel.ATtiny_DFP.1.3.172"
+PACB="$PAC/gcc/dev/$MCU/"
+PACI="$PAC/include/"
+PACa="-I $PACI -B $PACB"
+PACb="-B $PACB"
+CUR=$(pwd)
+
+if [ "$BFU" == "0x00" ]; then
+echo "CFG_BOOT_FUSE is 0x00, set CFG_BOOT_FUSE=0x0C and CFG_APP_ENT=0x0C00 in compile_config.sh"
+exit 1
+fi
+
+#options, F_CPU is the same as compile.sh
+OPT="  -DF_CPU=${CFG_F_CPU}UL "
+OPT+=" -DUSB_EXT_CLK=$CFG_EXT_CLK "
+OPT+=" -DBOOT_FUSE_VAR=$BFU "
+OPT+=" -DLKBITS_VAR=$LKB "
+OPT+=' -Os '
+OPT+=' -gdwarf-2 '
+OPT+=' -std=gnu99 '
+OPT+=' -Wall '
+OPT+=' -funsigned-char '
+OPT+=' -funsigned-bitfields '
+OPT+=' -fpack-struct '
+OPT+=' -fshort-enums '
+OPT+=' -ffunction-sections '       #remove unused functions
+OPT+=' -fdata-sections '
+OPT+=' -ffreestanding '
+OPT+=' -flto '
+
+#files to compile
+INCS=" -I $CUR/boot/  -I $CUR/  -I $CUR/usbdrv/ "   # boot/ first for boot/usbconfig.h
+ASMS=( usbdrv/usbdrvasm )                           # .S asm files
+FILES=( boot/boot usbdrv/usbdrv  usbdrv/oddebug )   # .c files
+
+#compile
+echo "__________________________________________________________"
+echo "STARTING BOOTLOADER COMPILE            BootFuse = $BFU"
+if [ ! -e "$OUT" ]; then mkdir "$OUT"; fi
+cd "$OUT"
+#===========================================================
+
+#reset object linking
+OL=""
+
+for FL in "${FILES[@]}"
+do
+echo "  C Compiling... $CUR/$FL.c"
+$GCC/avr-gcc -g -x c                              $INCS $PACa $OPT  -mmcu=$MCU -c -MD -MP -MT "$CUR/$FL.o" -MF "$CUR/$FL.d" -o "$CUR/$FL.o" -c "$CUR/$FL.c"
+OL+="$CUR/$FL.o "
+done
+
+for FL in "${ASMS[@]}"
+do
+echo "  ASM Compiling... $CUR/$FL.S"
+$GCC/avr-gcc -g -x assembler-with-cpp -Wa,-gdwarf2 $INCS $PACa $OPT -mmcu=$MCU     -MD -MP -MT "$CUR/$FL.o" -MF "$CUR/$FL.d" -o "$CUR/$FL.o" -c "$CUR/$FL.S"
+OL+="$CUR/$FL.o "
+done
+
+FM=boot
+$GCC/avr-gcc -g -gdwarf-2 -o $FM.elf  $OL   -Wl,-Map="$FM.map" -Wl,--start-group -Wl,-lm  -Wl,--end-group -Wl,--gc-sections -mmcu=$MCU $PACb
+$GCC/avr-objcopy -O ihex -R .eeprom -R .fuse -R .lock -R .signature -R .user_signatures  "$FM.elf" "$FM.hex"
+$GCC/avr-objdump -h -S -C -l -F -d "$FM.elf" > "$FM.lss"
+
+#===========================================================
+echo "COMPILE FINISHED"
+echo "__________________________________________________________"
+#the bootloader must fit below the app, BOOTEND is in 256 byte blocks
+$GCC/avr-size $FM.elf
+echo "bootloader must be smaller than $(( BFU * 256 )) bytes"
+echo "__________________________________________________________"
+cd ..
+# usbdrv objects are shared with compile.sh, keep them apart
+mv boot/*.o boot/*.d usbdrv/*.o usbdrv/*.d "./$OUT"
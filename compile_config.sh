@@ -9,10 +9,13 @@
 #config
       CFG_MCU=attiny1614  # MCU we are compiling for
       CFG_OSC=0x01        # 0x02 = Run at 20MHz, 0x01 = Run at 16MHz
+    CFG_F_CPU=12800000    # internal osc, 12800000 or 16500000 with CFG_OSC=0x01, 20000000 with CFG_OSC=0x02 (needs 4.5v or more)
+  CFG_EXT_CLK=0           # 1 = clock on the EXTCLK pin, CFG_F_CPU 12000000, 16000000, 18000000 or 20000000
    CFG_FUSE_5=0xF6        # <--- 0xF6=Updi_pin_normal, 0xF2=change UPDI pin to GPIO
 CFG_BOOT_FUSE=0x00        # 0x01=256 bytes, 0x02=512 bytes, 0x03=768, ect
    CFG_LKBITS=0xFF        # 0xFF=Locked, 0xC5=UnLocked
   CFG_APP_ENT=0x0000      # entry point for app, if bootloader is 0x02, this would be 0x0200
+# USB bootloader (compile_boot.sh), needs 3K... CFG_BOOT_FUSE=0x0C and CFG_APP_ENT=0x0C00
 
 
 #do NOT exit
@@ -41,7 +41,7 @@
 #define OUT_TGL(prt,pin)      PORTx(prt).OUTTGL = PINx_bm(pin)
 #define OUT_TGLS(prt,pins)    PORTx(prt).OUTTGL = pins
 #define IS_PIN_HI(prt,pin)    (PORTx(prt).IN & BIT(pin))
-#define IS_PINS_HI(prt,pin)   (PORTx(prt).IN & pins)
+#define IS_PINS_HI(prt,pins)  (PORTx(prt).IN & (pins))
 
 ///////////////////////////EEPROM MACROS FOR BUILT IN EEPROM CLASS//////////////////////////////
 #define WriteEE8(a,x)   eeprom_write_byte((uint8_t*)(uint16_t)a,x)    //always writes, only use if speed critical
@@ -28,6 +28,7 @@
 #include <stdio.h>			//snprintf (snprintf uses about 1560 bytes of flash)
 #include "defines.h"
 #include "usb.h"
+#include "sched.h"
 
 //operating freq pg550 (+0.18v for every 1Mhz)
 // 2.7v  10.0Mhz  Operation ensured down to BOD triggering level, V BOD with BODLEVEL2
@@ -77,6 +78,14 @@ static inline void use_16MHz_osc()
 	// VUSB will trim to 16.5MHz	
 }
 
+static inline void use_20MHz_osc()
+{
+	//internal oscillator at 20MHz, OSCCFG fuse must be 0x02 (CFG_OSC in compile_config.sh)
+	//factory calibration is only good to a few %, V-USB trims it to within USB_OSC_BOUND (usb_osc.h)
+	_PROTECTED_WRITE(CLKCTRL_MCLKCTRLB,0x00);            //no prescaler
+	while((CLKCTRL_MCLKSTATUS & CLKCTRL_OSC20MS_bm)==0); //pg88 wait for OSC20MS to become stable
+}
+
 static inline void use_16p5_Mhz_clk()
 {
 	//setup main clk freq to 16MHz, we trim to 16.5MHz later
@@ -97,9 +106,24 @@ static inline void use_16p5_Mhz_clk()
 	_PROTECTED_WRITE(CLKCTRL_OSC20MCALIBA,tmp);	
 }
 
+//application task, runs every 10ms from the scheduler (sched.c), usbPoll() runs before and after it
+static void taskApp()
+{
+	//application work goes here (sampling, processing...), return within the budget in g_Tasks
+	//OUT_TGL(B,1);
+}
+
+//static task table, period in ms (USB frames), budget in CPU cycles per run ('Z' reports runs over it)
+sched_task_t g_Tasks[] =
+{
+	SCHED_TASK(taskApp, 10, 2000),
+};
+
 void main(void) __attribute__((noreturn));  void main(void)
 {
-	#if F_CPU == 12000000 || F_CPU == 16000000 || F_CPU == 18000000 || F_CPU == 20000000
+	#if USB_OSC_TRIM && F_CPU == 20000000
+	use_20MHz_osc();  // V-USB will trim to 20MHz
+	#elif F_CPU == 12000000 || F_CPU == 16000000 || F_CPU == 18000000 || F_CPU == 20000000
 	use_ext_clk();
 	#elif F_CPU == 12800000 || F_CPU == 16500000
 	use_16MHz_osc();  // V-USB will trim to 16.5MHz or 12.8MHz (if you use VUSB in a bootloader, trim CLKCTRL_OSC20MCALIBA in your main app too!)
@@ -122,11 +146,7 @@ void main(void) __attribute__((noreturn));  void main(void)
     usbMyInit();
 	sei();//enable global interrupts (must be done AFTER usbMyInit)
 	
-	for(;;)
-	{
-		//OUT_TGL(B,1);
-        usbMyPolling();	
-	}	
+	schedRun(g_Tasks,sizeof(g_Tasks)/sizeof(g_Tasks[0])); //usbMyPolling() and the tasks, never returns
 
 }
 
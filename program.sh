@@ -31,6 +31,9 @@ fi
 #directories
  HEX_DIR="./out_attiny1614"     
    FLASH="$HEX_DIR/main.hex"      
+if [ "$1" == "boot" ]; then
+   FLASH="./out_boot_attiny1614/boot.hex" # USB bootloader, the app is then flashed with "usb_app -flash-app main.hex"
+fi
   EEPROM="$HEX_DIR/main.eep"     
    
 BTF=$CFG_BOOT_FUSE
@@ -38,6 +41,18 @@ F05=$CFG_FUSE_5
 LKB=$CFG_LKBITS
 OSC=$CFG_OSC
 
+#the internal oscillator only reaches 20MHz with the 20MHz fuse, and 12.8MHz or 16.5MHz with the 16MHz fuse
+if [ "$CFG_EXT_CLK" == "0" ]; then
+if [ "$CFG_F_CPU" == "20000000" ] && [ "$OSC" != "0x02" ]; then
+echo "CFG_F_CPU is 20000000 on the internal oscillator, set CFG_OSC=0x02 in compile_config.sh"
+exit 1
+fi
+if [ "$CFG_F_CPU" != "20000000" ] && [ "$OSC" != "0x01" ]; then
+echo "CFG_F_CPU is $CFG_F_CPU on the internal oscillator, set CFG_OSC=0x01 in compile_config.sh"
+exit 1
+fi
+fi
+
 FUSES=" -fuseW  0 0x00 " # 0x00 = watchdog disable
 FUSES+="-fuseW  1 0x45 " # <--- 0x45 is BOD lvl 2 datasheet says it good to 10MHz, though we run at 3.3v which is good to almost 13MHz
 FUSES+="-fuseW  2 $OSC " # <--- 0x02 = Run at 20MHz, 0x01 = Run at 16MHz
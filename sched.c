@@ -0,0 +1,107 @@
+/////////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL (see License.txt)
+// Date:    08-01-2020
+//
+/////////////////////////////////////////////////////////////////////
+//
+// Cooperative task scheduler, runs application work next to usbPoll()
+//
+// Tasks live in a static table (SCHED_TASK in sched.h), each with a
+// period in ms and a declared worst case of CPU cycles per run.
+// usbMyPolling() runs before the first task and after every task, so
+// the longest time without usbPoll() is one task plus the USB work
+// itself. V-USB wants usbPoll() at least every 50ms. A budget fits 16 bits
+// (about 4ms at 16.5MHz), so a task that keeps to its budget can never
+// come close to that.
+//
+// The timebase is usbSofCount, one count per USB frame. Tasks run at a
+// fixed rate locked to the host's 1ms frames, not to our trimmed
+// oscillator. While there are no SOFs (bus suspended, not yet
+// enumerated) TCA0 keeps the time.
+// TCB1 counts CPU cycles (usbMyInit), and every run is measured against
+// its budget. Runs over budget are counted, and 'Z' reports them.
+// Each task is marked as a usbPoll() call site (USB_POLL_SITE), so a
+// late usbPoll() that 'L' reports names the task that held it up.
+//
+/////////////////////////////////////////////////////////////////////
+
+#include <avr/io.h>
+#include "defines.h"
+#include "usbdrv.h"
+#include "usb.h"
+#include "sched.h"
+
+//-----------------GLOBAL VARIABLES-------------------------
+sched_task_t* g_SchedTasks = 0; //task table given to schedRun()
+U8  g_SchedCnt = 0;  //tasks in the table
+U16 g_SchedMs = 0;   //ms count, one per USB frame
+U8  g_SchedSof = 0;  //usbSofCount the ms count was last moved to
+U16 g_SchedTca = 0;  //TCA0 count at that time, keeps the time when there are no SOFs
+//----------------------------------------------------------
+
+//ms count, moved on by the SOFs since the last call, the main loop must come by within 255ms
+U16 schedMs()
+{
+	U8  n = usbSofCount;
+	U16 t = TCA0_SINGLE_CNT;
+	if(n != g_SchedSof)
+	{
+		g_SchedMs += (U8)(n - g_SchedSof);
+		g_SchedSof = n;
+		g_SchedTca = t;
+	}
+	else if((U16)(t - g_SchedTca) >= 2 * USB_TICKS_PER_MS) //a SOF is overdue, no frames on the bus
+	{
+		g_SchedMs++;
+		g_SchedTca += USB_TICKS_PER_MS;
+	}
+	return g_SchedMs;
+}
+
+//TCB1 count, the USB interrupt reads TCB1 too (usbSofHook) and that changes the latched high byte,
+//so read until two reads are close, this never disables interrupts
+static inline U16 schedCycles()
+{
+	U16 a, b;
+	do{ a = TCB1_CNT; b = TCB1_CNT; }while((U16)(b - a) > 32);
+	return a;
+}
+
+U8 schedCount(){ return g_SchedCnt; }
+sched_task_t* schedTask(U8 i){ return i < g_SchedCnt ? &g_SchedTasks[i] : 0; }
+
+void schedRun(sched_task_t* tasks, U8 cnt)
+{
+	g_SchedTasks = tasks;
+	g_SchedCnt = cnt;
+	g_SchedSof = usbSofCount;
+	g_SchedTca = TCA0_SINGLE_CNT;
+	U16 now = schedMs();
+	for(U8 i=0; i<cnt; i++){ tasks[i].due = now + tasks[i].period; }
+	
+	for(;;)
+	{
+		usbMyPolling();
+		for(U8 i=0; i<cnt; i++)
+		{
+			sched_task_t* t = &tasks[i];
+			now = schedMs();
+			if((I16)(now - t->due) < 0){ continue; } //not due yet
+			if(t->period && (U16)(now - t->due) >= t->period) //a whole period behind, drop the missed runs instead of running them back to back
+			{
+				t->due = now;
+				if(t->skip != 0xFF){ t->skip++; }
+			}
+			t->due += t->period;
+			USB_POLL_SITE(USB_SITE_TASK | i); //a late usbPoll() is blamed on the task
+			U16 c0 = schedCycles();
+			t->run();
+			U16 c = schedCycles() - c0;
+			if(c > t->worst){ t->worst = c; }
+			if(c > t->budget && t->over != 0xFF){ t->over++; }
+			usbMyPolling(); //after every task, two tasks never run without usbPoll() in between
+		}
+	}
+}
@@ -0,0 +1,29 @@
+#ifndef __sched_h_included__
+#define __sched_h_included__
+
+#include "defines.h"
+
+//cooperative task scheduler, the USB frame (SOF, 1ms) is the timebase, see sched.c
+
+typedef struct
+{
+	void (*run)(void); //the task, must return within budget
+	U16 period;        //ms (USB frames) from one run to the next
+	U16 budget;        //declared worst case CPU cycles of one run, up to 65535 (about 4ms at 16.5MHz)
+	//filled in by the scheduler
+	U16 due;           //ms count of the next run
+	U16 worst;         //longest run seen, CPU cycles
+	U8  over;          //runs longer than budget, saturates at 255
+	U8  skip;          //runs dropped because the task fell a whole period behind, saturates at 255
+} sched_task_t;
+
+//entry of a static task table
+#define SCHED_TASK(fn,period_ms,budget_cycles)  { fn, period_ms, budget_cycles, 0, 0, 0, 0 }
+
+//functions
+void schedRun(sched_task_t* tasks, U8 cnt) __attribute__((noreturn)); //main loop, usbMyPolling() and the tasks, never returns
+U8 schedCount();                                                      //tasks in the table
+sched_task_t* schedTask(U8 i);                                        //task i of the table
+U16 schedMs();                                                        //ms count, USB frames
+
+#endif
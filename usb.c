@@ -1,5 +1,7 @@
 
 #include "usb.h"
+#include "usb_osc.h"
+#include "sched.h"
 
 //extern PROGMEM const char usbDescriptorHidReport[];
 //extern PROGMEM const char usbDescriptorConfiguration[];
@@ -9,15 +11,16 @@
 //#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH 34 //sizeof(usbDescriptorHidReport)
 PROGMEM const char usbDescriptorHidReport[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = { 
 	#define USB_CFG_EP1_NUMBER      1    //EP3 number is defined in usbconfig.h, EP1 is 1, and defined here for custom descriptors below
+	#define USB_CFG_EPOUT_NUMBER    2    //interrupt OUT endpoint for commands, shares the number of EP3 (0x02 OUT and 0x82 IN are different endpoints)
 	#define MY_EN1_REPORT_CNT       8    //number of bytes in endpoint1 interrupt transfer if one is used
-	#define MY_EN3_REPORT_CNT       8    //number of bytes in endpoint3 interrupt transfer if one is used
+	#define MY_OUT_REPORT_CNT       8    //number of bytes in the interrupt OUT transfer
 	#define USB_CFG_ENDPOINT1_TYPE  0x80 //(default)ReportIn=0x80[PC_RECV]   ReportOut=0x00[PC_XMT]
-	#define USB_CFG_ENDPOINT3_TYPE  0x00 //(default)ReportIn=0x80[PC_RECV]   ReportOut=0x00[PC_XMT]	
+	#define USB_CFG_ENDPOINT3_TYPE  0x80 //(default)ReportIn=0x80[PC_RECV]   ReportOut=0x00[PC_XMT], streaming telemetry, see usbPollStream()
 	//[Endpoint 0] 
 	0x06, 0xa0, 0xff, // USAGE_PAGE (Vendor Defined Page 1)
 	0x09, 0x01,       // USAGE (Vendor Usage 1)
 	0xa1, 0x01,       // COLLECTION (Application)
-	//[Endpoint 1] Interrupt-In (used to send data to the host spontaneously)
+	//[Endpoint 1 and 3] Interrupt-In (used to send data to the host spontaneously)
 	// Input Report [PC receives data from AVR]
 	0x09, 0x02,       // Usage ID - vendor defined usage2
 	0x15, 0x00,       // Logical Minimum (0)
@@ -29,20 +32,14 @@ PROGMEM const char usbDescriptorHidReport[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
 	#else
 	0x81, 0x02,       // Input (Data, Variable, Absolute) //0x81=PC_RECV 0x91=PC_XMT
 	#endif
-	#if USB_CFG_HAVE_INTRIN_ENDPOINT3 == 1
 	//[Endpoint 2] Interrupt-Out
 	// Output Report [PC sends data to AVR]
 	0x09, 0x03,       // Usage ID - vendor defined usage3
 	0x15, 0x00,       // Logical Minimum (0)
 	0x26, 0xFF, 0x00, // Logical Maximum (255)
 	0x75, 0x08,       // Report Size (8 bits)
-	0x95, MY_EN3_REPORT_CNT,  // Report Count (8 fields)
-		#if USB_CFG_ENDPOINT3_TYPE == 0x00 //set report type
-		0x91, 0x02,       // Output (Data, Variable, Absolute) //0x81=PC_RECV 0x91=PC_XMT
-		#else
-		0x81, 0x02,       // Input (Data, Variable, Absolute) //0x81=PC_RECV 0x91=PC_XMT
-		#endif
-	#endif
+	0x95, MY_OUT_REPORT_CNT,  // Report Count (8 fields)
+	0x91, 0x02,       // Output (Data, Variable, Absolute) //0x81=PC_RECV 0x91=PC_XMT
 	0xc0              // END_COLLECTION
 };
 
@@ -54,7 +51,7 @@ PROGMEM const char usbDescriptorConfiguration[USB_CFG_DESCR_PROPS_CONFIGURATION]
 	#define USBDESCR_ENDPOINT   5 //also defined in usbdrv.h, need here for custom descriptor
     9,                // sizeof(usbDescriptorConfiguration): length of descriptor in bytes 
     USBDESCR_CONFIG,  // descriptor type 
-    18 + 7 * USB_CFG_HAVE_INTRIN_ENDPOINT + 7 * USB_CFG_HAVE_INTRIN_ENDPOINT3 +
+    18 + 7 * USB_CFG_HAVE_INTRIN_ENDPOINT + 7 * USB_CFG_HAVE_INTRIN_ENDPOINT3 + 7 +
                 (USB_CFG_DESCR_PROPS_HID & 0xff), 0,
                 // total length of data returned (including inlined descriptors) 
     1,          // number of interfaces in this configuration 
@@ -71,7 +68,7 @@ PROGMEM const char usbDescriptorConfiguration[USB_CFG_DESCR_PROPS_CONFIGURATION]
     USBDESCR_INTERFACE, // descriptor type 
     0,          // index of this interface 
     0,          // alternate setting for this interface 
-    USB_CFG_HAVE_INTRIN_ENDPOINT + USB_CFG_HAVE_INTRIN_ENDPOINT3, // endpoints excl 0: number of endpoint descriptors to follow 
+    USB_CFG_HAVE_INTRIN_ENDPOINT + USB_CFG_HAVE_INTRIN_ENDPOINT3 + 1, // endpoints excl 0: number of endpoint descriptors to follow (+1 interrupt OUT)
     USB_CFG_INTERFACE_CLASS,
     USB_CFG_INTERFACE_SUBCLASS,
     USB_CFG_INTERFACE_PROTOCOL,
@@ -101,6 +98,13 @@ PROGMEM const char usbDescriptorConfiguration[USB_CFG_DESCR_PROPS_CONFIGURATION]
     8, 0,       // maximum packet size 
     USB_CFG_INTR_POLL_INTERVAL, // in ms 
 #endif
+    // endpoint descriptor for the interrupt OUT endpoint, V-USB hands OUT data of any endpoint to usbFunctionWriteOut()
+    7,          // sizeof(usbDescrEndpoint) 
+    USBDESCR_ENDPOINT,  // descriptor type = endpoint 
+    (char)USB_CFG_EPOUT_NUMBER, // OUT endpoint 
+    0x03,       // attrib: Interrupt endpoint 
+    8, 0,       // maximum packet size 
+    USB_CFG_INTR_POLL_INTERVAL, // in ms 
 };
 //----------------------------------------------------------------------
 
@@ -113,97 +117,890 @@ PROGMEM const char usbDescriptorConfiguration[USB_CFG_DESCR_PROPS_CONFIGURATION]
 
 //-----------------GLOBAL VARIABLES-------------------------
 #define USB_REPORT_CNT 0x08 //size of 8 bytes is max for low speed usb
-volatile U8 g_UsbBuf[USB_REPORT_CNT];// = {1,2,3,4,5,6,7,8};
+#define USB_BLK_DATA   (USB_REPORT_CNT-2) //block read data bytes per report, byte0='B', byte1=address of first data byte
+#define USB_PACK_PAIRS 3    //'P' packed write, address/value pairs per report
+#define USB_DELTA_CNT  5    //'D' delta write, values per report
+#define USB_FRM_MAX    EEPROM_PAGE_SIZE //'F' framed write, largest frame, one EEPROM page
+#define USB_FRM_FIRST  (USB_REPORT_CNT-3) //data bytes in the 'F' start report
+#define USB_FRM_NEXT   (USB_REPORT_CNT-1) //data bytes in each '+' continuation report
+#define USB_RSP_CNT    8    //response queue entries, must be a power of 2
+#define USB_RSP_MASK   (USB_RSP_CNT-1)
+U8  g_RspBuf[USB_RSP_CNT][USB_REPORT_CNT]; //response queue, filled by usbFunctionWriteOut, drained by usbPollSendtoHost
+U8  g_RspHead = 0; //next entry to fill, free running, entry is g_RspHead & USB_RSP_MASK
+U8  g_RspTail = 0; //next entry to send, queue is empty when head == tail
+U8  g_HeldCmd[USB_REPORT_CNT]; //command that found the queue full, runs as soon as an entry is sent (g_HeldCmd[0] = 0 when none)
+U16 g_RspFull = 0; //times a command was held because the queue was full
+U16 g_RspLost = 0; //commands dropped because another command was already held
+U8  g_BlkAdr = 0; //block read, next EEPROM address to send
+U16 g_BlkCnt = 0; //block read, bytes left to send (0 = no block read active)
+U16 g_MemAdr = 0; //memory read, next data space address to send
+U16 g_MemCnt = 0; //memory read, bytes left to send (0 = no memory read active)
+U8  g_UsbState = 0; //readiness flags reported by the 'S' command, see USB_ST_xxx
+U16 g_UsbNonce __attribute__((section(".noinit"))); //session nonce, random RAM contents at power up, changes on every USB reset
+#define USB_ST_CALIBRATED  0x01 //oscillator calibrated (always set when using external clk)
+#define USB_ST_EE_READY    0x02 //EEPROM is not busy writing
+#define USB_ST_OSC_OFF     0x04 //oscillator is further than USB_OSC_BOUND from F_CPU, the closest CAL20M step is not close enough, expect retries
+#define USB_ST_POLL_LATE   0x08 //a gap between usbPoll() calls passed the 'L' threshold, cleared by 'L'
+#define USB_ST_READY       (USB_ST_CALIBRATED | USB_ST_EE_READY)
+#define USB_RQ_EE_READ     0x01 //vendor control request, read EEPROM block, wValue=address, wLength=count (up to 256)
+#define USB_RQ_EE_WRITE    0x02 //vendor control request, write EEPROM block, wValue=address, wLength=count (up to 256)
+U16 g_CtlAdr = 0; //control transfer, next EEPROM address
+U16 g_CtlCnt = 0; //control transfer, bytes left
+U8  g_FrmBuf[USB_FRM_MAX]; //framed write, reassembly buffer
+U8  g_FrmAdr = 0; //framed write, EEPROM address of the first byte
+U8  g_FrmLen = 0; //framed write, total bytes (0 = no frame open)
+U8  g_FrmPos = 0; //framed write, bytes received
+#define USB_EE_CNT     64   //pending EEPROM writes, must be a power of 2, room for a whole frame while a page is busy
+#define USB_EE_MASK    (USB_EE_CNT-1)
+U8  g_EeAdr[USB_EE_CNT]; //pending EEPROM writes, address
+U8  g_EeVal[USB_EE_CNT]; //pending EEPROM writes, value
+U8  g_EeHead = 0; //next entry to fill, free running, entry is g_EeHead & USB_EE_MASK
+U8  g_EeTail = 0; //oldest entry, queue is empty when head == tail
+U8  g_EeBusy = 0; //entries from the tail that are in the page being written, removed when the NVM is done
+U8  g_EePeak = 0; //most EEPROM writes ever queued
+U8  g_RspPeak = 0; //most responses ever queued
+U8  g_FlowOff = 0; //host requests are NAKed (usbDisableAllRequests)
+U16 g_FlowStalls = 0; //times requests were disabled
+U32 g_FlowTicks = 0; //time requests were disabled, in TCA0 ticks
+U16 g_FlowT0 = 0; //TCA0 count when requests were disabled
+#define USB_CRC_CHUNK  32   //'K' range CRC, bytes per main loop pass, keeps usbPoll() on time
+#define USB_SPACE_EE   0    //'K' memory space, EEPROM
+#define USB_SPACE_FLASH 1   //'K' memory space, flash (mapped program memory)
+#define USB_SPACE_BAD  0xFF //'K' response space, the requested space is unknown, no CRC
+U8  g_KRq[USB_REPORT_CNT]; //range CRC request ('K' or 'C'), echoed in the response
+U8  g_KSpace = 0; //range CRC memory space, USB_SPACE_xxx
+U8  g_KBusy = 0; //range CRC running, or waiting for a response entry
+U16 g_KPtr = 0;  //range CRC, next data space address
+U16 g_KLeft = 0; //range CRC, bytes left
+U16 g_KCrc = 0;  //range CRC so far
+U8  g_JumpBoot = 0; //'J' was accepted, reset into the bootloader once the response is sent
+#define USB_STR_CNT    64   //'T' streaming telemetry, sample ring, must be a power of 2
+#define USB_STR_MASK   (USB_STR_CNT-1)
+#define USB_STR_DATA   (USB_REPORT_CNT-3) //samples per report, byte0='V', byte1=report sequence, byte2=samples dropped before this report
+#define USB_STR_MUX    ADC_MUXPOS_AIN6_gc //sampled input, PA6
+#define USB_STR_MIN_HZ ((F_CPU/2)/65536 + 1) //slowest sample rate, the TCB0 period (CPU clock / 2) must fit 16 bits, 98Hz at 12.8MHz, 126Hz at 16.5MHz, 153Hz at 20MHz
+#define USB_STR_MAX_HZ 10000 //fastest sample rate, keeps the TCB0 interrupt from starving the main loop and usbPoll(), far more than two IN endpoints carry
+volatile U8 g_StrBuf[USB_STR_CNT]; //samples, filled by the TCB0 interrupt, drained into reports by usbPollStream()
+volatile U8 g_StrHead = 0; //next sample to fill, free running, only written by the TCB0 interrupt
+volatile U8 g_StrDrop = 0; //samples dropped since the last report (ring full), saturates at 255
+U8  g_StrTail = 0; //next sample to send
+U8  g_StrOn = 0;   //streaming is running
+U8  g_StrSeq = 0;  //report sequence, the host puts reports from both IN endpoints back in order with it
+U8  g_StrEp = 0;   //endpoint tried first for the next report, 0 = EP1, 1 = EP3, alternates
+U16 g_StrLost = 0; //samples dropped since streaming started
+U32 g_StrCnt = 0;  //samples sent since streaming started
+#define USB_GPIO_USB_A (BIT(USB_CFG_DMINUS_BIT) | BIT(USB_CFG_DPLUS_BIT)) //'G' can not watch the USB pins
+U8  g_GpioMaskA = 0; //'G' pin change notifications, subscribed PORTA pins
+U8  g_GpioMaskB = 0; //subscribed PORTB pins
+U8  g_GpioA = 0;     //last seen state of the subscribed pins
+U8  g_GpioB = 0;
+U8  g_GpioChgA = 0;  //pins that changed since the last 'E' report (coalesced)
+U8  g_GpioChgB = 0;
+U8  g_GpioCnt = 0;   //changes seen since the last 'E' report, saturates at 255 (0 = nothing to send)
+U16 g_GpioTs = 0;    //TCA0 count at the first change since the last 'E' report
+#define USB_OSC_SAVE   1    //g_OscSave, write the calibration in use to USERROW
+#define USB_OSC_FORGET 2    //g_OscSave, erase it, the next power up searches from the factory value
+U8  g_OscSave = 0;      //USERROW calibration write pending, USB_OSC_xxx (0 = none), usbPollOscSave() does it
+U8  g_OscReconnect = 0; //'O' asked to leave the bus and enumerate again, done once the response is sent
+U8  g_OscSteps = 0;     //frame measurements made by calibrations since the last 'O', saturates at 255
+U16 g_OscTicks = 0;     //time spent calibrating since the last 'O', TCA0 ticks
+#define USB_SOF_TRACK  USB_OSC_TRIM //internal oscillator, track its drift against the SOF (usbPollSof)
+#define USB_SOF_CYCLES (F_CPU/1000) //CPU cycles per USB frame, TCB1 counts these
+#define USB_SOF_SPAN   3    //most frames between two SOFs the tracker takes, TCB1 is 16 bits
+#define USB_SOF_ODD    (USB_SOF_CYCLES/32) //frames off by more than 3% were delayed by a cli() or a long interrupt, not drift
+#define USB_SOF_NUDGE  (USB_SOF_CYCLES/200) //filtered error that moves CAL20M one step, 0.5%, about half a step
+#define USB_SOF_SETTLE 64   //frames skipped after a CAL20M step or a USB reset
+#define USB_SOF_HIST   24   //drift history entries, must be a multiple of USB_SOF_BLK
+#define USB_SOF_BLK    (USB_REPORT_CNT-2) //history entries per 'H' report
+#define USB_SOF_EVERY  1024 //frames per history entry, about a second
+volatile U16 usbSofTicks; //TCB1 count at the last SOF, stored by usbSofHook (usbconfig.h) in the USB interrupt
+U8  g_SofSeen = 0;      //usbSofCount at the last SOF the tracker took
+U16 g_SofPrev = 0;      //TCB1 count at that SOF
+I16 g_SofErr = 0;       //filtered frame length error, CPU cycles * 16, positive when the clock is fast
+U8  g_SofSettle = 0;    //frames to skip before the error counts again
+U16 g_SofFrames = 0;    //frames since the last history entry
+U8  g_SofNudges = 0;    //CAL20M steps made, saturates at 255
+I8  g_SofHist[USB_SOF_HIST]; //drift history, filtered error in CPU cycles per frame, saturated, g_SofHistPos is the oldest once full
+U8  g_SofHistPos = 0;   //next history entry to fill
+U8  g_SofHistCnt = 0;   //history entries filled
+#if USB_POLL_STATS
+#define USB_POLL_BINS  16   //gap histogram, bin 0 is under a tick, bin n holds 2^(n-1) up to 2^n TCA0 ticks, the last bin everything longer
+#define USB_POLL_BLK   2    //bins per 'L' report, 24 bit counts
+#define USB_POLL_ALARM 25   //default alarm threshold, ms, half of what V-USB allows between usbPoll() calls
+#define USB_POLL_SAT   0xFFFFFFUL //bin counts saturate here
+U32 g_PollHist[USB_POLL_BINS]; //gaps between usbPoll() calls
+U16 g_PollLast = 0;     //TCA0 count at the last usbPoll()
+U8  g_PollRun = 0;      //g_PollLast is valid, cleared where the main loop stops on purpose (usbReconnect)
+U16 g_PollWorst = 0;    //longest gap, TCA0 ticks
+U8  g_PollWorstSite = 0;//USB_SITE_xxx blamed for it
+U8  g_PollAlarms = 0;   //gaps past the threshold, saturates at 255
+U8  g_PollAlarmMs = USB_POLL_ALARM; //threshold, ms, 'L' sets it
+U8  g_PollSite = 0;     //USB_SITE_xxx running now
+U16 g_PollSiteT = 0;    //TCA0 count when it started
+U16 g_PollSpan = 0;     //longest stretch of one site since the last usbPoll(), TCA0 ticks
+U8  g_PollSpanSite = 0; //its site
+#endif
 //----------------------------------------------------------
 
+//EEPROM write engine
+//writes are queued, and usbPollEeprom() commits them from the main loop one page at a time,
+//so the USB interrupt is never held off while the NVM works, and bytes for the same page
+//that arrive while the previous page is busy are written with a single erase/write cycle
+
+//value of an EEPROM byte, including writes that are still queued
+static U8 usbEeRead(U8 adr)
+{
+	for(U8 i=g_EeHead; i!=g_EeTail; ) //newest first
+	{
+		i--;
+		if(g_EeAdr[i & USB_EE_MASK] == adr){ return g_EeVal[i & USB_EE_MASK]; }
+	}
+	return ReadEE8(adr);
+}
+
+//start writing the page of the oldest queued byte, when the NVM is free
+static void usbPollEeprom()
+{
+	if(NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm){ return; } //previous page still writing
+	g_EeTail += g_EeBusy; //previous page is done
+	g_EeBusy = 0;
+	if(g_EeHead == g_EeTail){ return; }
+	
+	//every queued byte of the oldest byte's page goes in this page cycle, wherever it is in the queue
+	//they are moved down to the tail in order, bytes of other pages move up and keep their order
+	//(only bytes of different addresses change places, so usbEeRead() still finds the newest write first)
+	U8  page = g_EeAdr[g_EeTail & USB_EE_MASK] & ~(EEPROM_PAGE_SIZE-1);
+	U8  w = g_EeTail; //end of the page's bytes
+	for(U8 i=g_EeTail; i!=g_EeHead; i++)
+	{
+		U8 adr = g_EeAdr[i & USB_EE_MASK];
+		if((adr & ~(EEPROM_PAGE_SIZE-1)) != page){ continue; }
+		U8 val = g_EeVal[i & USB_EE_MASK];
+		for(U8 k=i; k!=w; k--)
+		{
+			g_EeAdr[k & USB_EE_MASK] = g_EeAdr[(U8)(k-1) & USB_EE_MASK];
+			g_EeVal[k & USB_EE_MASK] = g_EeVal[(U8)(k-1) & USB_EE_MASK];
+		}
+		g_EeAdr[w & USB_EE_MASK] = adr;
+		g_EeVal[w & USB_EE_MASK] = val;
+		w++;
+	}
+	
+	//load the page buffer newest first, the last write of each byte wins
+	//(reads of the EEPROM see the array, not the page buffer, so an older write must never be loaded)
+	U32 loaded = 0; //bit per byte of the page
+	U8  load = 0;   //any byte differs from the EEPROM
+	for(U8 i=w; i!=g_EeTail; )
+	{
+		i--;
+		U8 adr = g_EeAdr[i & USB_EE_MASK];
+		U8 val = g_EeVal[i & USB_EE_MASK];
+		U32 bit = 1UL << (adr & (EEPROM_PAGE_SIZE-1));
+		if(loaded & bit){ continue; } //older write of a loaded byte
+		loaded |= bit;
+		volatile U8* ee = (volatile U8*)(EEPROM_START + adr);
+		if(*ee != val){ *ee = val; load = 1; } //memory mapped store goes to the page buffer, unchanged bytes are skipped
+	}
+	g_EeBusy = w - g_EeTail;
+	if(load){ _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA,NVMCTRL_CMD_PAGEERASEWRITE_gc); } //only loaded bytes are erased and written
+}
+
+//queue one EEPROM write, the caller runs from usbPoll(), so waiting for room here makes the driver NAK the host
+static void usbEeWrite(U8 adr, U8 val)
+{
+	while((U8)(g_EeHead - g_EeTail) >= USB_EE_CNT){ usbPollEeprom(); } //full, wait for a page to finish
+	g_EeAdr[g_EeHead & USB_EE_MASK] = adr;
+	g_EeVal[g_EeHead & USB_EE_MASK] = val;
+	g_EeHead++;
+	if((U8)(g_EeHead - g_EeTail) > g_EePeak){ g_EePeak = g_EeHead - g_EeTail; }
+}
+
+//keep the calibration in USERROW (see usb_osc.h), the next power up then needs one measurement
+//USERROW shares the page buffer and EEBUSY with the EEPROM, so this runs between EEPROM pages
+static void usbPollOscSave()
+{
+	if(!g_OscSave || (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm)){ return; }
+	volatile U8* p = (volatile U8*)USB_OSC_UROW;
+	if(g_OscSave == USB_OSC_SAVE)
+	{
+		p[0] = g_Osc.cal; p[1] = ~g_Osc.cal;
+		p[2] = USB_OSC_TARGET & 0xFF; p[3] = USB_OSC_TARGET >> 8; //F_CPU it was found for
+	}
+	else { p[0] = p[1] = p[2] = p[3] = 0xFF; }
+	_PROTECTED_WRITE_SPM(NVMCTRL.CTRLA,NVMCTRL_CMD_PAGEERASEWRITE_gc); //only loaded bytes are erased and written
+	g_OscSave = 0;
+}
+
+//build the next block read report, and send it
+static inline void usbPollSendBlock()
+{
+	U8 buf[USB_REPORT_CNT];
+	buf[0] = 'B';
+	buf[1] = g_BlkAdr; //echo address of first data byte, so host can detect missing reports
+	for(U8 i=0; i<USB_BLK_DATA; i++)
+	{
+		if(g_BlkCnt){ buf[2+i] = usbEeRead(g_BlkAdr); g_BlkAdr++; g_BlkCnt--; } //U8 address wraps at 256
+		else        { buf[2+i] = 0xFF; } //pad last report
+	}
+	usbSetInterrupt(buf,USB_REPORT_CNT);
+}
+
+//one byte of the data space for 'M', peripherals whose registers change state when read come back as 0...
+//data registers pop a FIFO or start a bus transaction (USART0, TWI0, SPI0), result registers clear their flag (ADC),
+//and 16 bit registers latch TEMP (timers and RTC, TCA0, TCB0 and TCB1 keep our timebase and the SOF tracker)
+#define USB_MEM_SKIP(per,adr) ((U16)((adr) - (U16)&(per)) < sizeof(per))
+static inline U8 usbMemRead(U16 adr)
+{
+	if(adr < 0x1000 &&
+	  (USB_MEM_SKIP(RTC,adr) || USB_MEM_SKIP(ADC0,adr) || USB_MEM_SKIP(USART0,adr) || USB_MEM_SKIP(TWI0,adr) || USB_MEM_SKIP(SPI0,adr) ||
+	   USB_MEM_SKIP(TCA0,adr) || USB_MEM_SKIP(TCB0,adr) || USB_MEM_SKIP(TCB1,adr) || USB_MEM_SKIP(TCD0,adr)
+	   #ifdef ADC1
+	   || USB_MEM_SKIP(ADC1,adr)
+	   #endif
+	  )){ return 0; }
+	return *(volatile U8*)adr; //volatile, I/O registers are read one at a time
+}
+
+//build the next memory read report, and send it
+//the data space holds I/O at 0x0000, SIGROW 0x1100, FUSES 0x1280, USERROW 0x1300, EEPROM 0x1400, SRAM 0x3800, flash 0x8000
+static inline void usbPollSendMem()
+{
+	U8 buf[USB_REPORT_CNT];
+	buf[0] = 'M';
+	buf[1] = g_MemAdr & 0xFF; //low byte of the first data byte address, host knows the high byte from the order of reports
+	for(U8 i=0; i<USB_BLK_DATA; i++)
+	{
+		if(g_MemCnt){ buf[2+i] = usbMemRead(g_MemAdr); g_MemAdr++; g_MemCnt--; }
+		else        { buf[2+i] = 0xFF; } //pad last report
+	}
+	usbSetInterrupt(buf,USB_REPORT_CNT);
+}
+
+//next free response entry, 0 when the queue is full
+static inline U8* usbRspAlloc()
+{
+	if((U8)(g_RspHead - g_RspTail) >= USB_RSP_CNT){ return 0; }
+	U8* rsp = g_RspBuf[g_RspHead & USB_RSP_MASK];
+	for(U8 i=0; i<USB_REPORT_CNT; i++){ rsp[i] = 0; }
+	return rsp;
+}
+
+//the entry from usbRspAlloc() is filled in, queue it
+static inline void usbRspPush()
+{
+	g_RspHead++;
+	if((U8)(g_RspHead - g_RspTail) > g_RspPeak){ g_RspPeak = g_RspHead - g_RspTail; }
+}
+
+//start a range CRC, usbPollCrc() works through it between usbPoll() calls
+//'K' takes any range of a memory space, 'C' an EEPROM range of up to 256 bytes (count 0 = 256)
+//same CRC as USB data packets (poly 0xA001, init 0xFFFF, inverted), 0 is the CRC of no data
+//the range is clipped to the memory space, the response echoes the request
+static void usbCrcStart(U8* data)
+{
+	U16 adr = data[1] | (data[2] << 8);
+	U16 cnt = data[3] | (data[4] << 8);
+	U8  space = data[5];
+	if(data[0] == 'C'){ adr = data[1]; cnt = data[2] ? data[2] : 256; space = USB_SPACE_EE; }
+	U16 start = EEPROM_START;
+	U16 size = EEPROM_SIZE;
+	if(space == USB_SPACE_FLASH){ start = MAPPED_PROGMEM_START; size = MAPPED_PROGMEM_SIZE; }
+	if(adr >= size){ cnt = 0; }
+	else if(cnt > size - adr){ cnt = size - adr; }
+	for(U8 i=0; i<USB_REPORT_CNT; i++){ g_KRq[i] = data[i]; }
+	g_KSpace = space;
+	g_KPtr = start + adr;
+	g_KLeft = cnt;
+	g_KCrc = 0;
+	g_KBusy = 1;
+}
+
+//next chunk of a range CRC, or queue its response once done
+//an EEPROM CRC waits here, in the main loop, for queued writes to go in first, usbPoll() is never held up by it
+static void usbPollCrc()
+{
+	if(!g_KBusy){ return; }
+	if(g_KSpace == USB_SPACE_EE && (g_EeHead != g_EeTail || (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm))){ return; } //queued writes go in first
+	if(g_KLeft)
+	{
+		U8 n = (g_KLeft > USB_CRC_CHUNK) ? USB_CRC_CHUNK : g_KLeft;
+		g_KCrc = usbCrc16Continue(g_KPtr,n,g_KCrc); //uses the driver's usbCrc16 on the memory mapped space
+		g_KPtr += n;
+		g_KLeft -= n;
+		return;
+	}
+	U8* rsp = usbRspAlloc();
+	if(!rsp){ return; } //try again once an entry is sent
+	if(g_KRq[0] == 'C') //'C', address, count, CRC lo, CRC hi
+	{
+		rsp[0] = 'C'; rsp[1] = g_KRq[1]; rsp[2] = g_KRq[2];
+		rsp[3] = g_KCrc & 0xFF; rsp[4] = g_KCrc >> 8;
+	}
+	else
+	{
+		for(U8 i=0; i<5; i++){ rsp[i] = g_KRq[i]; }
+		rsp[5] = g_KCrc & 0xFF; rsp[6] = g_KCrc >> 8; rsp[7] = g_KRq[5];
+	}
+	usbRspPush();
+	g_KBusy = 0;
+}
+
+//add frame data, when the frame is complete queue it for the EEPROM and fill in the response
+//response is 'F', address, length, CRC lo, CRC hi of the reassembled data
+static void usbFrameAdd(U8* data, U8 cnt, U8* rsp)
+{
+	for(U8 i=0; i<cnt && g_FrmPos<g_FrmLen; i++){ g_FrmBuf[g_FrmPos++] = data[i]; }
+	if(g_FrmPos < g_FrmLen){ return; }
+	U16 crc = usbCrc16Continue(g_FrmBuf,g_FrmLen,0); //same CRC as 'C'
+	for(U8 i=0; i<g_FrmLen; i++){ usbEeWrite(g_FrmAdr+i,g_FrmBuf[i]); }
+	rsp[0] = 'F'; rsp[1] = g_FrmAdr; rsp[2] = g_FrmLen; rsp[3] = crc & 0xFF; rsp[4] = crc >> 8;
+	g_FrmLen = 0;
+}
+
+//streaming telemetry
+//TCB0 samples the ADC at a fixed rate into a RAM ring, the main loop packs USB_STR_DATA samples per report
+//and sends them on EP1 and EP3 in turn, so one endpoint is sending while the next report is built for the other.
+//the USB interrupt is level 1 (see usbMyInit) so the sampler never delays it.
+ISR(TCB0_INT_vect)
+{
+	TCB0_INTFLAGS = TCB_CAPT_bm;
+	U8 h = g_StrHead;
+	if((U8)(h - g_StrTail) >= USB_STR_CNT){ if(g_StrDrop != 0xFF){ g_StrDrop++; } return; } //ring full, sample is lost
+	g_StrBuf[h & USB_STR_MASK] = ADC0_RES & 0xFF; //8 bit result, freerunning conversion
+	g_StrHead = h + 1;
+}
+
+//start or stop the sampler, rate in Hz
+static void usbStreamStart(U16 rate)
+{
+	TCB0_CTRLA = 0;
+	TCB0_INTCTRL = 0;
+	g_StrOn = 0;
+	if(!rate){ ADC0_CTRLA = 0; return; }
+	if(rate < USB_STR_MIN_HZ){ rate = USB_STR_MIN_HZ; }
+	if(rate > USB_STR_MAX_HZ){ rate = USB_STR_MAX_HZ; }
+	ADC0_CTRLC = ADC_REFSEL_VDDREF_gc | ADC_PRESC_DIV16_gc;
+	ADC0_MUXPOS = USB_STR_MUX;
+	ADC0_CTRLA = ADC_ENABLE_bm | ADC_FREERUN_bm | ADC_RESSEL_bm; //8 bit, the sampler takes the latest result
+	ADC0_COMMAND = ADC_STCONV_bm;
+	g_StrTail = g_StrHead; //drop old samples
+	g_StrDrop = 0; g_StrLost = 0; g_StrCnt = 0; g_StrSeq = 0; g_StrEp = 0;
+	TCB0_CCMP = (F_CPU / 2) / rate - 1;
+	TCB0_CNT = 0;
+	TCB0_CTRLB = TCB_CNTMODE_INT_gc; //periodic interrupt
+	TCB0_INTFLAGS = TCB_CAPT_bm;
+	TCB0_INTCTRL = TCB_CAPT_bm;
+	TCB0_CTRLA = TCB_CLKSEL_CLKDIV2_gc | TCB_ENABLE_bm;
+	g_StrOn = 1;
+}
+
+//send the next report of samples on whichever IN endpoint is free, EP1 only when it has no other traffic
+static inline void usbPollStream()
+{
+	if(!g_StrOn || (U8)(g_StrHead - g_StrTail) < USB_STR_DATA){ return; }
+	U8 ep1 = usbInterruptIsReady() && g_RspHead == g_RspTail && !g_GpioCnt && !g_BlkCnt && !g_MemCnt;
+	U8 ep3 = usbInterruptIsReady3();
+	if(!ep1 && !ep3){ return; } //both busy, samples wait in the ring
+	U8 buf[USB_REPORT_CNT];
+	buf[0] = 'V';
+	buf[1] = g_StrSeq++;
+	ATOMIC_BLOCK(ATOMIC_FORCEON){ buf[2] = g_StrDrop; g_StrDrop = 0; }
+	g_StrLost += buf[2];
+	for(U8 i=0; i<USB_STR_DATA; i++){ buf[3+i] = g_StrBuf[g_StrTail & USB_STR_MASK]; g_StrTail++; }
+	g_StrCnt += USB_STR_DATA;
+	if(ep3 && (g_StrEp || !ep1)){ usbSetInterrupt3(buf,USB_REPORT_CNT); g_StrEp = 0; }
+	else                         { usbSetInterrupt(buf,USB_REPORT_CNT);  g_StrEp = 1; }
+}
+
+//pin change notifications
+//the subscribed pins are sampled on every main loop pass, PORTA pin change interrupts would land in the
+//USB interrupt (USB_INTR_VECTOR is PORTA_PORT_vect). A change is held until EP1 is free, and further
+//changes are merged into it, so the host gets one 'E' report per poll interval at most, with the newest
+//pin state, every pin that changed in between, the number of changes and the time of the first one
+static inline void usbPollGpio()
+{
+	if(!(g_GpioMaskA | g_GpioMaskB)){ return; }
+	U8 a = IS_PINS_HI(A,g_GpioMaskA);
+	U8 b = IS_PINS_HI(B,g_GpioMaskB);
+	U8 ca = a ^ g_GpioA;
+	U8 cb = b ^ g_GpioB;
+	if(!(ca | cb)){ return; }
+	if(!g_GpioCnt){ g_GpioTs = TCA0_SINGLE_CNT; }
+	if(g_GpioCnt != 0xFF){ g_GpioCnt++; }
+	g_GpioChgA |= ca; g_GpioChgB |= cb;
+	g_GpioA = a; g_GpioB = b;
+}
+
+//send the pending change report, 'E', PORTA state, PORTB state, PORTA changed, PORTB changed, time lo, time hi (TCA0 ticks), changes
+static inline void usbPollSendGpio()
+{
+	U8 buf[USB_REPORT_CNT];
+	buf[0] = 'E';
+	buf[1] = g_GpioA; buf[2] = g_GpioB;
+	buf[3] = g_GpioChgA; buf[4] = g_GpioChgB;
+	buf[5] = g_GpioTs & 0xFF; buf[6] = g_GpioTs >> 8;
+	buf[7] = g_GpioCnt;
+	usbSetInterrupt(buf,USB_REPORT_CNT);
+	g_GpioChgA = g_GpioChgB = 0;
+	g_GpioCnt = 0;
+}
+
+//oscillator drift tracker, compares TCB1 cycles between SOFs with the frame length and moves CAL20M one
+//step when the filtered error is past USB_SOF_NUDGE, the USB interrupt stores the count, nothing here disables interrupts
+static void usbPollSof()
+{
+	#if USB_SOF_TRACK
+	U8  n;
+	U16 t;
+	do{ n = usbSofCount; t = usbSofTicks; }while(n != usbSofCount); //a SOF came in between, read both again
+	U8 frames = n - g_SofSeen;
+	if(!frames){ return; }
+	U16 d = t - g_SofPrev;
+	g_SofSeen = n;
+	g_SofPrev = t;
+	g_SofFrames += frames;
+	if(g_SofFrames >= USB_SOF_EVERY) //history entry
+	{
+		g_SofFrames = 0;
+		I16 e = g_SofErr / 16;
+		g_SofHist[g_SofHistPos] = e > 127 ? 127 : e < -127 ? -127 : e;
+		if(++g_SofHistPos >= USB_SOF_HIST){ g_SofHistPos = 0; }
+		if(g_SofHistCnt < USB_SOF_HIST){ g_SofHistCnt++; }
+	}
+	if(frames > USB_SOF_SPAN){ return; } //main loop was away too long, TCB1 wrapped
+	if(g_SofSettle){ g_SofSettle = g_SofSettle > frames ? g_SofSettle - frames : 0; return; }
+	I16 e = (I16)(d - frames * (U16)USB_SOF_CYCLES);
+	if(e > (I16)(frames * USB_SOF_ODD) || e < -(I16)(frames * USB_SOF_ODD)){ return; }
+	e /= frames;
+	g_SofErr += e - g_SofErr / 16; //1/16 of the new error per frame
+	if(g_SofErr > USB_SOF_CYCLES / USB_OSC_BOUND_DIV * 16 || g_SofErr < -(USB_SOF_CYCLES / USB_OSC_BOUND_DIV * 16)){ g_UsbState |= USB_ST_OSC_OFF; }
+	else { g_UsbState &= ~USB_ST_OSC_OFF; }
+	if(g_SofErr > USB_SOF_NUDGE * 16 || g_SofErr < -USB_SOF_NUDGE * 16)
+	{
+		U8 cal = CLKCTRL_OSC20MCALIBA;
+		if(g_SofErr > 0){ if(cal > 0){ cal--; } } //fast, the frequency rises with cal
+		else if(cal < USB_OSC_CAL_MAX){ cal++; }
+		_PROTECTED_WRITE(CLKCTRL_OSC20MCALIBA,cal); //the CCP sequence holds off interrupts for 4 cycles by itself
+		g_Osc.cal = cal; //next USB reset starts here
+		if(g_SofNudges != 0xFF){ g_SofNudges++; }
+		g_SofErr = 0;
+		g_SofSettle = USB_SOF_SETTLE;
+	}
+	#endif
+}
+
+#if USB_POLL_STATS
+//the main loop moves on to another site, the longest stretch since the last usbPoll() is kept
+void usbPollSite(U8 site)
+{
+	U16 t = TCA0_SINGLE_CNT;
+	U16 d = t - g_PollSiteT;
+	if(d >= g_PollSpan){ g_PollSpan = d; g_PollSpanSite = g_PollSite; }
+	g_PollSite = site;
+	g_PollSiteT = t;
+}
+
+//usbPoll() is about to run, the gap since the last one goes in the histogram
+static inline void usbPollGap()
+{
+	usbPollSite(USB_SITE_POLL);
+	U16 gap = g_PollSiteT - g_PollLast;
+	g_PollLast = g_PollSiteT;
+	U8 site = g_PollSpanSite;
+	g_PollSpan = 0;
+	if(!g_PollRun){ g_PollRun = 1; return; } //first call, nothing to measure from
+	U8 bin = 0;
+	U16 g = gap;
+	if(g >> 8){ bin = 8; g >>= 8; }
+	while(g){ bin++; g >>= 1; }
+	if(bin >= USB_POLL_BINS){ bin = USB_POLL_BINS-1; }
+	if(g_PollHist[bin] < USB_POLL_SAT){ g_PollHist[bin]++; }
+	if(gap > g_PollWorst){ g_PollWorst = gap; g_PollWorstSite = site; }
+	if(gap >= g_PollAlarmMs * (U16)USB_TICKS_PER_MS) //soft alarm, V-USB survived it but there is not much room left
+	{
+		if(g_PollAlarms != 0xFF){ g_PollAlarms++; }
+		g_UsbState |= USB_ST_POLL_LATE;
+	}
+}
+#endif
+
+#define USB_RUN_FULL   0    //usbRunCommand(), needs a response and the queue is full, nothing was done, hold it
+#define USB_RUN_DONE   1    //usbRunCommand(), done
+#define USB_RUN_BUSY   2    //usbRunCommand(), a range CRC is running, nothing was done, hold it
+
+//run one command from the PC, returns USB_RUN_xxx
+static U8 usbRunCommand(U8* data)
+{
+	U8 cmd = data[0]; //'R'=read (will respond with read byte), 'W'=write (will NOT repond), 'P'/'D'=packed writes (will NOT respond), 'F'/'+'=framed page write (responds when complete), 'B'=block read (will respond with a stream of reports), 'C'=CRC16 of a range, 'S'=status, 'Q'=response queue stats, 'N'=flow control stats, 'K'=CRC16 of any EEPROM or flash range, 'M'=memory read (will respond with a stream of reports), 'J'=jump to bootloader, 'T'=streaming telemetry, 'G'=pin change notifications, 'O'=oscillator calibration, 'H'=oscillator drift history, 'Z'=scheduler task stats, 'L'=usbPoll() gap histogram
+	U8 adr = data[1]; //EEPROM address to read or write
+	U8 val = data[2]; //value to write, or block read / CRC count (0 = 256 bytes)
+	U8* rsp = 0;
+	if((cmd == 'K' || cmd == 'C') && g_KBusy){ return USB_RUN_BUSY; } //one range CRC at a time, hold this one
+	if(cmd != '+'){ g_FrmLen = 0; } //any other command drops an unfinished frame
+	U8 frm_end = (cmd == 'F' && val && val <= USB_FRM_FIRST) || (cmd == '+' && g_FrmLen && g_FrmLen - g_FrmPos <= USB_FRM_NEXT); //report completes a frame
+	U8 bad_space = cmd == 'K' && data[5] != USB_SPACE_EE && data[5] != USB_SPACE_FLASH; //'K' answers at once that it can not
+	if(cmd == 'R' || cmd == 'S' || cmd == 'Q' || cmd == 'N' || cmd == 'J' || cmd == 'T' || cmd == 'G' || cmd == 'O' || cmd == 'H' || cmd == 'Z' || cmd == 'L' || frm_end || bad_space)
+	{
+		rsp = usbRspAlloc();
+		if(!rsp){ return USB_RUN_FULL; }
+		rsp[0] = cmd;
+	}
+	switch(cmd)
+	{
+		case 'W': usbEeWrite(adr,val); break; //write EEPROM (no reponse is given after writing), queued, usbPollEeprom() commits it
+		case 'P': //packed write, 'P', pair count, adr0, val0, adr1, val1, adr2, val2 (no response)
+		{
+			if(adr > USB_PACK_PAIRS){ adr = USB_PACK_PAIRS; }
+			for(U8 i=0; i<adr; i++){ usbEeWrite(data[2+2*i],data[3+2*i]); }
+			break;
+		}
+		case 'D': //delta write, 'D', adr0, deltas, val0..val4 (no response)
+		{         //deltas holds 2 bits per following value, lowest first, 1-3 is the step from the previous address, 0 ends the list
+			U8 dd = val;
+			usbEeWrite(adr,data[3]);
+			for(U8 i=1; i<USB_DELTA_CNT && (dd & 3); i++, dd >>= 2)
+			{
+				adr += dd & 3;
+				usbEeWrite(adr,data[3+i]);
+			}
+			break;
+		}
+		case 'M': //memory read, 'M', adr lo, adr hi, count lo, count hi (0 = 256 like 'B'), streams 'M', adr lo, 6 data bytes per report
+		{         //reads the data space directly, EEPROM writes still queued are not seen here, see usbMemRead() for the I/O registers it skips
+			g_MemAdr = data[1] | (data[2] << 8);
+			g_MemCnt = data[3] | (data[4] << 8);
+			if(!g_MemCnt){ g_MemCnt = 256; }
+			break;
+		}
+		case 'K': //range CRC, 'K', adr lo, adr hi, count lo, count hi, space, responds later with 'K', adr lo, adr hi, count lo, count hi, CRC lo, CRC hi, space
+		{         //an unknown space responds at once with space USB_SPACE_BAD and no CRC
+			if(bad_space){ for(U8 i=1; i<5; i++){ rsp[i] = data[i]; } rsp[7] = USB_SPACE_BAD; break; }
+			usbCrcStart(data);
+			break;
+		}
+		case 'J': //jump to bootloader, 'J', 'B', 'O', 'O', 'T', respond with 'J', BOOTEND fuse (0 = no bootloader, nothing happens)
+		{
+			rsp[1] = FUSE_BOOTEND;
+			if(FUSE_BOOTEND && data[1] == 'B' && data[2] == 'O' && data[3] == 'O' && data[4] == 'T'){ g_JumpBoot = 1; }
+			break;
+		}
+		case 'T': //streaming telemetry, 'T', 1, rate lo, rate hi (Hz) starts, 'T', 0 stops
+		{         //responds with 'T', 1, rate lo, rate hi or 'T', 0, dropped samples lo, hi, sent samples (4 bytes), 'V' reports carry the samples
+			if(adr)
+			{
+				U16 rate = data[2] | (data[3] << 8);
+				usbStreamStart(rate);
+				rsp[1] = 1; rsp[2] = data[2]; rsp[3] = data[3];
+			}
+			else
+			{
+				usbStreamStart(0);
+				rsp[2] = g_StrLost & 0xFF; rsp[3] = g_StrLost >> 8;
+				rsp[4] = g_StrCnt & 0xFF; rsp[5] = (g_StrCnt >> 8) & 0xFF; rsp[6] = (g_StrCnt >> 16) & 0xFF; rsp[7] = g_StrCnt >> 24;
+			}
+			break;
+		}
+		case 'G': //pin change notifications, 'G', PORTA pins, PORTB pins (0, 0 = none), 'E' reports are sent when one changes
+		{         //responds with 'G', PORTA pins, PORTB pins (the USB pins removed), PORTA state, PORTB state, TCA0 ticks per ms
+			g_GpioMaskA = adr & (U8)~USB_GPIO_USB_A;
+			g_GpioMaskB = val;
+			g_GpioA = IS_PINS_HI(A,g_GpioMaskA);
+			g_GpioB = IS_PINS_HI(B,g_GpioMaskB);
+			g_GpioChgA = g_GpioChgB = 0;
+			g_GpioCnt = 0;
+			rsp[1] = g_GpioMaskA; rsp[2] = g_GpioMaskB; rsp[3] = g_GpioA; rsp[4] = g_GpioB; rsp[5] = USB_TICKS_PER_MS;
+			break;
+		}
+		case 'O': //oscillator calibration, 'O', 0 = stats, 1 = forget the USERROW value, 2 = forget it and reconnect, 3 = reconnect (2 and 3 time enumeration without and with the USERROW value)
+		{         //responds with 'O', cal, factory cal, first guess (0 = factory, 1 = USERROW, 2 = last USB reset), measurements by the last calibration,
+		          //measurements since the last 'O', time calibrating since the last 'O' lo, hi (0.1ms), the counts restart here
+			U16 t = (U32)g_OscTicks * 10 / USB_TICKS_PER_MS;
+			rsp[1] = g_Osc.cal; rsp[2] = g_Osc.factory; rsp[3] = g_Osc.from; rsp[4] = g_Osc.steps;
+			rsp[5] = g_OscSteps; rsp[6] = t & 0xFF; rsp[7] = t >> 8;
+			g_OscSteps = 0;
+			g_OscTicks = 0;
+			if(adr){ g_Osc.good = 0; } //next USB reset starts as after a power up
+			if(adr == 1 || adr == 2){ g_OscSave = USB_OSC_FORGET; } //and as after the first one
+			if(adr == 2 || adr == 3){ g_OscReconnect = 1; }
+			break;
+		}
+		case 'H': //oscillator drift, 'H', 0 responds with 'H', 0, cal, CAL20M steps made, filtered error lo, hi (CPU cycles per frame * 16, positive is fast), CPU cycles per frame / 100, history entries
+		{         //'H', n (1 and up) responds with 'H', n, history entries (n-1)*USB_SOF_BLK onwards, oldest first, CPU cycles per frame error (signed)
+			if(!adr)
+			{
+				rsp[2] = CLKCTRL_OSC20MCALIBA; rsp[3] = g_SofNudges;
+				rsp[4] = g_SofErr & 0xFF; rsp[5] = (U16)g_SofErr >> 8;
+				rsp[6] = USB_SOF_CYCLES / 100; rsp[7] = g_SofHistCnt;
+				break;
+			}
+			rsp[1] = adr;
+			U8 first = g_SofHistCnt < USB_SOF_HIST ? 0 : g_SofHistPos; //oldest
+			for(U8 i=0, k=(adr-1)*USB_SOF_BLK; i<USB_SOF_BLK; i++, k++)
+			{
+				U8 j = first + k;
+				if(j >= USB_SOF_HIST){ j -= USB_SOF_HIST; }
+				rsp[2+i] = k < g_SofHistCnt ? g_SofHist[j] : 0;
+			}
+			break;
+		}
+		case 'Z': //scheduler task stats, 'Z', task, responds with 'Z', task, runs over budget, runs dropped, worst lo, hi, budget lo, hi (CPU cycles)
+		{         //a task past the end of the table responds with budget 0
+			rsp[1] = adr;
+			sched_task_t* t = schedTask(adr);
+			if(!t){ break; }
+			rsp[2] = t->over; rsp[3] = t->skip;
+			rsp[4] = t->worst & 0xFF; rsp[5] = t->worst >> 8;
+			rsp[6] = t->budget & 0xFF; rsp[7] = t->budget >> 8;
+			break;
+		}
+		case 'L': //usbPoll() gaps, 'L', 0, op (0 = read, 1 = clear, 2 = clear and set the alarm threshold), threshold ms, responds with 'L', 0, worst gap lo, hi (TCA0 ticks),
+		{         //its site (USB_SITE_xxx), alarms, TCA0 ticks per ms, threshold ms (0 = built without USB_POLL_STATS), the response is taken before a clear
+		          //'L', n (1 and up), op responds with 'L', n, counts of bins (n-1)*USB_POLL_BLK onwards, 24 bits each, lo first, op 1 or 2 clears those bins
+		          //'L', 0 clears the summary only, so every count is read in the same response that clears it
+			rsp[1] = adr;
+			#if USB_POLL_STATS
+			if(!adr)
+			{
+				rsp[2] = g_PollWorst & 0xFF; rsp[3] = g_PollWorst >> 8;
+				rsp[4] = g_PollWorstSite; rsp[5] = g_PollAlarms;
+				rsp[6] = USB_TICKS_PER_MS; rsp[7] = g_PollAlarmMs;
+				if(val == 2 && data[3]){ g_PollAlarmMs = data[3]; }
+				if(val == 1 || val == 2)
+				{
+					g_PollWorst = 0; g_PollWorstSite = 0; g_PollAlarms = 0;
+					g_UsbState &= ~USB_ST_POLL_LATE;
+				}
+				break;
+			}
+			for(U8 i=0, k=(adr-1)*USB_POLL_BLK; i<USB_POLL_BLK && k<USB_POLL_BINS; i++, k++)
+			{
+				U32 c = g_PollHist[k];
+				rsp[2+i*3] = c & 0xFF; rsp[3+i*3] = (c >> 8) & 0xFF; rsp[4+i*3] = (c >> 16) & 0xFF;
+				if(val == 1 || val == 2){ g_PollHist[k] = 0; }
+			}
+			#endif
+			break;
+		}
+		case 'F': //framed write start, 'F', address, length (up to one page), first data bytes, '+' reports carry the rest
+		{         //responds with 'F' once the whole frame is in, see usbFrameAdd()
+			if(!val || val > USB_FRM_MAX){ break; } //bad length, no frame
+			g_FrmAdr = adr; g_FrmLen = val; g_FrmPos = 0;
+			usbFrameAdd(&data[3],USB_FRM_FIRST,rsp);
+			break;
+		}
+		case '+': if(g_FrmLen){ usbFrameAdd(&data[1],USB_FRM_NEXT,rsp); } break; //framed write continuation, ignored when no frame is open
+		case 'R': rsp[1] = adr; rsp[2] = usbEeRead(adr); break; //read EEPROM, echo address so host can match pipelined requests
+		case 'B': g_BlkAdr = adr; g_BlkCnt = val ? val : 256; break; //block read EEPROM (usbPollSendtoHost streams USB_BLK_DATA bytes per report until done)
+		case 'C': usbCrcStart(data); break; //CRC16 of EEPROM range, 'C', address, count (0 = 256), responds later with 'C', address, count, CRC lo, CRC hi, once queued writes are in
+		case 'S': //status, respond with 'S', readiness flags (USB_ST_xxx), session nonce lo, nonce hi, oscillator calibration
+		{
+			U8 st = g_UsbState;
+			if(g_EeHead == g_EeTail && !(NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm)){ st |= USB_ST_EE_READY; } //no queued writes either
+			rsp[1] = st; rsp[2] = g_UsbNonce & 0xFF; rsp[3] = g_UsbNonce >> 8; rsp[4] = CLKCTRL_OSC20MCALIBA;
+			break;
+		}
+		case 'Q': //response queue, respond with 'Q', entries, entries used (this one not counted), held, full lo, full hi, lost lo, lost hi
+		{
+			rsp[1] = USB_RSP_CNT; rsp[2] = (U8)(g_RspHead - g_RspTail); rsp[3] = g_HeldCmd[0] ? 1 : 0;
+			rsp[4] = g_RspFull & 0xFF; rsp[5] = g_RspFull >> 8; rsp[6] = g_RspLost & 0xFF; rsp[7] = g_RspLost >> 8;
+			break;
+		}
+		case 'N': //flow control, respond with 'N', EEPROM write queue entries, EEPROM peak, response peak, stalls lo, stalls hi, stalled ms lo, stalled ms hi
+		{
+			U32 ms = g_FlowTicks / USB_TICKS_PER_MS;
+			if(ms > 0xFFFF){ ms = 0xFFFF; }
+			rsp[1] = USB_EE_CNT; rsp[2] = g_EePeak; rsp[3] = g_RspPeak;
+			rsp[4] = g_FlowStalls & 0xFF; rsp[5] = g_FlowStalls >> 8; rsp[6] = ms & 0xFF; rsp[7] = ms >> 8;
+			break;
+		}
+	}
+	if(rsp){ usbRspPush(); } //response is queued
+	return USB_RUN_DONE;
+}
+
+//are we unable to take another command without holding it, or waiting for the EEPROM
+static inline U8 usbFlowBusy()
+{
+	return g_HeldCmd[0] || (U8)(g_RspHead - g_RspTail) >= USB_RSP_CNT || (U8)(g_EeHead - g_EeTail) > USB_EE_CNT - USB_FRM_MAX;
+}
+
+//stop taking requests while busy, the driver NAKs the host and the host retries in hardware
+//must be called from usbFunctionWriteOut() or usbFunctionWrite(), see usbdrv.h
+static inline void usbFlowStop()
+{
+	if(g_FlowOff || !usbFlowBusy()){ return; }
+	usbDisableAllRequests();
+	g_FlowOff = 1;
+	g_FlowStalls++;
+	g_FlowT0 = TCA0_SINGLE_CNT;
+}
+
+//take requests again once there is room, called from the main loop
+static inline void usbFlowPoll()
+{
+	if(!g_FlowOff || usbFlowBusy()){ return; }
+	g_FlowTicks += (U16)(TCA0_SINGLE_CNT - g_FlowT0); //stalls are much shorter than one TCA0 period
+	g_FlowOff = 0;
+	usbEnableAllRequests();
+}
+
 //do we have data to send?
 inline void usbPollSendtoHost()
 {
-	//we use first byte (command byte) to detect if we have data to send
-	if(g_UsbBuf[0] && usbInterruptIsReady())//if we have data to send, and previous data was sent
-	{               
-		uchar* p = (void*)g_UsbBuf;
-	    usbSetInterrupt(p,USB_REPORT_CNT);
-		g_UsbBuf[0] = 0; //we copied data to interrupt buffer, clear this byte
+	if(!usbInterruptIsReady()){return;} //previous data not sent yet
+	
+	if(g_RspHead != g_RspTail)//queued response, send the oldest
+	{
+		usbSetInterrupt(g_RspBuf[g_RspTail & USB_RSP_MASK],USB_REPORT_CNT); //copies the data to the interrupt buffer
+		g_RspTail++;
+		if(g_HeldCmd[0] && usbRunCommand(g_HeldCmd) == USB_RUN_DONE){ g_HeldCmd[0] = 0; } //an entry is free, run the held command (a held CRC runs after the running one's response)
+	}
+	else if(g_GpioCnt)//pin change, sent ahead of block reads so it is never more than one poll interval late
+	{
+		usbPollSendGpio();
+	}
+	else if(g_BlkCnt)//block read in progress, stream next report
+	{
+		usbPollSendBlock();
+	}
+	else if(g_MemCnt)//memory read in progress, stream next report
+	{
+		usbPollSendMem();
 	}
 }
 
 //this is where we receive data from PC
+//a command that needs a response while the queue is full is held, not dropped, and runs once an entry is sent
+//requests are disabled while a command is held or a queue is full, so the host is NAKed instead of
+//a command being lost (g_RspLost only counts if that ever fails)
 inline void usbFunctionWriteOut(uchar *data, uchar len)
 {
-	//first byte is EEPROM address, second byte is the data to write
-	U8* pCmd = (void*)data;		//'R'=read (will respond with read byte), 'W'=write (will NOT repond)
-	U8* pAdr = (void*)data+1;	//EEPROM address to read or write
-	U8* pVal = (void*)data+2;	//value to read or write
-	switch( (*pCmd) )
+	if(g_HeldCmd[0]){ g_RspLost++; return; }
+	U8 r = usbRunCommand(data);
+	if(r != USB_RUN_DONE)
 	{
-		case 'W': cli(); UpdateEE8( (*pAdr) , (*pVal) ); sei(); break;	    //write EEPROM (no reponse is given after writing), maybe can use ATOMIC_BLOCK(ATOMIC_FORCEON){
-		case 'R': g_UsbBuf[2] = ReadEE8( (*pAdr) ); g_UsbBuf[0]='R'; break; //read EEPROM (this will trigger usbPollSendtoHost to send a response) 			
+		for(U8 i=0; i<USB_REPORT_CNT; i++){ g_HeldCmd[i] = data[i]; }
+		if(r == USB_RUN_FULL){ g_RspFull++; } //'Q' reports only a full queue, not a CRC still running
 	}
+	usbFlowStop();
 }
 
-//we don't use this feature, so just return 0
+//vendor control requests, EEPROM blocks move in the data stage of a control transfer
+//(control transfers are not limited to one 8 byte report per interrupt poll interval)
 inline usbMsgLen_t usbFunctionSetup(uchar *data)
 {
+	usbRequest_t* rq = (void*)data;
+	if((rq->bmRequestType & USBRQ_TYPE_MASK) != USBRQ_TYPE_VENDOR){ return 0; }
+	switch(rq->bRequest)
+	{
+		case USB_RQ_EE_READ:
+		case USB_RQ_EE_WRITE:
+			g_CtlAdr = rq->wValue.word;
+			g_CtlCnt = rq->wLength.word;
+			if(g_CtlAdr >= EEPROM_SIZE){ g_CtlCnt = 0; } //nothing to do, read sends a zero length packet
+			else if(g_CtlCnt > EEPROM_SIZE - g_CtlAdr){ g_CtlCnt = EEPROM_SIZE - g_CtlAdr; } //do not run past the end of EEPROM
+			return USB_NO_MSG; //usbFunctionRead() or usbFunctionWrite() moves the data
+	}
 	return 0;
 }
 
-//calibrate internal oscillator to 16.5MHz or 12.8MHz
-static inline void usb_calibrate_osc()
+//control-in data stage, called for each 8 byte packet, a short packet ends the transfer
+inline uchar usbFunctionRead(uchar *data, uchar len)
 {
-	//16.5MHz will be 2356 (we want to arrive at this point)
-	//16.0MHz will be 2284 (internal oscillator at 16MHz starts at about this point)
-	//12.8MHz will be 1827 (we want to arrive at this point)
-	I16 targetValue = (unsigned)(1499 * (double)F_CPU / 10.5e6 + 0.5); //10.5e6 is 10500000 //targetValue should be 2356 for 16.5MHz
-	U8 tmp = CLKCTRL_OSC20MCALIBA; //oscilator default calibration value
-	
-	//trim to 16.5MHz or 12.8MHz
-	// https://www.silabs.com/community/interface/knowledge-base.entry.html/2004/03/15/usb_clock_tolerance-gVai
-	// http://vusb.wikidot.com/examples	
-	U8  sav = tmp;
-	I16 low = 32767; //lowest saved value
-	while(1) //normally solves in about 5 itterations
-	{
-		I16 cur = usbMeasureFrameLength() - targetValue; //we expect cur to be negative numbers until we overshoot
-		
-		I16 curabs = cur;
-		if(curabs < 0){curabs = -curabs;} //make a positive number, so we know how far away from zero it is
-		if(curabs < low)  //current value is lower
-		{
-			low = curabs; //got a new lower value, save it
-			sav = tmp;    //save the OSC CALB value
-		}
-		else //things just got worse, curabs > low, so saved value before this was the best value
-		{
-			_PROTECTED_WRITE(CLKCTRL_OSC20MCALIBA,sav);
-			return;
-		}		
-		
-		if(cur < 0) //freq too high
-		{ tmp++; }  //+1 will increase frequency by about 1%	
-		else        //freq too low
-		{ tmp--; }  //-1 will increase frequency by about 1%	
-		//apply change and check again
-		_PROTECTED_WRITE(CLKCTRL_OSC20MCALIBA,tmp);		
-	}	
+	uchar i;
+	for(i=0; i<len && g_CtlCnt; i++)
+	{
+		data[i] = usbEeRead(g_CtlAdr);
+		g_CtlAdr++;
+		g_CtlCnt--;
+	}
+	return i;
+}
+
+//control-out data stage, called for each 8 byte packet, return 1 when the block is done
+//bytes are queued, the driver NAKs the next packet while we wait for room in the queue
+inline uchar usbFunctionWrite(uchar *data, uchar len)
+{
+	for(uchar i=0; i<len && g_CtlCnt; i++)
+	{
+		usbEeWrite(g_CtlAdr,data[i]);
+		g_CtlAdr++;
+		g_CtlCnt--;
+	}
+	usbFlowStop();
+	return g_CtlCnt == 0;
 }
 
 //a USB reset occured, disable all internal functions except USB
 inline void usbHadReset()
 {
-	#if F_CPU == 16500000 || F_CPU == 12800000
+	#if USB_OSC_TRIM
     //cli();  // usbMeasureFrameLength() counts CPU cycles, so disable interrupts.
     ATOMIC_BLOCK(ATOMIC_FORCEON)
     {
+		U16 t0 = TCA0_SINGLE_CNT;
 		usb_calibrate_osc();
+		g_OscTicks += TCA0_SINGLE_CNT - t0;
 	}
     //sei();
+	g_OscSteps = (U16)g_OscSteps + g_Osc.steps > 255 ? 255 : g_OscSteps + g_Osc.steps;
+	if(g_Osc.good && usb_osc_cached() != g_Osc.cal){ g_OscSave = USB_OSC_SAVE; } //new or changed, keep it
+	if(usb_osc_abs(g_Osc.err) > USB_OSC_BOUND){ g_UsbState |= USB_ST_OSC_OFF; }
+	else { g_UsbState &= ~USB_ST_OSC_OFF; }
+	g_SofErr = 0;                      //drift tracker starts over, the history is kept
+	g_SofSettle = USB_SOF_SETTLE;
     #endif
+	g_UsbState |= USB_ST_CALIBRATED;  //commands can be answered now
+	g_UsbNonce = g_UsbNonce * 5 + 1;   //new session, host can tell the device was reset (full period LCG step, never sticks at one value)
+	g_BlkCnt = 0;                      //drop any block read from the previous session
+	g_MemCnt = 0;                      //and any memory read
+	g_CtlCnt = 0;                      //and any control transfer
+	g_FrmLen = 0;                      //and any framed write
+	g_KBusy = 0;                       //and any range CRC
+	usbStreamStart(0);                 //and streaming
+	g_GpioMaskA = g_GpioMaskB = 0;     //and pin change notifications
+	g_GpioCnt = 0;
+	g_RspHead = g_RspTail = 0;         //and queued responses
+	g_HeldCmd[0] = 0;
+	g_RspFull = g_RspLost = 0;
+	g_EePeak = g_RspPeak = 0;
+	g_FlowStalls = 0;
+	g_FlowTicks = 0;
+	//queued EEPROM writes are kept, they were acknowledged to the host
+}
+
+//software reset, the bootloader stays when it finds the software reset flag (boot/boot.c)
+static void usbJumpBoot()
+{
+	cli();
+	usbDeviceDisconnect(); //host sees us leave, the bootloader enumerates as a new device
+	_delay_ms(100);
+	_PROTECTED_WRITE(RSTCTRL_SWRR,RSTCTRL_SWRE_bm);
+	while(1);
+}
+
+//leave the bus and enumerate again, 'O' uses this to time enumeration
+static void usbReconnect()
+{
+	g_OscReconnect = 0;
+	cli();
+	usbDeviceDisconnect();
+	_delay_ms(250);
+	usbDeviceConnect();
+	sei();
+	#if USB_POLL_STATS
+	g_PollRun = 0; //off the bus on purpose, not a late usbPoll()
+	#endif
 }
 
 inline void usbMyInit()
 {
 	usbInit();
+	TCA0_SINGLE_CTRLA = TCA_SINGLE_CLKSEL_DIV256_gc | TCA_SINGLE_ENABLE_bm; //free running timebase for the flow control stats
+	TCB1_CCMP = 0xFFFF; //free running CPU cycle count, the USB interrupt stores it at every SOF, the scheduler times tasks with it
+	TCB1_CTRLB = TCB_CNTMODE_INT_gc;
+	TCB1_CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm;
+	CPUINT_LVL1VEC = PORTA_PORT_vect_num; //USB interrupt preempts any other interrupt (the TCB0 sampler), V-USB can not wait
     usbDeviceDisconnect();  //enforce re-enumeration, do this while interrupts are disabled!
 	_delay_ms(250);
     usbDeviceConnect();
@@ -211,8 +1008,21 @@ inline void usbMyInit()
 
 inline void usbMyPolling()
 {
+	#if USB_POLL_STATS
+	usbPollGap();//time since the last usbPoll()
+	#endif
     usbPoll();//check for USB work and incoming messages
-	usbPollSendtoHost();//check if we have USB data to send
+	USB_POLL_SITE(USB_SITE_GPIO);   usbPollGpio();//look for subscribed pin changes
+	USB_POLL_SITE(USB_SITE_SEND);   usbPollSendtoHost();//check if we have USB data to send
+	USB_POLL_SITE(USB_SITE_EEPROM); usbPollEeprom();//commit queued EEPROM writes
+	USB_POLL_SITE(USB_SITE_OSC);    usbPollOscSave();//keep the oscillator calibration in USERROW
+	USB_POLL_SITE(USB_SITE_CRC);    usbPollCrc();//next chunk of a range CRC
+	USB_POLL_SITE(USB_SITE_FLOW);   usbFlowPoll();//take requests again once our queues have room
+	USB_POLL_SITE(USB_SITE_STREAM); usbPollStream();//next report of streaming samples
+	USB_POLL_SITE(USB_SITE_SOF);    usbPollSof();//follow oscillator drift
+	USB_POLL_SITE(USB_SITE_MAIN);   //back to the main loop
+	if(g_JumpBoot && g_RspHead == g_RspTail && usbInterruptIsReady()){ usbJumpBoot(); } //'J' response is on its way to the host
+	if(g_OscReconnect && !g_OscSave && g_RspHead == g_RspTail && usbInterruptIsReady()){ usbReconnect(); } //'O' response sent, USERROW written
 }
 //----------------------------------------------------------
 //----------------------------------------------------------
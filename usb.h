@@ -12,10 +12,37 @@
 
 //custom descriptors are in the C file
 
+#define USB_TICKS_PER_MS  (F_CPU/256000UL) //TCA0 runs at F_CPU/256, free running from usbMyInit()
+
+//usbPoll() gap histogram, 'L' reports it, optional instrumentation, build with -DUSB_POLL_STATS=1 to put it in
+#ifndef USB_POLL_STATS
+#define USB_POLL_STATS    0
+#endif
+//call sites, the main loop marks what runs between two usbPoll() calls and the longest stretch is blamed for a gap
+#define USB_SITE_POLL     0  //usbPoll() itself, commands and USB reset (oscillator calibration)
+#define USB_SITE_GPIO     1
+#define USB_SITE_SEND     2
+#define USB_SITE_EEPROM   3
+#define USB_SITE_OSC      4
+#define USB_SITE_CRC      5
+#define USB_SITE_FLOW     6
+#define USB_SITE_STREAM   7
+#define USB_SITE_SOF      8
+#define USB_SITE_MAIN     9  //back in the main loop, between tasks
+#define USB_SITE_TASK     0x80 //scheduler task, ORed with its index
+#if USB_POLL_STATS
+void usbPollSite(U8 site);
+#define USB_POLL_SITE(s)  usbPollSite(s)
+#else
+#define USB_POLL_SITE(s)
+#endif
+
 //functions
 void usbPollSendtoHost();                         //do we have data to send?
 void usbFunctionWriteOut(uchar *data, uchar len); //this is where we receive data from PC
-usbMsgLen_t usbFunctionSetup(uchar *data);        //we don't use this feature, so just return 0
+usbMsgLen_t usbFunctionSetup(uchar *data);        //vendor control requests, EEPROM block read and write
+uchar usbFunctionRead(uchar *data, uchar len);    //control-in data, next chunk of an EEPROM block read
+uchar usbFunctionWrite(uchar *data, uchar len);   //control-out data, next chunk of an EEPROM block write
 void usbHadReset();                               //a USB reset occured, disable all internal functions except USB
 void usbMyInit();                                 //init USB driver
 void usbMyPolling();                              //usb data polling
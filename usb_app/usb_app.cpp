@@ -6,6 +6,7 @@
 //
 // To Compile
 // g++ -std=c++11 -g -Wall -Wshadow -DDEBUG -lusb-1.0 -pthread usb_app.cpp -o usb_app
+// (the usb_*.h files are header only, and are pulled in by usb_app.cpp)
 //
 //////////////////////////////////////////////////////////////////
 //
@@ -19,252 +20,173 @@
 // # USB devices (usbfs replacement)
 // SUBSYSTEM=="usb", ATTR{idVendor}=="16c0", ATTR{idProduct}=="05dc", MODE="0666"
 // KERNEL=="hiddev*", ATTRS{idVendor}=="16c0", MODE="0666"
+// KERNEL=="hidraw*", ATTRS{idVendor}=="16c0", ATTRS{idProduct}=="05dc", MODE="0666"
 //
 //////////////////////////////////////////////////////////////////
 
 #define USB_VID   0x16c0
 #define USB_PID   0x05dc
+#define OSC_WAIT_MS  5000 //-osc, time for the device to leave the bus and enumerate again
+#define OSC_OFF_MS   250  //-osc, the device stays off the bus this long (usbReconnect in usb.c)
 
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>             //for CTRL+C
 #include <unistd.h>             //for CTRL+C
-#include <atomic>               //std::atomic
 #include <stdlib.h>             //srand, rand
-//#include <time.h>             //time()
 //#include <chrono>               //std::chrono::milliseconds, requires C++11 standard
 #include <libusb-1.0/libusb.h>  //requires linker option -lusb-1.0    
 //sudo apt-get install libusb-1.0-0-dev   
 //sudo apt-get install libusb-1.0-0
+#include "usb_defs.h"           //types, delays, printf colors, TRACE macros
+#include "usb_xfer.h"           //asynchronous pipelined transfer engine
+#include "usb_discover.h"       //hotplug discovery cache
+#include "usb_client.h"         //reentrant device client
+#include "usb_daemon.h"         //daemon mode with eeprom shadow cache
+#include "usb_sim.h"            //simulated device
+#include "usb_bench.h"          //latency and throughput benchmark
+#include "usb_hidraw.h"         //hidraw and epoll backend
+#include "usb_boot.h"           //USB bootloader flasher
+#include "usb_stream.h"         //streaming telemetry capture
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
 
-//ints
-#define  U8 uint8_t
-#define U16 uint16_t
-#define U32 uint32_t
-#define U64 uint64_t
-#define  I8 int8_t
-#define I16 int16_t
-#define I32 int32_t
-#define I64 int64_t
-#define f32 float_t
-#define f64 double_t
-
-//delays
-#define delay_us(x)  usleep(x)
-#define delay_ms(x)  usleep((x*1000))
-#define delay_s(x)   sleep(x)
-
-//printf colors
-#define C_RED       "\033[0;31m"  //Red
-#define C_RED_BOLD  "\033[1;31m"  //Bold Red
-#define C_GRN       "\033[0;32m"  //Green
-#define C_GRN_BOLD  "\033[1;32m"  //Bold Green
-#define C_YEL       "\033[0;33m"  //Yellow
-#define C_YEL_BOLD  "\033[01;33m" //Bold Yellow
-#define C_BLU       "\033[0;34m"  //Blue
-#define C_BLU_BOLD  "\033[1;34m"  //Bold Blue
-#define C_MAG       "\033[0;35m"  //Magenta
-#define C_MAG_BOLD  "\033[1;35m"  //Bold Magenta
-#define C_CYAN      "\033[0;36m"  //Cyan
-#define C_CYAN_BOLD "\033[1;36m"  //Bold Cyan
-#define C_WHT       "\033[0;37m"  //White
-#define C_WHT_BOLD  "\033[1;37m"  //Bold White
-#define C_RESET     "\033[0m"     //Reset
-
-#ifdef DEBUG
-#define TRACE(...)     printf(__VA_ARGS__); fflush(stdout) //printf(x...) //windows method
-#define ETRACE(...)    printf(C_RED); printf(__VA_ARGS__); printf(C_RESET); fflush(stdout) //printf(x...) //windows method
-#define ERRTRACE(...)  printf(C_RED "\nFILE: %s\nLINE: %d\nFUNC: %s\nERROR: ",__FILE__,__LINE__,__func__); printf(__VA_ARGS__); printf("\n" C_RESET); fflush(stdout)
-#endif
-
-
-//global
-int m_run = 1;
-int m_interface_claimed = 0;
-libusb_device_handle* m_devh = 0;
-
-void hid_disconnect()
+//options shared by every device job
+struct app_opts
 {
-	if(m_devh)
-	{
-		if(m_interface_claimed)
-		{
-			libusb_release_interface(m_devh,0);
-			m_interface_claimed = 0;
-			TRACE("Released usb interface\n");
-		}
-
-		libusb_close(m_devh);
-		m_devh = 0;
-	}
-}
+	const char* sDump;  //dump file, suffixed with the device path when -all is used
+	const char* sWrite; //file to write to the device
+	const char* sVerify; //file to compare with the device, by CRC
+	bool flash;         //-verify compares flash instead of eeprom
+	const char* sMem;   //memory region to read and show, see mem_regions
+	int mem_adr;        //data space address of sMem
+	int mem_len;
+	int limit;          //number of eeprom bytes
+	int depth;          //transfer engine requests in flight
+	bool bytewise;
+	bool speedtest;
+	bool readback;
+	bool interrupt;     //use interrupt reports only, no control transfers
+	bool quiet;         //no progress output, several devices are running at once
+};
 
-void hid_shutdown()
+//named regions of the attiny1614 data space for -mem
+struct mem_region
 {
-	hid_disconnect();
-	libusb_exit(NULL);	//shutdown library
-}
-
-bool hid_init()
+	const char* name;
+	int adr;
+	int len;
+};
+const mem_region mem_regions[] =
 {
-	//init libusb
-	int r = libusb_init(NULL);
-	if(r < 0){ TRACE("Failed to initialise usb\n"); exit(0); return false;}
-	return true;
-}
+	{"io",      0x0000, 0x1040}, //registers that change state when read (data, ADC result, timers, RTC) come back as 0
+	{"sigrow",  0x1100, 0x0040},
+	{"fuses",   0x1280, 0x000B},
+	{"userrow", 0x1300, 0x0020},
+	{"eeprom",  0x1400, 0x0100},
+	{"sram",    0x3800, 0x0800},
+	{"flash",   0x8000, 0x4000},
+};
 
-//will open a device based on vid, pid, manufacturer_string, product_string
-libusb_device_handle* hid_open_hiddev(uint16_t vid, uint16_t pid, const char* mfg, const char* prd)
+//parse a region name, or adr:len
+bool mem_parse(const char* s, int* adr, int* len)
 {
-	//default return value
-	libusb_device_handle* devH = NULL;
-
-	//get all usb devices to devs pointer
-	libusb_device** devs;
-	ssize_t cnt = libusb_get_device_list(NULL,&devs);
-	if(cnt < 0){ return NULL; }//no usb devices found
-
-	//spin through devices
-	libusb_device *dev;
-	int i=0;
-	while((dev = devs[i++]) != NULL)
+	for(size_t i=0; i<sizeof(mem_regions)/sizeof(mem_regions[0]); i++)
 	{
-		//get device descriptor
-		libusb_device_descriptor desc;
-		int r = libusb_get_device_descriptor(dev, &desc);
-		if(r != 0){continue;}//failed to get device descriptor for this device
-
-		//if vid and pid match, check the strings
-		if(vid == desc.idVendor && pid == desc.idProduct && desc.iManufacturer > 0 && desc.iProduct > 0)
-		{
-			r = libusb_open(dev,&devH);//open device so we can read strings
-			if(r == LIBUSB_SUCCESS && devH != NULL)
-			{
-				//Get the string associated with iManufacturer index.
-				const int buflen = 256;
-				unsigned char strbuf[buflen];
-				r = libusb_get_string_descriptor_ascii(devH,desc.iManufacturer,strbuf,buflen);
-				TRACE("MFG: %s\n",strbuf);
-				if(!mfg || (r > 0 && strcmp((char*)strbuf,mfg)==0))//mfg string matches
-				{
-					r = libusb_get_string_descriptor_ascii(devH,desc.iProduct,strbuf,buflen);
-					TRACE("PRD: %s\n",strbuf);
-					if(!prd || (r > 0 && strcmp((char*)strbuf,prd)==0))//product string matches
-					{ goto done; }// leave handle open and return the open handle, we found our device.
-				}
-			}
-			else
-			{
-				const char* sError = libusb_error_name(r);
-				ETRACE(sError);		
-			}
-			//close device handle
-			if(devH != NULL )
-			{ libusb_close(devH); devH=NULL; }
-		}
+		if(strcmp(s,mem_regions[i].name)==0){ *adr = mem_regions[i].adr; *len = mem_regions[i].len; return true; }
 	}
-
-	//cleanup and return
-	done:
-	libusb_free_device_list(devs,1);
-	return devH;
+	char* end;
+	*adr = (int)strtol(s,&end,0);
+	if(*end != ':'){ return false; }
+	*len = (int)strtol(end+1,&end,0);
+	return *end == 0 && *adr >= 0 && *len > 0 && *adr + *len <= 0x10000;
 }
 
-bool hid_connect(uint16_t vid, uint16_t pid, const char* mfg, const char* prd)
+//result of one device job
+struct job_result
 {
-	if(m_devh){return false;}
-
-	//open device
-	//m_devh = libusb_open_device_with_vid_pid(NULL,USB_VID,USB_PID);
-    m_devh = hid_open_hiddev(vid,pid,mfg,prd);
-	if(!m_devh){ ETRACE("Failed to open device %04X %04X [%s] [%s]\n",vid,pid,mfg?mfg:"*",prd?prd:"*"); return false; }
+	std::string name;   //bus-port path of the device
+	bool ok;
+	int bytes;          //bytes read plus bytes written
+	double ms;          //time spent transferring
+	int retries;
+};
 
-	//auto detach kernel driver
-	libusb_set_auto_detach_kernel_driver(m_devh,1);
-
-	//claim the usb interface
-	int r = libusb_claim_interface(m_devh, 0);
-	if (r < 0){ ETRACE("Usb claim interface error %d\n", r); hid_disconnect(); return false; }
-	m_interface_claimed = 1;
-	TRACE("Claimed usb interface\n");
+//progress output, skipped when several jobs run at once
+#define PTRACE(o,...) if(!(o).quiet){ TRACE(__VA_ARGS__); }
 
+//read eeprom one byte at a time using blocking read_byte, this is the
+//slow path the transfer engine is measured against
+bool read_eeprom_blocking(xfer_dev& dev, const app_opts& o, U8* eeprom, int toread)
+{
+	PTRACE(o,"000%%");
+	for(int i=0; i<toread; i++)
+	{
+		if(!dev.read_byte(&eeprom[i],i))
+		{ return false; }
+		int iprog = (i+1)*100/toread;
+		if(!o.quiet){ printf("\b\b\b\b%3d%%",iprog); fflush(stdout); }
+	}
+	PTRACE(o,"\n");
 	return true;
 }
 
-//proprietary read byte command for t44a firmware
-bool hid_read_byte(U8* ret_byte, U8 adr)
-{	
-	//command setup
-    #define CMD_READ    'R'
-    #define CMD_WRITE   'W'
-    U8 data[8] = {0,0,0,0,0,0,0,0};
-	data[0] = CMD_READ;
-	data[1] = adr; //address to read
-	
-	//xmt data
-	//EP OUT 0x02 = Endpoint Type 0x00 + Endpoint Number 2
-	int xfer = 0;
-	int r = libusb_interrupt_transfer(m_devh,0x02,data,sizeof(data),&xfer,250);//timeout in 250ms
-	if(r != 0 || xfer != sizeof(data)){ETRACE("USB XMT ERROR %d, SENT %d\n",r,xfer); hid_disconnect(); return false;}
-
-	//wait for response
-	//EP IN 0x81 = Endpoint Type 0x80 + Endpoint Number 1
-	xfer = 0;
-	retry:
-	r = libusb_interrupt_transfer(m_devh,0x81,data,sizeof(data),&xfer,250);//retry every 250ms
-	if(m_run && r == LIBUSB_ERROR_TIMEOUT && xfer == 0)
-	{goto retry;}//if m_run==1 and we have a timeout, try again
-	if(r != 0 || xfer != sizeof(data))
-	{ETRACE("RCV USB ERROR %d, XFER %d\n",r,xfer); hid_disconnect(); return false;}
-	
-	//byte0: CMD_READ, anything else error
-	//byte1: echo adr
-	//byte2: data requested
-	if(data[0] != CMD_READ && data[1] != adr)
-	{ETRACE("ECHO RESPONSE ERROR RSP=%d ADR=%d\n",data[0],adr); hid_disconnect(); return false;}
-	
-	//returned byte of data
-	*ret_byte = data[2];
+//wait for the device to report ready before the first transfer
+//(this replaces a 250ms sleep, the first dump byte sometimes came back as 0xFF
+// because a stale response or an uncalibrated device answered the first request)
+bool wait_ready(xfer_engine& eng, const app_opts& o)
+{
+	U16 nonce = 0;
+	double t0 = time_ms();
+	if(!eng.wait_ready(&nonce)){ return false; }
+	PTRACE(o,"(ready in %.1f ms, session %04X) ",time_ms()-t0,nonce);
 	
+	//responses beyond the device queue would be held or lost, not overwritten, but they still stall
+	xfer_qstats q;
+	if(eng.queue_stats(&q,1)){ eng.limit_depth(q.size); }
 	return true;
 }
 
-//proprietary write byte command for t44a firmware
-bool hid_write_byte(U8* data_byte, U8 adr)
-{	
-	//command setup
-    #define CMD_READ    'R'
-    #define CMD_WRITE   'W'
-    U8 data[8] = {0,0,0,0,0,0,0,0};
-	data[0] = CMD_WRITE; //command
-	data[1] = adr;       //address to write to
-	data[2] = (U8)(*data_byte); //data to write	
-	
-	//xmt data
-	//EP OUT 0x02 = Endpoint Type 0x00 + Endpoint Number 2
-	int xfer = 0;
-	int r = libusb_interrupt_transfer(m_devh,0x02,data,sizeof(data),&xfer,250);//timeout in 250ms
-	if(r != 0 || xfer != sizeof(data)){ETRACE("USB XMT ERROR %d, SENT %d\n",r,xfer); hid_disconnect(); return false;}
-
-	//verify data written
-	U8 verify_byte = 0xFF;
-	if(!hid_read_byte(&verify_byte,adr)){return false;}
-	if(*data_byte != verify_byte){ ETRACE("USB XMT VERIFY ERROR\n"); return false;}
-	
-	return true;
+//report device response queue trouble, requests that had to wait for a free entry or were lost
+void show_queue(xfer_engine& eng, const app_opts& o)
+{
+	xfer_qstats q;
+	if(!eng.queue_stats(&q,1)){ return; }
+	if(q.full || q.lost){ PTRACE(o,"Device response queue of %d was full %d times, %d requests lost\n",q.size,q.full,q.lost); }
+	xfer_flowstats f;
+	if(!eng.flow_stats(&f,1)){ return; }
+	if(f.stalls){ PTRACE(o,"Device NAKed the host %d times for %d ms, queue peaks %d of %d responses, %d of %d EEPROM writes\n",f.stalls,f.stall_ms,f.rsp_peak,q.size,f.ee_peak,f.ee_size); }
+}
+
+//progress display for the transfer engine
+void show_progress(int done, int total)
+{
+	int iprog = done*100/total;
+	printf("\b\b\b\b%3d%%",iprog); fflush(stdout);
+}
+
+//dump file name for one device when several are read, "dump.eep" becomes "dump_1-2.3.eep"
+std::string dev_file(const char* sFile, const char* sName)
+{
+	std::string s = sFile;
+	size_t dot = s.rfind('.');
+	size_t slash = s.rfind('/');
+	if(dot == std::string::npos || (slash != std::string::npos && dot < slash)){ dot = s.size(); }
+	return s.substr(0,dot) + "_" + sName + s.substr(dot);
 }
 
 //proprietary read eeprom or compare eeprom
-bool read_eeprom(const char* sDump, int toread)
+//bytewise uses pipelined per-byte requests instead of a block read
+//speedtest reads again with blocking per-byte requests and reports the speedup
+bool read_eeprom(xfer_dev& dev, const app_opts& o, const char* sDump, job_result& res)
 {
-	//
-	// problem, sometimes dump file first byte is 0xFF,
-	// added 250ms delay before reading, maybe that will fix the issue (it did fix the issue)
-	//
-	
-	TRACE("Reading eeprom ");
-	delay_ms(250);
+	int toread = o.limit;
+	PTRACE(o,"Reading eeprom ");
 	
 	//256 bytes of EEPROM in attiny44a
 	const int eelen = 256;
@@ -272,48 +194,147 @@ bool read_eeprom(const char* sDump, int toread)
 	memset(eeprom,0xFF,sizeof(eeprom));
 	
 	//read entire eeprom, or toread length
-	TRACE("000%%");
-	for(int i=0; i<toread; i++)
+	xfer_engine eng(dev.new_link(o.depth),o.depth,true);
+	if(!o.quiet){ eng.set_progress(show_progress); }
+	if(!eng.start()){ ETRACE("%s: Unable to start transfer engine\n",dev.name()); return false; }
+	if(!wait_ready(eng,o)){ return false; }
+	PTRACE(o,"000%%");
+	double t0 = time_ms();
+	bool ok = false;
+	if(!o.bytewise && !o.interrupt)
 	{
-		if(!hid_read_byte(&eeprom[i],i))
-		{ return false; }
-		int iprog = (i+1)*100/toread;
-		printf("\b\b\b\b%3d%%",iprog); fflush(stdout);
+		//one control transfer, falls back to interrupt reports on firmware without control requests
+		ok = dev.ctl_read(eeprom,0,toread) == toread;
+		if(!ok){ PTRACE(o,"(no control read, using block read) "); }
+	}
+	if(!ok){ ok = o.bytewise ? eng.read(eeprom,0,toread) : eng.read_block(eeprom,0,toread); }
+	double t1 = time_ms();
+	PTRACE(o,"\n");
+	if(ok){ show_queue(eng,o); }
+	eng.stop();
+	if(!ok){ return false; }
+	PTRACE(o,"Read %d bytes in %.1f ms (%.0f bytes/sec, %d retries)\n",toread,t1-t0,toread*1000.0/(t1-t0),eng.retries());
+	res.bytes += toread;
+	res.ms += t1-t0;
+	res.retries += eng.retries();
+	
+	//read again with the blocking per-byte path, and report how much faster the engine is
+	if(o.speedtest)
+	{
+		U8 check[eelen];
+		memset(check,0xFF,sizeof(check));
+		PTRACE(o,"Reading eeprom blocking per byte ");
+		double t2 = time_ms();
+		if(!read_eeprom_blocking(dev,o,check,toread)){ return false; }
+		double t3 = time_ms();
+		PTRACE(o,"Read %d bytes in %.1f ms (%.0f bytes/sec)\n",toread,t3-t2,toread*1000.0/(t3-t2));
+		if(memcmp(eeprom,check,toread) != 0){ ETRACE("%s: Engine read and blocking read do not match\n",dev.name()); return false; }
+		PTRACE(o,"Speedup %.1fx\n",(t3-t2)/(t1-t0));
 	}
-	TRACE("\n");
 	
-	//we have a dump file, so we are reading, not comparing
+	//we have a dump file, comparing is done by CRC on the device, see verify_file()
 	if(sDump)
 	{
-		TRACE("Saving: %s\n",sDump);
+		PTRACE(o,"Saving: %s\n",sDump);
 		FILE* pFile = fopen(sDump,"wb");
 		if(!pFile){ ETRACE("Unable to write file: %s\n",sDump); return false; }
 		size_t written = fwrite(eeprom,1,toread,pFile);
 		fclose(pFile);
 		if(written != (size_t)toread){ ETRACE("Only wrote %lu of %d bytes\n",written,eelen); return false; }
 	}
-	else
+	
+	return true;
+}
+
+//read a region of the data space and show it as hex
+bool read_memory(xfer_dev& dev, const app_opts& o, job_result& res)
+{
+	PTRACE(o,"Reading %s ",o.sMem);
+	std::vector<U8> buf(o.mem_len,0xFF);
+	xfer_engine eng(dev.new_link(o.depth),o.depth,true);
+	if(!o.quiet){ eng.set_progress(show_progress); }
+	if(!eng.start()){ ETRACE("%s: Unable to start transfer engine\n",dev.name()); return false; }
+	if(!wait_ready(eng,o)){ return false; }
+	PTRACE(o,"000%%");
+	double t0 = time_ms();
+	bool ok = eng.read_mem(buf.data(),o.mem_adr,o.mem_len);
+	double t1 = time_ms();
+	eng.stop();
+	PTRACE(o,"\n");
+	if(!ok){ return false; }
+	PTRACE(o,"Read %d bytes in %.1f ms (%.0f bytes/sec, %d retries)\n",o.mem_len,t1-t0,o.mem_len*1000.0/(t1-t0),eng.retries());
+	res.bytes += o.mem_len;
+	res.ms += t1-t0;
+	res.retries += eng.retries();
+	for(int i=0; i<o.mem_len; i+=16)
 	{
-		//TODO, compare with file
-		//load up all .eep files in current directory, compare with them.
-		//check what kind of memory we had
-		//dump to file, then compare to make sure it is correct.
-		//or we could just have a bash script do this junk		
+		TRACE("%04X:",o.mem_adr+i);
+		for(int k=0; k<16 && i+k<o.mem_len; k++){ TRACE(" %02X",buf[i+k]); }
+		TRACE("\n");
 	}
 	
+	//SIGROW serial number, SERNUM0 to SERNUM9
+	if(o.mem_adr <= 0x1103 && o.mem_adr + o.mem_len >= 0x110D)
+	{
+		TRACE("%s serial number ",dev.name());
+		for(int k=0; k<10; k++){ TRACE("%02X",buf[0x1103 - o.mem_adr + k]); }
+		TRACE("\n");
+	}
 	return true;
 }
 
-//proprietary read eeprom or compare eeprom
-bool write_eeprom(const char* sWrite, int towrite)
+//compare a file with the device by CRC16, the device computes its side over the same range
+//eeprom compares up to -limit bytes of a binary file, flash loads an Intel hex or binary image
+//(as -flash-app does) and compares the range it uses, from the 256 byte block it starts in
+bool verify_file(xfer_dev& dev, const app_opts& o, job_result& res)
 {
-	//
-	// problem, sometimes dump file first byte is 0xFF,
-	// added 250ms delay before reading, maybe that will fix the issue (it did fix the issue)
-	//
+	std::vector<U8> buf;
+	int adr = 0;
+	int len = 0;
+	if(o.flash)
+	{
+		int end = boot_load_image(o.sVerify,buf);
+		int start = 0;
+		while(start < end && buf[start] == 0xFF){ start++; }
+		adr = start & ~0xFF; //the app starts on a BOOTEND boundary
+		len = end - adr;
+	}
+	else
+	{
+		buf.resize(256);
+		FILE* pFile = fopen(o.sVerify,"rb");
+		if(!pFile){ ETRACE("Unable to read file: %s\n",o.sVerify); return false; }
+		len = (int)fread(buf.data(),1,buf.size(),pFile);
+		fclose(pFile);
+		if(len > o.limit){ len = o.limit; }
+	}
+	if(len < 1){ ETRACE("Empty file: %s\n",o.sVerify); return false; }
+	PTRACE(o,"Verifying %s %s ",o.flash ? "flash" : "eeprom",o.sVerify);
 	
-	TRACE("Writing eeprom ");
-	delay_ms(250);
+	xfer_engine eng(dev.new_link(o.depth),o.depth,true);
+	if(!eng.start()){ ETRACE("%s: Unable to start transfer engine\n",dev.name()); return false; }
+	if(!wait_ready(eng,o)){ return false; }
+	double t0 = time_ms();
+	U16 crc_dev = 0;
+	bool ok = eng.range_crc(&crc_dev,o.flash ? XFER_SPACE_FLASH : XFER_SPACE_EE,adr,len);
+	double t1 = time_ms();
+	eng.stop();
+	PTRACE(o,"\n");
+	if(!ok){ return false; }
+	U16 crc_file = crc16_usb(&buf[adr],len);
+	res.ms += t1-t0;
+	if(crc_dev != crc_file){ ETRACE("%s: %d bytes at %04X DIFFER, device CRC %04X, file CRC %04X\n",dev.name(),len,adr,crc_dev,crc_file); return false; }
+	PTRACE(o,"%d bytes at %04X MATCH, CRC %04X in %.1f ms\n",len,adr,crc_dev,t1-t0);
+	return true;
+}
+
+//proprietary write eeprom
+//the writes are streamed and then verified with one device CRC over the range,
+//readback verifies every byte with a read request instead (the old, slower way)
+bool write_eeprom(xfer_dev& dev, const app_opts& o, job_result& res)
+{
+	int towrite = o.limit;
+	PTRACE(o,"Writing eeprom ");
 	
 	//256 bytes of EEPROM in attiny44a
 	const int eelen = 256;
@@ -321,8 +342,8 @@ bool write_eeprom(const char* sWrite, int towrite)
 	memset(eeprom,0xFF,sizeof(eeprom));
 	
 	//read file into eeprom memory
-	FILE* pFile = fopen(sWrite,"rb");
-	if(!pFile){ ETRACE("Unable to read file: %s\n",sWrite); return false; }
+	FILE* pFile = fopen(o.sWrite,"rb");
+	if(!pFile){ ETRACE("Unable to read file: %s\n",o.sWrite); return false; }
 
 	//obtain file size:
 	//fseek(pFile,0,SEEK_END);
@@ -335,23 +356,428 @@ bool write_eeprom(const char* sWrite, int towrite)
 	if((int)result < towrite){ ETRACE("Only read %lu bytes from file, wanted %d\n",result,towrite); return false; }		
 	
 	//write entire eeprom, or towrite length
-	TRACE("000%%");
-	for(int i=0; i<towrite; i++)
+	xfer_engine eng(dev.new_link(o.depth),o.depth,true);
+	if(!o.quiet){ eng.set_progress(show_progress); }
+	if(!eng.start()){ ETRACE("%s: Unable to start transfer engine\n",dev.name()); return false; }
+	if(!wait_ready(eng,o)){ return false; }
+	PTRACE(o,"000%%");
+	double t0 = time_ms();
+	if(!o.readback)
 	{
-		if(!hid_write_byte(&eeprom[i],i))
-		{ return false; }
-		int iprog = (i+1)*100/towrite;
-		printf("\b\b\b\b%3d%%",iprog); fflush(stdout);
+		//one control transfer, then verify with range CRC, interrupt writes fix up whatever does not match
+		bool ok = false;
+		if(!o.interrupt && dev.ctl_write(eeprom,0,towrite))
+		{
+			U16 crc_dev = 0;
+			ok = eng.crc(&crc_dev,0,towrite) && crc_dev == crc16_usb(eeprom,towrite);
+			if(!ok){ PTRACE(o,"(control write did not verify, using interrupt writes) "); }
+		}
+		
+		//stream writes, verify with range CRC
+		if(!ok){ ok = eng.write_verify(eeprom,0,towrite); }
+		PTRACE(o,"\n");
+		if(ok){ show_queue(eng,o); }
+		eng.stop();
+		if(!ok){ return false; }
 	}
-	TRACE("\n");
+	else
+	{
+		if(!eng.write(eeprom,0,towrite)){ PTRACE(o,"\n"); return false; }
+		
+		//verify data written
+		PTRACE(o,"\nVerifying eeprom 000%%");
+		U8 verify[eelen];
+		if(!eng.read(verify,0,towrite)){ PTRACE(o,"\n"); return false; }
+		eng.stop();
+		PTRACE(o,"\n");
+		for(int i=0; i<towrite; i++)
+		{
+			if(eeprom[i] != verify[i]){ ETRACE("%s: USB XMT VERIFY ERROR ADR=%d WROTE=%02X READ=%02X\n",dev.name(),i,eeprom[i],verify[i]); return false; }
+		}
+	}
+	double t1 = time_ms();
+	PTRACE(o,"Wrote %d bytes in %.1f ms (%.0f bytes/sec, %d retries)\n",towrite,t1-t0,towrite*1000.0/(t1-t0),eng.retries());
+	res.bytes += towrite;
+	res.ms += t1-t0;
+	res.retries += eng.retries();
 	
 	return true;
 }
 
+//read and or write one connected device
+void run_job(xfer_dev& dev, const app_opts& o, job_result& res)
+{
+	res.name = dev.name();
+	res.ok = false;
+	res.bytes = 0;
+	res.ms = 0;
+	res.retries = 0;
+	
+	//communicate
+	if(o.sDump)
+	{
+		std::string sDump = o.quiet ? dev_file(o.sDump,dev.name()) : o.sDump;
+		if(!read_eeprom(dev,o,sDump.c_str(),res))
+		{ ETRACE("%s: Unable to communicate with device\n",dev.name()); return; }
+	}
+	
+	//write to device
+	if(o.sWrite)
+	{
+		if(!write_eeprom(dev,o,res))
+		{ ETRACE("%s: Unable to communicate with device\n",dev.name()); return; }
+	}
+	
+	//show a memory region
+	if(o.sMem)
+	{
+		if(!read_memory(dev,o,res))
+		{ ETRACE("%s: Unable to communicate with device\n",dev.name()); return; }
+	}
+	
+	//compare with a file
+	if(o.sVerify)
+	{
+		if(!verify_file(dev,o,res)){ return; }
+	}
+	
+	res.ok = true;
+}
+
+//opens device i of a run_all() list, 0 if it can not be opened
+typedef std::function<xfer_dev*(int i)> dev_open_fn;
+
+//run a job on every device in names, "jobs" devices at a time
+//each worker thread opens its own client, nothing else is shared
+int run_all(const std::vector<std::string>& names, dev_open_fn open_dev, const app_opts& o, int jobs)
+{
+	int cnt = (int)names.size();
+	if(cnt == 0){ ETRACE("No devices found %04X %04X\n",USB_VID,USB_PID); return 0; }
+	if(jobs > cnt){ jobs = cnt; }
+	TRACE("Found %d devices, running %d at a time\n",cnt,jobs);
+	
+	//worker pool, each worker takes the next device until there are none left
+	std::vector<job_result> results(cnt);
+	std::atomic<int> next(0);
+	std::vector<std::thread> workers;
+	double t0 = time_ms();
+	for(int w=0; w<jobs; w++)
+	{
+		workers.push_back(std::thread([&]()
+		{
+			for(int i = next++; i < cnt; i = next++)
+			{
+				std::unique_ptr<xfer_dev> dev(open_dev(i));
+				if(!dev)
+				{
+					results[i].name = names[i];
+					results[i].ok = false;
+					results[i].bytes = 0;
+					results[i].ms = 0;
+					results[i].retries = 0;
+					continue;
+				}
+				run_job(*dev,o,results[i]);
+			}//client closed here
+		}));
+	}
+	for(size_t w=0; w<workers.size(); w++){ workers[w].join(); }
+	double t1 = time_ms();
+	
+	//per device results
+	int good = 0;
+	int total = 0;
+	TRACE("%-16s %-6s %8s %10s %8s\n","DEVICE","RESULT","MS","BYTES/SEC","RETRIES");
+	for(int i=0; i<cnt; i++)
+	{
+		job_result& r = results[i];
+		if(r.ok){ good++; total += r.bytes; }
+		if(r.ok){ TRACE("%-16s " C_GRN "%-6s" C_RESET " %8.1f %10.0f %8d\n",r.name.c_str(),"OK",r.ms,r.ms > 0 ? r.bytes*1000.0/r.ms : 0.0,r.retries); }
+		else    { TRACE("%-16s " C_RED "%-6s" C_RESET "\n",r.name.c_str(),"FAIL"); }
+	}
+	TRACE("%d of %d devices OK, %d bytes in %.1f ms (%.0f bytes/sec aggregate)\n",good,cnt,total,t1-t0,total*1000.0/(t1-t0));
+	return good == cnt ? 0 : 1;
+}
+
+//benchmark an open device
+int run_bench(xfer_dev& dev, const app_opts& o, const char* sBench, bench_mode mode, int ops, int size)
+{
+	xfer_engine eng(dev.new_link(o.depth),o.depth,true);
+	TRACE("Benchmark %s, device %s\n",sBench,dev.name());
+	if(!eng.start() || !wait_ready(eng,o)){ return 1; }
+	TRACE("\n");
+	if(!bench_run(eng,mode,ops,size)){ return 1; }
+
+	//device side, for sizing the firmware queues
+	xfer_qstats q;
+	xfer_flowstats f;
+	if(eng.queue_stats(&q) && eng.flow_stats(&f))
+	{
+		TRACE("Device queue peaks %d of %d responses, %d of %d EEPROM writes\n",f.rsp_peak,q.size,f.ee_peak,f.ee_size);
+		TRACE("Device NAKed the host %d times for %d ms, held %d, lost %d\n",f.stalls,f.stall_ms,q.full,q.lost);
+	}
+	return 0;
+}
+
+//capture streaming telemetry into a file for a number of seconds
+int run_stream(hid_client& dev, const char* sFile, int rate, int seconds)
+{
+	stream_capture cap(dev.context(),dev.handle());
+	TRACE("Streaming %d samples/sec from %s into %s for %d sec\n",rate,dev.name(),sFile,seconds);
+	if(!cap.start(sFile,rate)){ ETRACE("Unable to start streaming\n"); return 1; }
+	delay_ms(seconds * 1000);
+	stream_stats st;
+	bool ok = cap.stop(&st);
+	if(!ok){ ETRACE("No stop response, device counts are missing\n"); }
+	TRACE("%u samples in %u reports, %.1f ms (%.0f samples/sec, %.0f bytes/sec)\n",st.samples,st.reports,st.ms,st.samples*1000.0/st.ms,st.reports*XFER_RPT_LEN*1000.0/st.ms);
+	TRACE("Dropped %u samples on the device, %u reports missing, %u reports over the host ring\n",st.dropped,st.lost,st.ring_full);
+	if(ok){ TRACE("Device sent %u samples and dropped %u\n",st.dev_samples,st.dev_dropped); }
+	return ok ? 0 : 1;
+}
+
+//parse a pin list such as "a3,a4,b0" into PORTA and PORTB masks
+bool gpio_parse(const char* s, U8* mask_a, U8* mask_b)
+{
+	*mask_a = *mask_b = 0;
+	while(*s)
+	{
+		char prt = s[0] | 0x20; //lower case
+		if((prt != 'a' && prt != 'b') || s[1] < '0' || s[1] > '7'){ return false; }
+		if(prt == 'a'){ *mask_a |= 1 << (s[1]-'0'); }
+		else          { *mask_b |= 1 << (s[1]-'0'); }
+		s += 2;
+		if(*s == ','){ s++; }
+	}
+	return *mask_a || *mask_b;
+}
+
+//pin state as text, "a3=1 a4=0 b0=1", changed pins are marked with *
+std::string gpio_text(U8 mask_a, U8 mask_b, U8 pins_a, U8 pins_b, U8 chg_a, U8 chg_b)
+{
+	std::string t;
+	char buf[16];
+	for(int i=0; i<16; i++)
+	{
+		U8 m = 1 << (i & 7);
+		if(!((i < 8 ? mask_a : mask_b) & m)){ continue; }
+		snprintf(buf,sizeof(buf),"%c%d=%d%s ",i < 8 ? 'a' : 'b',i & 7,((i < 8 ? pins_a : pins_b) & m) ? 1 : 0,((i < 8 ? chg_a : chg_b) & m) ? "*" : " ");
+		t += buf;
+	}
+	return t;
+}
+
+//subscribe to pin changes and print every 'E' report for a number of seconds
+int run_watch(xfer_dev& dev, const app_opts& o, U8 mask_a, U8 mask_b, int seconds)
+{
+	xfer_engine eng(dev.new_link(1),1,true);
+	if(!eng.start() || !wait_ready(eng,o)){ return 1; }
+	xfer_gpio sub;
+	if(!eng.gpio_subscribe(mask_a,mask_b,&sub)){ ETRACE("%s: Unable to subscribe\n",dev.name()); return 1; }
+	if(!sub.mask_a && !sub.mask_b){ ETRACE("%s: no pins left to watch, the USB pins can not be watched\n",dev.name()); return 1; }
+	if(!sub.ticks_ms){ sub.ticks_ms = 1; }
+	TRACE("Watching %s for %d sec\n",gpio_text(sub.mask_a,sub.mask_b,sub.pins_a,sub.pins_b,0,0).c_str(),seconds);
+	
+	//device time is 16 bit, unwrap it with the host clock between reports
+	double t0 = time_ms();
+	double t_prev = 0;
+	double dev_ms = 0;
+	U16 prev_ticks = 0;
+	int events = 0, changes = 0;
+	xfer_gpio g;
+	while(time_ms() - t0 < seconds * 1000.0)
+	{
+		if(!eng.gpio_event(&g,100)){ continue; }
+		double t = time_ms() - t0;
+		if(events)
+		{
+			double d = (U16)(g.ticks - prev_ticks);
+			d += 65536.0 * (int)(((t - t_prev) * sub.ticks_ms - d) / 65536.0 + 0.5);
+			dev_ms += d / sub.ticks_ms;
+		}
+		else{ dev_ms = t; }
+		t_prev = t;
+		prev_ticks = g.ticks;
+		events++;
+		changes += g.changes;
+		TRACE("%10.1f ms  dev %10.2f ms  %s (%d change%s)\n",t,dev_ms,gpio_text(sub.mask_a,sub.mask_b,g.pins_a,g.pins_b,g.chg_a,g.chg_b).c_str(),g.changes,g.changes == 1 ? "" : "s");
+	}
+	eng.gpio_subscribe(0,0,&sub);
+	TRACE("%d reports, %d changes\n",events,changes);
+	return 0;
+}
+
+//oscillator drift tracker state and its history, one entry about every second, newest last
+int run_drift(xfer_dev& dev, const app_opts& o)
+{
+	xfer_engine eng(dev.new_link(1),1,true);
+	if(!eng.start() || !wait_ready(eng,o)){ return 1; }
+	xfer_drift d;
+	if(!eng.drift(&d)){ ETRACE("%s: Unable to read drift\n",dev.name()); return 1; }
+	if(!d.cycles){ d.cycles = 1; }
+	TRACE("%s: OSC20MCALIBA %d, %d step%s since power up, error %+.1f cycles per frame (%+.3f%%)\n",dev.name(),d.cal,d.nudges,d.nudges == 1 ? "" : "s",d.err,d.err*100/d.cycles);
+	for(size_t i=0; i<d.hist.size(); i++)
+	{
+		int sec = (int)(d.hist.size() - i);
+		double pct = d.hist[i]*100.0/d.cycles;
+		int bar = (int)(pct * 40 + (pct < 0 ? -0.5 : 0.5)); //0.025% per column
+		if(bar > 20){ bar = 20; }
+		if(bar < -20){ bar = -20; }
+		TRACE("%5d s %+4d %+.3f%% %*s%s\n",-sec,d.hist[i],pct,20 + (bar < 0 ? bar : 0),"",std::string(bar < 0 ? -bar : bar,bar < 0 ? '-' : '+').c_str());
+	}
+	return 0;
+}
+
+//firmware scheduler stats, every task of the table
+int run_tasks(xfer_dev& dev, const app_opts& o)
+{
+	xfer_engine eng(dev.new_link(1),1,true);
+	if(!eng.start() || !wait_ready(eng,o)){ return 1; }
+	TRACE("%s: scheduler tasks\n%4s %8s %8s %6s %6s\n",dev.name(),"TASK","BUDGET","WORST","OVER","SKIP");
+	for(int i=0; i<256; i++)
+	{
+		xfer_task t;
+		if(!eng.task_stats(i,&t)){ ETRACE("%s: Unable to read task %d\n",dev.name(),i); return 1; }
+		if(!t.budget){ break; }
+		TRACE("%4d %8d %8d %6d %6d%s\n",i,t.budget,t.worst,t.over,t.skip,t.over ? "  over budget" : "");
+	}
+	return 0;
+}
+
+//name of a usbPoll() call site (USB_SITE_xxx in usb.h)
+std::string poll_site_name(int site)
+{
+	static const char* names[] = {"usbPoll","usbPollGpio","usbPollSendtoHost","usbPollEeprom","usbPollOscSave","usbPollCrc","usbFlowPoll","usbPollStream","usbPollSof","main loop"};
+	char buf[32];
+	if(site & 0x80){ snprintf(buf,sizeof(buf),"task %d",site & 0x7F); return buf; }
+	if(site < (int)(sizeof(names)/sizeof(names[0]))){ return names[site]; }
+	snprintf(buf,sizeof(buf),"site %d",site);
+	return buf;
+}
+
+//gaps between usbPoll() calls on the device, bars are log scale, 4 columns per decade
+//op clears the stats after they are read (XFER_POLLS_xxx), alarm_ms is the new threshold for XFER_POLLS_ALARM
+int run_polls(xfer_dev& dev, const app_opts& o, U8 op, int alarm_ms)
+{
+	xfer_engine eng(dev.new_link(1),1,true);
+	if(!eng.start() || !wait_ready(eng,o)){ return 1; }
+	xfer_polls p;
+	if(!eng.polls(&p,op,alarm_ms)){ ETRACE("%s: Unable to read usbPoll() stats\n",dev.name()); return 1; }
+	if(!p.alarm_ms || !p.ticks_ms){ ETRACE("%s: firmware built without USB_POLL_STATS, build it with -DUSB_POLL_STATS=1\n",dev.name()); return 1; }
+	double tick = 1.0 / p.ticks_ms; //ms
+	TRACE("%s: usbPoll() gaps, worst %.3f ms in %s, %d over %d ms\n",dev.name(),p.worst*tick,poll_site_name(p.site).c_str(),p.alarms,p.alarm_ms);
+	int last = 0;
+	for(int i=0; i<(int)p.hist.size(); i++){ if(p.hist[i]){ last = i; } }
+	TRACE("%10s %10s %9s\n","FROM(ms)","TO(ms)","COUNT");
+	for(int i=0; i<=last; i++)
+	{
+		double lo = i ? (1 << (i-1)) * tick : 0;
+		double hi = (1 << i) * tick;
+		int bar = 0;
+		for(U32 c=p.hist[i]; c; c/=10){ bar += 4; }
+		char to[16];
+		if(i == XFER_POLLS_BINS-1){ snprintf(to,sizeof(to),"-"); }
+		else { snprintf(to,sizeof(to),"%.3f",hi); }
+		const char* mark = !p.hist[i] || hi <= p.alarm_ms ? "" : lo >= p.alarm_ms ? "  alarm" : "  some may be alarms";
+		TRACE("%10.3f %10s %9u %s%s\n",lo,to,p.hist[i],std::string(bar,'#').c_str(),mark);
+	}
+	if(op == XFER_POLLS_ALARM){ TRACE("%s: cleared, alarm at %d ms\n",dev.name(),alarm_ms); }
+	else if(op == XFER_POLLS_CLEAR){ TRACE("%s: cleared\n",dev.name()); }
+	return 0;
+}
+
+//reconnect the device with 'O' op and time it, from the response until it answers again
+//st gets the calibrations the device made meanwhile, returns the time, 0 on error
+double osc_reconnect(libusb_context* ctx, hid_discovery& disc, const app_opts& o, const char* mfg, const char* prd, const char* serial, U8 op, xfer_osc* st)
+{
+	libusb_device* old = 0;
+	double t0 = 0;
+	{
+		hid_client dev(ctx);
+		if(!dev.connect(disc,mfg,prd,serial)){ ETRACE("Unable to open device\n"); return 0; }
+		xfer_engine eng(dev.new_link(1),1,true);
+		if(!eng.start() || !wait_ready(eng,o) || !eng.osc(op,st)){ ETRACE("%s: Unable to communicate with device\n",dev.name()); return 0; }
+		t0 = time_ms();
+		old = libusb_ref_device(libusb_get_device(dev.handle()));
+	}//closed here
+	
+	//the old device leaves the index first, whatever arrives after it is the new session
+	for(;;)
+	{
+		libusb_device* d = disc.find(mfg,prd,serial,0);
+		if(d){ libusb_unref_device(d); }
+		if(d != old){ break; }
+		if(time_ms() - t0 > OSC_WAIT_MS){ libusb_unref_device(old); ETRACE("Device did not leave the bus\n"); return 0; }
+		delay_ms(1);
+	}
+	libusb_unref_device(old);
+	hid_client dev(ctx);
+	if(!dev.connect(disc,mfg,prd,serial,OSC_WAIT_MS)){ ETRACE("Device did not come back\n"); return 0; }
+	xfer_engine eng(dev.new_link(1),1,true);
+	if(!eng.start() || !wait_ready(eng,o)){ return 0; }
+	double t = time_ms() - t0;
+	if(!eng.osc(XFER_OSC_STATS,st)){ return 0; }
+	return t;
+}
+
+//oscillator calibration, and enumeration time without and with the value kept in USERROW
+int run_osc(libusb_context* ctx, hid_discovery& disc, const app_opts& o, const char* mfg, const char* prd, const char* serial)
+{
+	static const char* from[] = {"the factory value","USERROW","the last USB reset"};
+	xfer_osc st;
+	{
+		hid_client dev(ctx);
+		if(!dev.connect(disc,mfg,prd,serial)){ ETRACE("Unable to open device\n"); return 1; }
+		xfer_engine eng(dev.new_link(1),1,true);
+		if(!eng.start() || !wait_ready(eng,o) || !eng.osc(XFER_OSC_STATS,&st)){ ETRACE("%s: Unable to communicate with device\n",dev.name()); return 1; }
+		TRACE("%s: OSC20MCALIBA %d (factory %d), last calibration started from %s, %d measurement%s\n",dev.name(),st.cal,st.factory,from[st.from % 3],st.steps,st.steps == 1 ? "" : "s");
+	}
+	xfer_osc cold, warm;
+	double t_cold = osc_reconnect(ctx,disc,o,mfg,prd,serial,XFER_OSC_FORGET_RECONNECT,&cold);
+	if(!t_cold){ return 1; }
+	double t_warm = osc_reconnect(ctx,disc,o,mfg,prd,serial,XFER_OSC_RECONNECT,&warm);
+	if(!t_warm){ return 1; }
+	TRACE("\nReconnect times include %d ms off the bus\n",OSC_OFF_MS);
+	TRACE("Without USERROW value: ready in %6.1f ms, %3d measurements, %5.1f ms calibrating\n",t_cold,cold.total,cold.ms);
+	TRACE("With USERROW value:    ready in %6.1f ms, %3d measurements, %5.1f ms calibrating\n",t_warm,warm.total,warm.ms);
+	TRACE("OSC20MCALIBA %d, kept in USERROW\n",warm.cal);
+	return 0;
+}
+
+//daemon wants absolute paths, it does not share our working directory
+std::string abs_path(const char* sFile)
+{
+	if(sFile[0] == '/'){ return sFile; }
+	char cwd[1024];
+	if(!getcwd(cwd,sizeof(cwd))){ return sFile; }
+	return std::string(cwd) + "/" + sFile;
+}
+
+//send requests to a running daemon, -read and -write become dump and load requests
+int run_client(const char* sSock, const app_opts& o, const char* sCmd)
+{
+	std::vector<std::string> rqs;
+	if(o.sDump){ rqs.push_back("dump " + abs_path(o.sDump) + " " + std::to_string(o.limit)); }
+	if(o.sWrite)
+	{
+		rqs.push_back("load " + abs_path(o.sWrite) + " " + std::to_string(o.limit));
+		rqs.push_back("flush");//the write is on the device when we return
+	}
+	if(sCmd){ rqs.push_back(sCmd); }
+	for(size_t i=0; i<rqs.size(); i++)
+	{
+		std::string rsp;
+		double t0 = time_ms();
+		if(!daemon_request(sSock,rqs[i].c_str(),rsp)){ ETRACE("Unable to reach daemon on %s\n",sSock); return 1; }
+		TRACE("%s -> %s (%.1f ms)\n",rqs[i].c_str(),rsp.c_str(),time_ms()-t0);
+		if(rsp.compare(0,2,"OK") != 0){ return 1; }
+	}
+	return 0;
+}
+
 void signal_handler(int sig)
 {
+   //the kernel releases claimed interfaces when the process exits
    printf("Caught signal %d\n",sig);
-   hid_shutdown();
    exit(1); 
 }
 
@@ -362,9 +788,49 @@ int main(int argc, char **argv)
 	printf("TinyAvr HID USB Test App [press CTRL+C to exit]\n");
 	
 	//check arguments
-	const char* sDump = 0;
-	const char* sWrite = 0;
-	int mylimit = 256; //default is read entire eeprom
+	app_opts o;
+	o.sDump = 0;
+	o.sWrite = 0;
+	o.sVerify = 0;
+	o.flash = false;
+	o.sMem = 0;
+	o.mem_adr = 0;
+	o.mem_len = 0;
+	o.limit = 256; //default is read entire eeprom
+	o.depth = 4;
+	o.bytewise = false;
+	o.speedtest = false;
+	o.readback = false;
+	o.interrupt = false;
+	o.quiet = false;
+	bool all = false;
+	bool daemon = false;
+	const char* sSock = 0;
+	const char* sCmd = 0;
+	const char* sBench = 0;
+	const char* sApp = 0;
+	const char* sStream = 0;
+	const char* sWatch = 0;
+	bool osc = false;
+	bool drift = false;
+	bool tasks = false;
+	bool polls = false;
+	U8 polls_op = XFER_POLLS_READ;
+	int poll_alarm = 0;
+	U8 watch_a = 0, watch_b = 0;
+	int stream_rate = STREAM_RATE;
+	int stream_sec = 10;
+	int bench_ops = 200;
+	int bench_size = 16;
+	bool sim = false;
+	bool hidraw = false;
+	int sim_interval = SIM_INTERVAL_MS;
+	bool list = false;
+	const char* sMfg = 0;
+	const char* sPrd = 0;
+	const char* sSerial = 0;
+	int jobs = 4;
+	int ret = 0;
 	
 	//no args?
 	if(argc == 1)
@@ -374,6 +840,40 @@ int main(int argc, char **argv)
 		printf("-read  <file>    #create a eeprom dump file\n");
 		printf("-write <file>    #write eeprom dump file to device\n");
 		printf("-limit <bytes>   #number of eeprom bytes to read 1 to 256\n");
+		printf("-verify <file>   #compare file with the device by CRC, nothing is read back\n");
+		printf("-flash           #-verify compares flash with an Intel hex or binary image instead of eeprom\n");
+		printf("-flash-app <file> #flash an app .hex or .bin through the USB bootloader, unchanged pages are skipped\n");
+		printf("-stream <file>   #capture streaming telemetry (8 bit ADC samples) into a file\n");
+		printf("-rate <hz>       #-stream sample rate %d to %d, default %d\n",STREAM_RATE_MIN,STREAM_RATE_MAX,STREAM_RATE);
+		printf("-seconds <n>     #-stream and -watch time, default 10\n");
+		printf("-watch <pins>    #report pin changes as the device sends them, such as a3,a4,b0\n");
+		printf("-osc             #show the oscillator calibration, time enumeration without and with the value kept in USERROW\n");
+		printf("-drift           #show the oscillator drift the device followed, about one entry per second\n");
+		printf("-tasks           #show the firmware scheduler tasks, their cycle budgets and the longest runs\n");
+		printf("-polls           #show the gaps between usbPoll() calls on the device, the worst one and what ran during it\n");
+		printf("-polls-clear     #-polls, then clear them on the device\n");
+		printf("-poll-alarm <ms> #-polls, then clear them and set the alarm threshold, 1 to 255\n");
+		printf("-mem <region>    #show memory, io, sigrow, fuses, userrow, eeprom, sram, flash or <adr>:<len>\n");
+		printf("-bytewise        #read one byte per request instead of block reads\n");
+		printf("-speedtest       #read again with blocking per byte requests, report speedup\n");
+		printf("-depth <n>       #requests in flight 1 to 64, default 4\n");
+		printf("-readback        #verify writes by reading every byte back, instead of a range CRC\n");
+		printf("-interrupt       #use interrupt reports only, no control transfers\n");
+		printf("-all             #run on every connected device, dump files get the device path appended\n");
+		printf("-jobs <n>        #devices to run at once with -all, default 4\n");
+		printf("-list            #list discovered devices and their strings\n");
+		printf("-hidraw          #use /dev/hidrawN instead of libusb, the kernel HID driver stays attached\n");
+		printf("-mfg <string>    #open the device with this manufacturer string\n");
+		printf("-prd <string>    #open the device with this product string\n");
+		printf("-serial <string> #open the device with this serial number string\n");
+		printf("-daemon          #hold the device open and serve requests on a unix socket\n");
+		printf("-sock <path>     #daemon socket, default %s, -read and -write go through the daemon\n",DAEMON_SOCK);
+		printf("-cmd <request>   #send one request line to the daemon, such as \"read 0 16\" or \"stats\"\n");
+		printf("-bench <mode>    #benchmark read, block, write, mixed or frame operations, report latency and bytes/sec\n");
+		printf("-ops <n>         #benchmark operations, default 200\n");
+		printf("-size <bytes>    #bytes per benchmark operation, default 16\n");
+		printf("-sim             #benchmark a simulated device instead of the real one\n");
+		printf("-sim-interval <ms> #simulated poll interval, default %d\n",SIM_INTERVAL_MS);
 		exit(0);		
 	}
 	
@@ -387,60 +887,367 @@ int main(int argc, char **argv)
 		if(strcmp("-read",argv[i])==0 && (i+1)<argc)//dump eeprom to file
 		{
 			//get next argument
-			i++; sDump = argv[i];			
+			i++; o.sDump = argv[i];			
 		}
 		if(strcmp("-limit",argv[i])==0 && (i+1)<argc)//dump eeprom to file
 		{
 			//get next argument
-			i++; mylimit = atoi(argv[i]);
-			if(mylimit < 1){mylimit=1;}
-			if(mylimit > 256){mylimit=256;}			
+			i++; o.limit = atoi(argv[i]);
+			if(o.limit < 1){o.limit=1;}
+			if(o.limit > 256){o.limit=256;}			
 		}
 		if(strcmp("-write",argv[i])==0 && (i+1)<argc)//dump eeprom to file
 		{
 			//get next argument
-			i++; sWrite = argv[i];		
+			i++; o.sWrite = argv[i];		
 		}		
+		if(strcmp("-verify",argv[i])==0 && (i+1)<argc)//compare file by CRC
+		{
+			//get next argument
+			i++; o.sVerify = argv[i];
+		}
+		if(strcmp("-mem",argv[i])==0 && (i+1)<argc)//show memory
+		{
+			//get next argument
+			i++; o.sMem = argv[i];
+			if(!mem_parse(o.sMem,&o.mem_adr,&o.mem_len)){ ETRACE("Unknown memory region: %s\n",o.sMem); return 1; }
+		}
+		if(strcmp("-flash-app",argv[i])==0 && (i+1)<argc)//flash through the bootloader
+		{
+			//get next argument
+			i++; sApp = argv[i];
+		}
+		if(strcmp("-stream",argv[i])==0 && (i+1)<argc)//telemetry capture
+		{
+			//get next argument
+			i++; sStream = argv[i];
+		}
+		if(strcmp("-rate",argv[i])==0 && (i+1)<argc)//telemetry sample rate
+		{
+			//get next argument
+			i++; stream_rate = atoi(argv[i]);
+			if(stream_rate < STREAM_RATE_MIN){stream_rate=STREAM_RATE_MIN;}
+			if(stream_rate > STREAM_RATE_MAX){stream_rate=STREAM_RATE_MAX;}
+		}
+		if(strcmp("-seconds",argv[i])==0 && (i+1)<argc)//telemetry capture time
+		{
+			//get next argument
+			i++; stream_sec = atoi(argv[i]);
+			if(stream_sec < 1){stream_sec=1;}
+		}
+		if(strcmp("-watch",argv[i])==0 && (i+1)<argc)//pin change notifications
+		{
+			//get next argument
+			i++; sWatch = argv[i];
+			if(!gpio_parse(sWatch,&watch_a,&watch_b)){ ETRACE("Bad pin list: %s\n",sWatch); return 1; }
+		}
+		if(strcmp("-osc",argv[i])==0)//oscillator calibration
+		{
+			osc = true;
+		}
+		if(strcmp("-drift",argv[i])==0)//oscillator drift history
+		{
+			drift = true;
+		}
+		if(strcmp("-tasks",argv[i])==0)//scheduler stats
+		{
+			tasks = true;
+		}
+		if(strcmp("-polls",argv[i])==0)//usbPoll() gaps
+		{
+			polls = true;
+		}
+		if(strcmp("-polls-clear",argv[i])==0)//usbPoll() gaps, then clear
+		{
+			polls = true;
+			polls_op = XFER_POLLS_CLEAR;
+		}
+		if(strcmp("-poll-alarm",argv[i])==0 && (i+1)<argc)//usbPoll() gaps, then clear and set the threshold
+		{
+			//get next argument
+			i++; poll_alarm = atoi(argv[i]);
+			if(poll_alarm < 1 || poll_alarm > 255){ ETRACE("Bad alarm threshold: %s\n",argv[i]); return 1; }
+			polls = true;
+			polls_op = XFER_POLLS_ALARM;
+		}
+		if(strcmp("-flash",argv[i])==0)//verify flash
+		{
+			o.flash = true;
+		}
+		if(strcmp("-depth",argv[i])==0 && (i+1)<argc)//requests in flight
+		{
+			//get next argument
+			i++; o.depth = atoi(argv[i]);
+			if(o.depth < 1){o.depth=1;}
+			if(o.depth > XFER_MAX_DEPTH){o.depth=XFER_MAX_DEPTH;}
+		}
+		if(strcmp("-bytewise",argv[i])==0)//use per byte read requests
+		{
+			o.bytewise = true;
+		}
+		if(strcmp("-speedtest",argv[i])==0)//compare block read with per byte read
+		{
+			o.speedtest = true;
+		}
+		if(strcmp("-readback",argv[i])==0)//verify writes per byte
+		{
+			o.readback = true;
+		}
+		if(strcmp("-interrupt",argv[i])==0)//no control transfers
+		{
+			o.interrupt = true;
+		}
+		if(strcmp("-all",argv[i])==0)//every connected device
+		{
+			all = true;
+		}
+		if(strcmp("-jobs",argv[i])==0 && (i+1)<argc)//devices at once
+		{
+			//get next argument
+			i++; jobs = atoi(argv[i]);
+			if(jobs < 1){jobs=1;}
+		}
+		if(strcmp("-daemon",argv[i])==0)//serve requests
+		{
+			daemon = true;
+		}
+		if(strcmp("-sock",argv[i])==0 && (i+1)<argc)//daemon socket
+		{
+			//get next argument
+			i++; sSock = argv[i];
+		}
+		if(strcmp("-cmd",argv[i])==0 && (i+1)<argc)//daemon request
+		{
+			//get next argument
+			i++; sCmd = argv[i];
+		}
+		if(strcmp("-bench",argv[i])==0 && (i+1)<argc)//benchmark workload
+		{
+			//get next argument
+			i++; sBench = argv[i];
+		}
+		if(strcmp("-ops",argv[i])==0 && (i+1)<argc)//benchmark operations
+		{
+			//get next argument
+			i++; bench_ops = atoi(argv[i]);
+		}
+		if(strcmp("-size",argv[i])==0 && (i+1)<argc)//bytes per operation
+		{
+			//get next argument
+			i++; bench_size = atoi(argv[i]);
+		}
+		if(strcmp("-sim",argv[i])==0)//simulated device
+		{
+			sim = true;
+		}
+		if(strcmp("-sim-interval",argv[i])==0 && (i+1)<argc)//simulated poll interval
+		{
+			//get next argument
+			i++; sim_interval = atoi(argv[i]);
+		}
+		if(strcmp("-hidraw",argv[i])==0)//hidraw backend
+		{
+			hidraw = true;
+		}
+		if(strcmp("-list",argv[i])==0)//list discovered devices
+		{
+			list = true;
+		}
+		if(strcmp("-mfg",argv[i])==0 && (i+1)<argc)//match manufacturer string
+		{
+			//get next argument
+			i++; sMfg = argv[i];
+		}
+		if(strcmp("-prd",argv[i])==0 && (i+1)<argc)//match product string
+		{
+			//get next argument
+			i++; sPrd = argv[i];
+		}
+		if(strcmp("-serial",argv[i])==0 && (i+1)<argc)//match serial number string
+		{
+			//get next argument
+			i++; sSerial = argv[i];
+		}
+	}
+	
+	//benchmark workload
+	bench_mode mode = BENCH_READ;
+	if(sBench && !bench_parse(sBench,&mode)){ ETRACE("Unknown benchmark: %s\n",sBench); return 1; }
+	
+	//benchmark the simulated device, no libusb at all
+	if(sBench && sim)
+	{
+		xfer_sim_link link(o.depth,sim_interval);
+		xfer_engine eng(&link,o.depth);
+		TRACE("Benchmark %s, simulated device, %d ms poll interval\n",sBench,sim_interval);
+		if(!eng.start() || !wait_ready(eng,o)){ return 1; }
+		TRACE("\n");
+		return bench_run(eng,mode,bench_ops,bench_size) ? 0 : 1;
+	}
+	
+	//talk to a running daemon, no libusb at all
+	if(!daemon && (sSock || sCmd))
+	{
+		return run_client(sSock ? sSock : DAEMON_SOCK,o,sCmd);
+	}
+	
+	//hidraw backend, no libusb, the kernel HID driver stays attached
+	if(hidraw)
+	{
+		hidraw_poller poller;
+		if(!poller.start()){ return 1; }
+		std::vector<std::string> paths;
+		double t0 = time_ms();
+		hidraw_list(USB_VID,USB_PID,paths);
+		TRACE("Discovery took %.1f ms (hidraw)\n",time_ms()-t0);
+		if(list)
+		{
+			for(size_t i=0; i<paths.size(); i++){ TRACE("%s\n",paths[i].c_str()); }
+		}
+		if(all)
+		{
+			o.quiet = true;
+			return run_all(paths,[&](int i) -> xfer_dev*
+			{
+				hidraw_client* c = new hidraw_client(poller);
+				if(!c->open(paths[i].c_str())){ delete c; return 0; }
+				return c;
+			},o,jobs);
+		}
+		if(!sBench && !sWatch && !drift && !tasks && !polls && !o.sDump && !o.sWrite && !o.sVerify && !o.sMem){ return 0; }
+		hidraw_client dev(poller);
+		if(paths.empty() || !dev.open(paths[0].c_str())){ ETRACE("Unable to open device\n"); return 1; }
+		if(sWatch){ return run_watch(dev,o,watch_a,watch_b,stream_sec); }
+		if(drift){ return run_drift(dev,o); }
+		if(tasks){ return run_tasks(dev,o); }
+		if(polls){ return run_polls(dev,o,polls_op,poll_alarm); }
+		if(sBench){ return run_bench(dev,o,sBench,mode,bench_ops,bench_size); }
+		job_result res;
+		run_job(dev,o,res);
+		return res.ok ? 0 : 1;
 	}
 	
 	//init library
-	if(!hid_init())
+	hid_context ctx;
+	if(!ctx.ok())
 	{
 		ETRACE("Unable to open device\n");
 		exit(0);
 	}
 	
-	//connect to device...
-	if(!hid_connect(USB_VID,USB_PID,0,0))
+	//index matching devices, hotplug keeps it current from here on
+	hid_discovery disc(ctx.get(),USB_VID,USB_PID);
+	disc.start();
+	TRACE("Discovery took %.1f ms (%s)\n",disc.scan_ms(),disc.hotplug() ? "hotplug" : "bus scan");
+	
+	//list the index
+	if(list)
 	{
-		ETRACE("Unable to open device\n");
-		goto done;
+		std::vector<hid_dev_info> devs = disc.devices();
+		TRACE("%-16s %-16s %-16s %-16s %8s\n","PATH","MANUFACTURER","PRODUCT","SERIAL","PROBE MS");
+		for(size_t i=0; i<devs.size(); i++)
+		{ TRACE("%-16s %-16s %-16s %-16s %8.1f\n",devs[i].path.c_str(),devs[i].mfg.c_str(),devs[i].prd.c_str(),devs[i].serial.c_str(),devs[i].probe_ms); }
 	}
 	
-	//communicate
-	if(sDump)
+	//serve requests until a quit request
+	if(daemon)
 	{
-		if(!read_eeprom(sDump,mylimit))
-		{
-			ETRACE("Unable to communicate with device\n");
-			goto done;		
-		}
+		usb_daemon d(ctx.get(),disc,sMfg,sPrd,sSerial,o.depth);
+		return d.run(sSock ? sSock : DAEMON_SOCK) ? 0 : 1;
 	}
 	
-	//write to device
-	if(sWrite)
+	//update the app through the USB bootloader
+	if(sApp)
+	{
+		return boot_flash(ctx.get(),disc,sMfg,sPrd,sSerial,sApp) ? 0 : 1;
+	}
+	
+	//streaming telemetry, needs both IN endpoints, so libusb only
+	if(sStream)
+	{
+		hid_client dev(ctx.get());
+		if(!dev.connect(disc,sMfg,sPrd,sSerial)){ ETRACE("Unable to open device\n"); return 1; }
+		return run_stream(dev,sStream,stream_rate,stream_sec);
+	}
+	
+	//pin change notifications
+	if(sWatch)
+	{
+		hid_client dev(ctx.get());
+		if(!dev.connect(disc,sMfg,sPrd,sSerial)){ ETRACE("Unable to open device\n"); return 1; }
+		return run_watch(dev,o,watch_a,watch_b,stream_sec);
+	}
+	
+	//oscillator calibration, reconnects the device, so libusb only
+	if(osc)
+	{
+		return run_osc(ctx.get(),disc,o,sMfg,sPrd,sSerial);
+	}
+	
+	//oscillator drift history
+	if(drift)
+	{
+		hid_client dev(ctx.get());
+		if(!dev.connect(disc,sMfg,sPrd,sSerial)){ ETRACE("Unable to open device\n"); return 1; }
+		return run_drift(dev,o);
+	}
+	
+	//firmware scheduler stats
+	if(tasks)
+	{
+		hid_client dev(ctx.get());
+		if(!dev.connect(disc,sMfg,sPrd,sSerial)){ ETRACE("Unable to open device\n"); return 1; }
+		return run_tasks(dev,o);
+	}
+	
+	//usbPoll() gap histogram
+	if(polls)
+	{
+		hid_client dev(ctx.get());
+		if(!dev.connect(disc,sMfg,sPrd,sSerial)){ ETRACE("Unable to open device\n"); return 1; }
+		return run_polls(dev,o,polls_op,poll_alarm);
+	}
+	
+	//benchmark the real device
+	if(sBench)
 	{
-		if(!write_eeprom(sWrite,mylimit))
+		hid_client dev(ctx.get());
+		if(!dev.connect(disc,sMfg,sPrd,sSerial)){ ETRACE("Unable to open device\n"); return 1; }
+		return run_bench(dev,o,sBench,mode,bench_ops,bench_size);
+	}
+	
+	//every device at once
+	if(all)
+	{
+		o.quiet = true;
+		std::vector<hid_dev_info> devs = disc.devices();
+		std::vector<std::string> names;
+		for(size_t i=0; i<devs.size(); i++){ names.push_back(devs[i].path); }
+		return run_all(names,[&](int i) -> xfer_dev*
 		{
-			ETRACE("Unable to communicate with device\n");
-			goto done;		
-		}		
+			hid_client* c = new hid_client(ctx.get());
+			if(!c->open(devs[i].dev)){ delete c; return 0; }
+			return c;
+		},o,jobs);
 	}
+	if(!o.sDump && !o.sWrite && !o.sVerify && !o.sMem){ return 0; }
 	
-	//shutdown & disconnect
-	done:
-	hid_shutdown();
+	//connect to device...
+	{
+		hid_client dev(ctx.get());
+		double t0 = time_ms();
+		if(!dev.connect(disc,sMfg,sPrd,sSerial))
+		{
+			ETRACE("Unable to open device\n");
+			return 0;
+		}
+		TRACE("Opened %s in %.1f ms\n",dev.name(),time_ms()-t0);
+		
+		job_result res;
+		run_job(dev,o,res);
+		ret = res.ok ? 0 : 1;
+	}//shutdown & disconnect
 	
-	return 0;
+	return ret;
 }
 
@@ -0,0 +1,131 @@
+//////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL v2 (see License.txt)
+// Date:    08-01-2020
+//
+// Transfer engine benchmark
+//
+// Runs a workload of operations through an xfer_engine and times every
+// operation, then prints p50, p99 and max latency, a log2 histogram of
+// the latencies and bytes/sec. The engine can sit on a real device or on
+// the simulated one in usb_sim.h, so host path regressions show up on
+// any box.
+// Workloads, each operation moves "size" bytes at a random address...
+//   read   pipelined per byte 'R' requests
+//   block  one 'B' block read
+//   write  packed 'D' write requests, then wait until they left the host
+//   frame  'F' page frames, each confirmed by the device CRC
+//   mixed  read or write, picked at random
+// The EEPROM is read before and written back after a workload that writes.
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef __usb_bench_h_included__
+#define __usb_bench_h_included__
+
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include "usb_defs.h"
+#include "usb_xfer.h"
+
+#define BENCH_EE_SIZE   256
+#define BENCH_BUCKETS   16   //log2 latency buckets, 0.125ms to 4s
+
+enum bench_mode { BENCH_READ, BENCH_BLOCK, BENCH_WRITE, BENCH_MIXED, BENCH_FRAME };
+
+//parse a workload name, false if unknown
+inline bool bench_parse(const char* s, bench_mode* mode)
+{
+	if(strcmp(s,"read")==0) { *mode = BENCH_READ;  return true; }
+	if(strcmp(s,"block")==0){ *mode = BENCH_BLOCK; return true; }
+	if(strcmp(s,"write")==0){ *mode = BENCH_WRITE; return true; }
+	if(strcmp(s,"mixed")==0){ *mode = BENCH_MIXED; return true; }
+	if(strcmp(s,"frame")==0){ *mode = BENCH_FRAME; return true; }
+	return false;
+}
+
+//latency of one operation lands in bucket n when it is below 0.125ms << n
+inline int bench_bucket(double ms)
+{
+	int b = 0;
+	double top = 0.125;
+	while(ms >= top && b < BENCH_BUCKETS-1){ top *= 2; b++; }
+	return b;
+}
+
+//value at percentile pct of sorted latencies
+inline double bench_pct(const std::vector<double>& sorted, double pct)
+{
+	if(sorted.empty()){ return 0; }
+	size_t i = (size_t)(pct / 100.0 * (sorted.size() - 1) + 0.5);
+	return sorted[i];
+}
+
+//run ops operations of size bytes, returns false if a transfer failed
+inline bool bench_run(xfer_engine& eng, bench_mode mode, int ops, int size)
+{
+	if(size < 1){ size = 1; }
+	if(size > BENCH_EE_SIZE){ size = BENCH_EE_SIZE; }
+	if(ops < 1){ ops = 1; }
+	bool writes = mode == BENCH_WRITE || mode == BENCH_MIXED || mode == BENCH_FRAME;
+
+	//save the EEPROM, the workload overwrites it
+	U8 save[BENCH_EE_SIZE];
+	if(writes && !eng.read_block(save,0,BENCH_EE_SIZE)){ ETRACE("Unable to save eeprom\n"); return false; }
+
+	std::vector<double> lat;
+	lat.reserve(ops);
+	int bytes = 0;
+	int retries = eng.retries();
+	srand(1);//same addresses and data on every run
+	U8 buf[BENCH_EE_SIZE];
+	double t0 = time_ms();
+	for(int i=0; i<ops; i++)
+	{
+		int adr = rand() % (BENCH_EE_SIZE - size + 1);
+		bool wr = mode == BENCH_WRITE || mode == BENCH_FRAME || (mode == BENCH_MIXED && (rand() & 1));
+		for(int k=0; wr && k<size; k++){ buf[k] = rand(); }
+		double t1 = time_ms();
+		bool ok;
+		if(mode == BENCH_FRAME)    { ok = eng.write_frames(buf,adr,size); }
+		else if(wr)                { ok = eng.write(buf,adr,size) && eng.flush(); }
+		else if(mode == BENCH_BLOCK){ ok = eng.read_block(buf,adr,size); }
+		else                       { ok = eng.read(buf,adr,size); }
+		if(!ok){ ETRACE("Operation %d failed\n",i); return false; }
+		lat.push_back(time_ms() - t1);
+		bytes += size;
+	}
+	double t_all = time_ms() - t0;
+	retries = eng.retries() - retries;
+
+	//put the EEPROM back
+	if(writes && !eng.write_verify(save,0,BENCH_EE_SIZE)){ ETRACE("Unable to restore eeprom\n"); return false; }
+
+	//latency histogram
+	int hist[BENCH_BUCKETS];
+	memset(hist,0,sizeof(hist));
+	for(size_t i=0; i<lat.size(); i++){ hist[bench_bucket(lat[i])]++; }
+	int peak = *std::max_element(hist,hist+BENCH_BUCKETS);
+	TRACE("%10s %7s\n","LATENCY","OPS");
+	double top = 0.125;
+	for(int b=0; b<BENCH_BUCKETS; b++, top *= 2)
+	{
+		if(!hist[b]){ continue; }
+		char bar[41];
+		int n = hist[b] * 40 / peak;
+		memset(bar,'#',n); bar[n] = 0;
+		if(b == BENCH_BUCKETS-1){ TRACE(">=%6.3fms %7d %s\n",top/2,hist[b],bar); }
+		else                    { TRACE(" <%6.3fms %7d %s\n",top,hist[b],bar); }
+	}
+
+	std::sort(lat.begin(),lat.end());
+	TRACE("%d ops of %d bytes, depth %d\n",ops,size,eng.depth());
+	TRACE("p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",bench_pct(lat,50),bench_pct(lat,99),lat.back());
+	TRACE("%d bytes in %.1f ms (%.0f bytes/sec, %d retries)\n",bytes,t_all,bytes*1000.0/t_all,retries);
+	return true;
+}
+
+#endif
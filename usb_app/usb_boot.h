@@ -0,0 +1,250 @@
+//////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL v2 (see License.txt)
+// Date:    08-01-2020
+//
+// Flasher for the USB bootloader in boot/boot.c
+//
+// The app is sent 'J' and resets into the bootloader, which enumerates
+// with the product string "TinyBoot". A device that is already in the
+// bootloader (blank app) is used as it is.
+// The bootloader returns a CRC16 of every flash page, only the pages
+// whose CRC differs from the image are written, so flashing a small
+// change takes a few pages instead of the whole app. The CRCs are read
+// again afterwards to verify, then the bootloader starts the app.
+// Images are Intel hex or raw binary, linked at the app start
+// (CFG_APP_ENT in compile_config.sh).
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef __usb_boot_h_included__
+#define __usb_boot_h_included__
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <libusb-1.0/libusb.h>
+#include "usb_defs.h"
+#include "usb_xfer.h"
+#include "usb_discover.h"
+#include "usb_client.h"
+
+#define BOOT_PRODUCT     "TinyBoot" //USB_CFG_DEVICE_NAME in boot/usbconfig.h
+#define BOOT_RQ_INFO     0x20       //vendor requests, see boot/boot.c
+#define BOOT_RQ_CRC      0x21
+#define BOOT_RQ_WRITE    0x22
+#define BOOT_RQ_EXIT     0x23
+#define BOOT_CRC_PAGES   64         //page CRCs per BOOT_RQ_CRC request
+#define BOOT_WRITE_MS    10         //the CPU halts while a page is written, the device can not answer
+#define BOOT_WAIT_MS     5000       //time for the app to reset and the bootloader to enumerate
+#define BOOT_CTL_MS      1000       //control transfer timeout
+
+//load an Intel hex or binary file into img (XFER_FLASH_SIZE bytes of 0xFF), returns the end of the used flash, 0 on error
+inline int boot_load_image(const char* file, std::vector<U8>& img)
+{
+	img.assign(XFER_FLASH_SIZE,0xFF);
+	FILE* pFile = fopen(file,"rb");
+	if(!pFile){ ETRACE("Unable to read file: %s\n",file); return 0; }
+	int end = 0;
+	const char* ext = strrchr(file,'.');
+	if(!ext || strcmp(ext,".hex") != 0)
+	{
+		end = (int)fread(img.data(),1,img.size(),pFile);
+		fclose(pFile);
+		return end;
+	}
+
+	//Intel hex, data (00), end of file (01), extended segment (02) and linear (04) records
+	char line[600];
+	U32 base = 0;
+	int n = 0;
+	while(fgets(line,sizeof(line),pFile))
+	{
+		n++;
+		if(line[0] != ':'){ continue; }
+		U8 rec[256];
+		int len = 0;
+		for(char* p = line+1; p[0] > ' ' && p[1] > ' ' && len < (int)sizeof(rec); p += 2)
+		{ char hex[3] = {p[0],p[1],0}; rec[len++] = (U8)strtoul(hex,0,16); }
+		if(len < 5 || rec[0] + 5 != len){ ETRACE("%s line %d: bad record\n",file,n); fclose(pFile); return 0; }
+		U8 sum = 0;
+		for(int i=0; i<len; i++){ sum += rec[i]; }
+		if(sum){ ETRACE("%s line %d: bad checksum\n",file,n); fclose(pFile); return 0; }
+		U32 adr = base + ((rec[1] << 8) | rec[2]);
+		switch(rec[3])
+		{
+			case 0x00:
+				if(adr + rec[0] > img.size()){ ETRACE("%s line %d: address %X past the end of flash\n",file,n,adr); fclose(pFile); return 0; }
+				memcpy(&img[adr],&rec[4],rec[0]);
+				if((int)(adr + rec[0]) > end){ end = adr + rec[0]; }
+				break;
+			case 0x01: fclose(pFile); return end;
+			case 0x02: base = ((rec[4] << 8) | rec[5]) << 4; break;
+			case 0x04: base = ((rec[4] << 8) | rec[5]) << 16; break;
+		}
+	}
+	fclose(pFile);
+	return end;
+}
+
+//talks to the bootloader over vendor control requests
+class boot_client
+{
+public:
+	boot_client(libusb_device_handle* devh) : m_devh(devh), m_page(0), m_app(0), m_size(0), m_version(0) {}
+
+	//page size, app start and flash size
+	bool info()
+	{
+		U8 buf[8];
+		if(ctl_in(BOOT_RQ_INFO,0,buf,sizeof(buf)) != sizeof(buf)){ return false; }
+		m_page = buf[0];
+		m_app = buf[1] | (buf[2] << 8);
+		m_size = buf[3] | (buf[4] << 8);
+		m_version = buf[5];
+		if(!m_page || m_size > XFER_FLASH_SIZE || m_app >= m_size){ ETRACE("Bad bootloader info\n"); return false; }
+		return true;
+	}
+
+	//CRC16 of every page, index is the page number, pages below the app start are left 0
+	bool page_crcs(std::vector<U16>& crc)
+	{
+		crc.assign(m_size / m_page,0);
+		for(int p=m_app / m_page; p<(int)crc.size(); p+=BOOT_CRC_PAGES)
+		{
+			int cnt = std::min(BOOT_CRC_PAGES,(int)crc.size() - p);
+			U8 buf[BOOT_CRC_PAGES*2];
+			if(ctl_in(BOOT_RQ_CRC,p * m_page,buf,cnt*2) != cnt*2){ return false; }
+			for(int i=0; i<cnt; i++){ crc[p+i] = buf[2*i] | (buf[2*i+1] << 8); }
+		}
+		return true;
+	}
+
+	//one page, the device writes it after the status stage and is deaf until it is done
+	bool write_page(int adr, const U8* data)
+	{
+		int r = libusb_control_transfer(m_devh,LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+			BOOT_RQ_WRITE,adr,0,(U8*)data,m_page,BOOT_CTL_MS);
+		if(r != m_page){ ETRACE("BOOT WRITE ERROR %s ADR=%04X\n",libusb_error_name(r),adr); return false; }
+		delay_ms(BOOT_WRITE_MS);
+		return true;
+	}
+
+	//start the app, the device leaves the bus
+	void exit()
+	{
+		libusb_control_transfer(m_devh,LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+			BOOT_RQ_EXIT,0,0,0,0,BOOT_CTL_MS);
+	}
+
+	int page(){ return m_page; }
+	int app_start(){ return m_app; }
+	int flash_size(){ return m_size; }
+	int version(){ return m_version; }
+
+private:
+	libusb_device_handle* m_devh;
+	int m_page;
+	int m_app;
+	int m_size;
+	int m_version;
+
+	int ctl_in(U8 rq, U16 value, U8* buf, int len)
+	{
+		int r = libusb_control_transfer(m_devh,LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+			rq,value,0,buf,len,BOOT_CTL_MS);
+		if(r < 0){ ETRACE("BOOT RCV ERROR %s RQ=%02X\n",libusb_error_name(r),rq); }
+		return r;
+	}
+};
+
+//flash file into the app section, the app is found by mfg, prd and serial, returns false on error
+inline bool boot_flash(libusb_context* ctx, hid_discovery& disc, const char* mfg, const char* prd, const char* serial, const char* file)
+{
+	std::vector<U8> img;
+	int end = boot_load_image(file,img);
+	if(!end){ ETRACE("Empty image: %s\n",file); return false; }
+
+	//already in the bootloader? otherwise ask the app to go there
+	hid_client dev(ctx);
+	libusb_device* found = disc.find(0,BOOT_PRODUCT,0,0);
+	if(found){ bool ok = dev.open(found); libusb_unref_device(found); if(!ok){ return false; } }
+	else
+	{
+		{
+			hid_client app(ctx);
+			if(!app.connect(disc,mfg,prd,serial)){ ETRACE("Unable to open device\n"); return false; }
+			xfer_engine eng(app.new_link(1),1,true);
+			U8 bootend = 0;
+			if(!eng.start() || !eng.jump_boot(&bootend)){ ETRACE("%s: Unable to communicate with device\n",app.name()); return false; }
+			eng.stop();
+			if(!bootend){ ETRACE("%s: has no bootloader, BOOTEND fuse is 0\n",app.name()); return false; }
+			TRACE("%s: resetting into the bootloader, %d byte boot section\n",app.name(),bootend * 256);
+		}//app closed here
+		if(!dev.connect(disc,0,BOOT_PRODUCT,0,BOOT_WAIT_MS)){ ETRACE("Bootloader did not show up\n"); return false; }
+	}
+	TRACE("Opened bootloader %s\n",dev.name());
+
+	boot_client boot(dev.handle());
+	if(!boot.info()){ return false; }
+	TRACE("Bootloader v%d, %d byte pages, app at %04X, %d bytes flash\n",boot.version(),boot.page(),boot.app_start(),boot.flash_size());
+	if(end > boot.flash_size()){ ETRACE("Image is %d bytes, larger than flash\n",end); return false; }
+	for(int i=0; i<boot.app_start(); i++)
+	{
+		if(img[i] != 0xFF){ ETRACE("Image has data at %04X, below the app start %04X, check CFG_APP_ENT\n",i,boot.app_start()); return false; }
+	}
+
+	//write the pages that differ, the bootloader stays after a power up while the first app page is blank,
+	//so that page (the reset vector) is erased before any other page is written and programmed last,
+	//once every other page verifies, a flash that is cut short leaves the bootloader in charge
+	double t0 = time_ms();
+	std::vector<U16> crc;
+	if(!boot.page_crcs(crc)){ return false; }
+	int pg = boot.page();
+	int first = boot.app_start() / pg;
+	std::vector<U8> blank(pg,0xFF);
+	U16 crc_blank = crc16_usb(blank.data(),pg);
+	int written = 0, skipped = 0;
+	bool change = false;
+	for(int p=first; p<(int)crc.size(); p++){ if(crc[p] != crc16_usb(&img[p*pg],pg)){ change = true; } }
+	TRACE("Flashing %s 000%%",file);
+	if(change && crc[first] != crc_blank)
+	{
+		if(!boot.write_page(first*pg,blank.data())){ TRACE("\n"); return false; }
+		crc[first] = crc_blank;
+	}
+	for(int p=first+1; p<(int)crc.size(); p++)
+	{
+		if(crc[p] == crc16_usb(&img[p*pg],pg)){ skipped++; continue; }
+		if(!boot.write_page(p*pg,&img[p*pg])){ TRACE("\n"); return false; }
+		written++;
+		printf("\b\b\b\b%3d%%",(p+1)*100/(int)crc.size()); fflush(stdout);
+	}
+
+	//verify every page, blank pages too, so old code past the end of the image is gone
+	if(!boot.page_crcs(crc)){ TRACE("\n"); return false; }
+	for(int p=first+1; p<(int)crc.size(); p++)
+	{
+		if(crc[p] != crc16_usb(&img[p*pg],pg)){ TRACE("\n"); ETRACE("Verify failed at %04X, the app stays blank, flash again\n",p*pg); return false; }
+	}
+
+	//then the first page, it makes the app start on the next power up
+	if(crc[first] != crc16_usb(&img[first*pg],pg))
+	{
+		if(!boot.write_page(first*pg,&img[first*pg])){ TRACE("\n"); return false; }
+		if(!boot.page_crcs(crc)){ TRACE("\n"); return false; }
+		if(crc[first] != crc16_usb(&img[first*pg],pg)){ TRACE("\n"); ETRACE("Verify failed at %04X\n",first*pg); return false; }
+		written++;
+	}
+	else { skipped++; }
+	TRACE("\b\b\b\b100%%\n");
+	double t1 = time_ms();
+	TRACE("Wrote %d pages, skipped %d unchanged, verified in %.1f ms\n",written,skipped,t1-t0);
+	boot.exit();
+	return true;
+}
+
+#endif
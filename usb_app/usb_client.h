@@ -0,0 +1,208 @@
+//////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL v2 (see License.txt)
+// Date:    08-01-2020
+//
+// Reentrant HID client
+//
+// hid_context owns the libusb context, hid_client owns one device handle.
+// There is no global state, so each thread can drive its own device.
+// The interface is released and the handle closed when the client is
+// destroyed, even if a job bails out early.
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef __usb_client_h_included__
+#define __usb_client_h_included__
+
+#include <string.h>
+#include <string>
+#include <atomic>
+#include <libusb-1.0/libusb.h>
+#include "usb_defs.h"
+#include "usb_xfer.h"
+#include "usb_discover.h"
+
+//libusb context, one per process is enough, it is shared by every client
+class hid_context
+{
+public:
+	hid_context() : m_ctx(0), m_ok(false)
+	{
+		int r = libusb_init(&m_ctx);
+		if(r < 0){ ETRACE("Failed to initialise usb\n"); return; }
+		m_ok = true;
+	}
+	~hid_context(){ if(m_ok){ libusb_exit(m_ctx); } }
+	hid_context(const hid_context&) = delete;
+	hid_context& operator=(const hid_context&) = delete;
+
+	bool ok(){ return m_ok; }
+	libusb_context* get(){ return m_ctx; }
+
+private:
+	libusb_context* m_ctx;
+	bool m_ok;
+};
+
+//one connected device
+class hid_client : public xfer_dev
+{
+public:
+	hid_client(libusb_context* ctx) : m_ctx(ctx), m_devh(0), m_interface_claimed(false), m_run(true) {}
+	~hid_client(){ disconnect(); }
+	hid_client(const hid_client&) = delete;
+	hid_client& operator=(const hid_client&) = delete;
+
+	//open first device matching manufacturer, product and serial strings, null matches anything
+	//this is a lookup in the discovery index, no bus scan
+	bool connect(hid_discovery& disc, const char* mfg, const char* prd, const char* serial, int timeout_ms = 1000)
+	{
+		if(m_devh){return false;}
+		libusb_device* dev = disc.find(mfg,prd,serial,timeout_ms);
+		if(!dev){ ETRACE("Failed to find device [%s] [%s] [%s]\n",mfg?mfg:"*",prd?prd:"*",serial?serial:"*"); return false; }
+		bool ok = open(dev);
+		libusb_unref_device(dev);
+		return ok;
+	}
+
+	//open a device from the discovery index
+	bool open(libusb_device* dev)
+	{
+		if(m_devh){return false;}
+		libusb_device_handle* devh = 0;
+		int r = libusb_open(dev,&devh);
+		if(r != LIBUSB_SUCCESS || !devh){ ETRACE("Failed to open device %s %s\n",hid_dev_path(dev).c_str(),libusb_error_name(r)); return false; }
+		return claim(devh);
+	}
+
+	void disconnect()
+	{
+		if(m_devh)
+		{
+			if(m_interface_claimed)
+			{
+				libusb_release_interface(m_devh,0);
+				m_interface_claimed = false;
+				TRACE("Released usb interface %s\n",m_name.c_str());
+			}
+
+			libusb_close(m_devh);
+			m_devh = 0;
+		}
+	}
+
+	//stop blocking reads from retrying, safe to call from another thread
+	void abort(){ m_run = false; }
+
+	bool connected(){ return m_devh != 0; }
+	libusb_device_handle* handle(){ return m_devh; }
+	libusb_context* context(){ return m_ctx; }
+	const char* name(){ return m_name.c_str(); }
+	xfer_link* new_link(int depth){ return new xfer_usb_link(m_ctx,m_devh,depth); }
+
+	//proprietary read byte command for TinyAvr firmware, blocking
+	bool read_byte(U8* ret_byte, U8 adr)
+	{
+		//command setup
+		U8 data[8] = {0,0,0,0,0,0,0,0};
+		data[0] = XFER_CMD_READ;
+		data[1] = adr; //address to read
+
+		//xmt data
+		int xfer = 0;
+		int r = libusb_interrupt_transfer(m_devh,XFER_EP_OUT,data,sizeof(data),&xfer,250);//timeout in 250ms
+		if(r != 0 || xfer != sizeof(data)){ETRACE("USB XMT ERROR %d, SENT %d\n",r,xfer); disconnect(); return false;}
+
+		//wait for response
+		xfer = 0;
+		retry:
+		r = libusb_interrupt_transfer(m_devh,XFER_EP_IN,data,sizeof(data),&xfer,250);//retry every 250ms
+		if(m_run && r == LIBUSB_ERROR_TIMEOUT && xfer == 0)
+		{goto retry;}//if m_run and we have a timeout, try again
+		if(r != 0 || xfer != sizeof(data))
+		{ETRACE("RCV USB ERROR %d, XFER %d\n",r,xfer); disconnect(); return false;}
+
+		//byte0: CMD_READ, anything else error
+		//byte1: echo adr
+		//byte2: data requested
+		if(data[0] != XFER_CMD_READ && data[1] != adr)
+		{ETRACE("ECHO RESPONSE ERROR RSP=%d ADR=%d\n",data[0],adr); disconnect(); return false;}
+
+		//returned byte of data
+		*ret_byte = data[2];
+
+		return true;
+	}
+
+	//proprietary write byte command for TinyAvr firmware, blocking, verified with a read
+	bool write_byte(U8* data_byte, U8 adr)
+	{
+		//command setup
+		U8 data[8] = {0,0,0,0,0,0,0,0};
+		data[0] = XFER_CMD_WRITE; //command
+		data[1] = adr;       //address to write to
+		data[2] = (U8)(*data_byte); //data to write
+
+		//xmt data
+		int xfer = 0;
+		int r = libusb_interrupt_transfer(m_devh,XFER_EP_OUT,data,sizeof(data),&xfer,250);//timeout in 250ms
+		if(r != 0 || xfer != sizeof(data)){ETRACE("USB XMT ERROR %d, SENT %d\n",r,xfer); disconnect(); return false;}
+
+		//verify data written
+		U8 verify_byte = 0xFF;
+		if(!read_byte(&verify_byte,adr)){return false;}
+		if(*data_byte != verify_byte){ ETRACE("USB XMT VERIFY ERROR\n"); return false;}
+
+		return true;
+	}
+
+	//read an EEPROM block with one vendor control transfer, returns bytes read, -1 on error
+	//firmware without control requests answers with no data
+	int ctl_read(U8* buf, int adr, int len)
+	{
+		if(len > XFER_CTL_MAX){ len = XFER_CTL_MAX; }
+		int r = libusb_control_transfer(m_devh,LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+			XFER_RQ_EE_READ,adr,0,buf,len,1000);
+		if(r < 0){ ETRACE("USB CONTROL READ ERROR %s\n",libusb_error_name(r)); return -1; }
+		return r;
+	}
+
+	//write an EEPROM block with one vendor control transfer, the device writes while it NAKs the data stage
+	bool ctl_write(const U8* buf, int adr, int len)
+	{
+		if(len > XFER_CTL_MAX){ len = XFER_CTL_MAX; }
+		//every byte can take an EEPROM write time, give the device 10ms per byte
+		int r = libusb_control_transfer(m_devh,LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+			XFER_RQ_EE_WRITE,adr,0,(U8*)buf,len,1000 + len*10);
+		if(r != len){ ETRACE("USB CONTROL WRITE ERROR %s\n",r < 0 ? libusb_error_name(r) : "short"); return false; }
+		return true;
+	}
+
+private:
+	libusb_context* m_ctx;
+	libusb_device_handle* m_devh;
+	bool m_interface_claimed;
+	std::atomic<bool> m_run;
+	std::string m_name; //bus-port path, used to tell devices apart in output
+
+	//take ownership of an open handle and claim the usb interface
+	bool claim(libusb_device_handle* devh)
+	{
+		m_devh = devh;
+		m_name = hid_dev_path(libusb_get_device(m_devh));
+
+		//auto detach kernel driver
+		libusb_set_auto_detach_kernel_driver(m_devh,1);
+
+		//claim the usb interface
+		int r = libusb_claim_interface(m_devh, 0);
+		if (r < 0){ ETRACE("Usb claim interface error %d\n", r); disconnect(); return false; }
+		m_interface_claimed = true;
+		TRACE("Claimed usb interface %s\n",m_name.c_str());
+		return true;
+	}
+};
+
+#endif
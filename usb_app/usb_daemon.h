@@ -0,0 +1,443 @@
+//////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL v2 (see License.txt)
+// Date:    08-01-2020
+//
+// usb_app daemon
+//
+// Every usb_app run pays for libusb_init, discovery, claiming the interface
+// and the ready handshake before doing any work. The daemon does that once,
+// holds the device open, and serves requests on a unix domain socket.
+// It keeps a write-back shadow copy of the EEPROM, reads are served from
+// RAM once a byte has been fetched, writes only mark the bytes that
+// actually change as dirty, and dirty runs go over USB on flush, after
+// the daemon has been idle for a moment, or on quit.
+//
+// One request per line, one reply line per request...
+//   read <adr> <len>         OK <hex bytes>
+//   write <adr> <hex bytes>  OK <bytes changed>
+//   dump <file> [len]        OK <len>       save eeprom to file
+//   load <file> [len]        OK <changed>   write file to eeprom
+//   flush                    OK <bytes written>
+//   invalidate               OK             drop clean bytes, read them again next time
+//   stats                    OK <counters>
+//   quit                     OK             flush and exit
+// Errors are replied as "ERR <message>".
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef __usb_daemon_h_included__
+#define __usb_daemon_h_included__
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include "usb_defs.h"
+#include "usb_xfer.h"
+#include "usb_discover.h"
+#include "usb_client.h"
+
+#define DAEMON_SOCK       "/tmp/usb_app.sock" //default socket path
+#define DAEMON_EE_SIZE    256   //eeprom bytes shadowed
+#define DAEMON_IDLE_MS    200   //flush dirty bytes after this long with no request
+#define DAEMON_MAX_LINE   1024  //longest request, "write" of 256 bytes is 3+1+3+1+512
+#define DAEMON_STOP_MS    500   //how often the stop flag is checked when nothing is dirty
+
+//set by the signal handler, the daemon flushes and exits, a signal may land on any thread so it is polled
+inline volatile sig_atomic_t& daemon_stop(){ static volatile sig_atomic_t stop = 0; return stop; }
+inline void daemon_signal_handler(int sig){ daemon_stop() = 1; }
+
+//host side copy of the device eeprom
+class ee_shadow
+{
+public:
+	ee_shadow(){ reset(); }
+
+	//forget everything, including unwritten bytes
+	void reset()
+	{
+		memset(m_data,0xFF,sizeof(m_data));
+		memset(m_valid,0,sizeof(m_valid));
+		memset(m_dirty,0,sizeof(m_dirty));
+		m_hits = m_misses = m_usb_rd = m_usb_wr = 0;
+	}
+
+	//forget clean bytes, dirty bytes are still written on the next flush
+	void invalidate()
+	{
+		for(int i=0; i<DAEMON_EE_SIZE; i++){ if(!m_dirty[i]){ m_valid[i] = false; } }
+	}
+
+	//copy bytes out, fetching the ones not cached with one block read per missing run
+	bool read(xfer_engine& eng, U8* buf, int adr, int len)
+	{
+		for(int i=adr; i<adr+len; )
+		{
+			if(m_valid[i]){ m_hits++; i++; continue; }
+			int n = 0;
+			while(i+n < adr+len && !m_valid[i+n]){ n++; }
+			if(!eng.read_block(&m_data[i],i,n)){ return false; }
+			for(int k=0; k<n; k++){ m_valid[i+k] = true; }
+			m_misses += n;
+			m_usb_rd += n;
+			i += n;
+		}
+		memcpy(buf,&m_data[adr],len);
+		return true;
+	}
+
+	//update the copy, returns the number of bytes that changed and are now dirty
+	//bytes not cached yet are fetched first, so a write of the same value costs no usb write
+	int write(xfer_engine& eng, const U8* buf, int adr, int len)
+	{
+		U8 cur[DAEMON_EE_SIZE];
+		if(!read(eng,cur,adr,len)){ return -1; }
+		int changed = 0;
+		for(int i=0; i<len; i++)
+		{
+			if(cur[i] == buf[i]){ continue; }
+			m_data[adr+i] = buf[i];
+			m_dirty[adr+i] = true;
+			changed++;
+		}
+		return changed;
+	}
+
+	int dirty()
+	{
+		int n = 0;
+		for(int i=0; i<DAEMON_EE_SIZE; i++){ if(m_dirty[i]){ n++; } }
+		return n;
+	}
+
+	//write every dirty byte in packed requests, then verify each dirty run with a range CRC
+	//returns bytes written, -1 on error (the bytes stay dirty)
+	int flush(xfer_engine& eng)
+	{
+		U8 adr[DAEMON_EE_SIZE];
+		U8 val[DAEMON_EE_SIZE];
+		int cnt = 0;
+		for(int i=0; i<DAEMON_EE_SIZE; i++)
+		{
+			if(m_dirty[i]){ adr[cnt] = i; val[cnt] = m_data[i]; cnt++; }
+		}
+		if(cnt && !eng.write_pairs(adr,val,cnt)){ return -1; }
+
+		int written = 0;
+		for(int i=0; i<DAEMON_EE_SIZE; )
+		{
+			if(!m_dirty[i]){ i++; continue; }
+			int n = 0;
+			while(i+n < DAEMON_EE_SIZE && m_dirty[i+n]){ n++; }
+			U16 crc_dev = 0;
+			if(!eng.crc(&crc_dev,i,n)){ return -1; }
+			if(crc_dev != crc16_usb(&m_data[i],n) && !eng.write_verify(&m_data[i],i,n)){ return -1; }
+			for(int k=0; k<n; k++){ m_dirty[i+k] = false; }
+			written += n;
+			m_usb_wr += n;
+			i += n;
+		}
+		return written;
+	}
+
+	int m_hits;   //bytes served from the copy
+	int m_misses; //bytes fetched from the device
+	int m_usb_rd; //bytes read over usb
+	int m_usb_wr; //bytes written over usb
+
+private:
+	U8 m_data[DAEMON_EE_SIZE];
+	bool m_valid[DAEMON_EE_SIZE];
+	bool m_dirty[DAEMON_EE_SIZE];
+};
+
+//holds the device open and serves requests
+class usb_daemon
+{
+public:
+	usb_daemon(libusb_context* ctx, hid_discovery& disc, const char* mfg, const char* prd, const char* serial, int depth)
+	: m_ctx(ctx), m_disc(disc), m_mfg(mfg), m_prd(prd), m_serial(serial), m_depth(depth), m_dev(0), m_eng(0), m_listen(-1), m_quit(false)
+	{}
+
+	~usb_daemon()
+	{
+		close_device();
+		if(m_listen >= 0){ close(m_listen); unlink(m_path.c_str()); }
+		for(size_t i=0; i<m_clients.size(); i++){ close(m_clients[i].fd); }
+	}
+
+	//serve until a quit request
+	bool run(const char* sock)
+	{
+		m_path = sock;
+		if(!listen_on(sock)){ return false; }
+		signal(SIGINT,daemon_signal_handler);//CTRL+C flushes dirty bytes before exit
+		signal(SIGTERM,daemon_signal_handler);
+		if(!open_device()){ ETRACE("No device yet, will retry on the first request\n"); }
+		TRACE("Daemon listening on %s\n",sock);
+
+		double t_last = time_ms();
+		while(!m_quit && !daemon_stop())
+		{
+			//listen socket first, then clients
+			std::vector<pollfd> fds(1 + m_clients.size());
+			fds[0].fd = m_listen; fds[0].events = POLLIN; fds[0].revents = 0;
+			for(size_t i=0; i<m_clients.size(); i++){ fds[i+1].fd = m_clients[i].fd; fds[i+1].events = POLLIN; fds[i+1].revents = 0; }
+			int r = poll(&fds[0],fds.size(),m_shadow.dirty() ? DAEMON_IDLE_MS : DAEMON_STOP_MS);
+			if(r < 0 && errno != EINTR){ ETRACE("poll error %d\n",errno); return false; }
+			if(r < 0){ continue; }
+
+			//write-back, once nobody has asked for anything for a while
+			if(r == 0)
+			{
+				if(m_shadow.dirty() && time_ms() - t_last >= DAEMON_IDLE_MS && open_device() && m_shadow.flush(*m_eng) < 0){ close_device(); }
+				continue;
+			}
+			t_last = time_ms();
+
+			if(fds[0].revents & POLLIN)
+			{
+				int fd = accept(m_listen,NULL,NULL);
+				if(fd >= 0){ client c; c.fd = fd; m_clients.push_back(c); }
+			}
+			for(size_t i=1; i<fds.size(); i++)
+			{
+				if(!fds[i].revents){ continue; }
+				if(!service(m_clients[i-1])){ close(m_clients[i-1].fd); m_clients[i-1].fd = -1; }
+			}
+			for(size_t i=0; i<m_clients.size(); )
+			{
+				if(m_clients[i].fd < 0){ m_clients.erase(m_clients.begin()+i); }
+				else{ i++; }
+			}
+		}
+
+		//write-back whatever is left
+		if(m_eng && m_shadow.dirty()){ m_shadow.flush(*m_eng); }
+		TRACE("Daemon stopped\n");
+		return true;
+	}
+
+private:
+	struct client
+	{
+		int fd;
+		std::string line; //partial request
+	};
+
+	libusb_context* m_ctx;
+	hid_discovery& m_disc;
+	const char* m_mfg;
+	const char* m_prd;
+	const char* m_serial;
+	int m_depth;
+	hid_client* m_dev;
+	xfer_engine* m_eng;
+	ee_shadow m_shadow;
+	int m_listen;
+	std::string m_path;
+	std::vector<client> m_clients;
+	bool m_quit;
+
+	bool listen_on(const char* sock)
+	{
+		sockaddr_un sa;
+		memset(&sa,0,sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		if(strlen(sock) >= sizeof(sa.sun_path)){ ETRACE("Socket path too long: %s\n",sock); return false; }
+		strcpy(sa.sun_path,sock);
+		m_listen = socket(AF_UNIX,SOCK_STREAM,0);
+		if(m_listen < 0){ ETRACE("socket error %d\n",errno); return false; }
+		unlink(sock);//stale socket from a daemon that did not exit cleanly
+		if(bind(m_listen,(sockaddr*)&sa,sizeof(sa)) != 0 || listen(m_listen,8) != 0)
+		{ ETRACE("Unable to listen on %s, error %d\n",sock,errno); close(m_listen); m_listen = -1; return false; }
+		return true;
+	}
+
+	bool open_device()
+	{
+		if(m_eng){ return true; }
+		m_dev = new hid_client(m_ctx);
+		if(!m_dev->connect(m_disc,m_mfg,m_prd,m_serial)){ close_device(); return false; }
+		m_eng = new xfer_engine(m_ctx,m_dev->handle(),m_depth);
+		U16 nonce = 0;
+		if(!m_eng->start() || !m_eng->wait_ready(&nonce)){ close_device(); return false; }
+		TRACE("Opened %s, session %04X\n",m_dev->name(),nonce);
+		return true;
+	}
+
+	//the device may have been reprogrammed while it was gone, only dirty bytes are kept
+	void close_device()
+	{
+		if(m_eng){ m_eng->stop(); delete m_eng; m_eng = 0; }
+		if(m_dev){ delete m_dev; m_dev = 0; }
+		m_shadow.invalidate();
+	}
+
+	//read what the client sent, run complete lines, false when the client has gone
+	bool service(client& c)
+	{
+		char buf[256];
+		ssize_t n = recv(c.fd,buf,sizeof(buf),0);
+		if(n <= 0){ return false; }
+		c.line.append(buf,n);
+		size_t eol;
+		while((eol = c.line.find('\n')) != std::string::npos)
+		{
+			std::string rq = c.line.substr(0,eol);
+			c.line.erase(0,eol+1);
+			std::string rsp = request(rq);
+			rsp += "\n";
+			if(send(c.fd,rsp.c_str(),rsp.size(),MSG_NOSIGNAL) != (ssize_t)rsp.size()){ return false; }
+		}
+		return c.line.size() <= DAEMON_MAX_LINE;
+	}
+
+	static std::string hex(const U8* buf, int len)
+	{
+		std::string s;
+		char h[4];
+		for(int i=0; i<len; i++){ snprintf(h,sizeof(h),"%02X",buf[i]); s += h; }
+		return s;
+	}
+
+	static int unhex(const char* s, U8* buf, int max)
+	{
+		int n = 0;
+		while(s[0] && s[1] && n < max)
+		{
+			char h[3] = {s[0],s[1],0};
+			char* end;
+			buf[n++] = (U8)strtol(h,&end,16);
+			if(*end){ return -1; }
+			s += 2;
+		}
+		return s[0] ? -1 : n;
+	}
+
+	static bool range(int adr, int len)
+	{ return adr >= 0 && len > 0 && adr + len <= DAEMON_EE_SIZE; }
+
+	//run one request, retry once after reopening if the device went away
+	std::string request(const std::string& rq)
+	{
+		char cmd[16] = {0};
+		char arg[DAEMON_MAX_LINE+1] = {0};
+		int adr = 0;
+		int len = DAEMON_EE_SIZE;
+		sscanf(rq.c_str(),"%15s",cmd);
+		std::string rsp;
+
+		//requests that do not need the device
+		if(strcmp(cmd,"stats")==0)
+		{
+			char s[160];
+			snprintf(s,sizeof(s),"OK hits=%d misses=%d usb_rd=%d usb_wr=%d dirty=%d retries=%d",
+				m_shadow.m_hits,m_shadow.m_misses,m_shadow.m_usb_rd,m_shadow.m_usb_wr,m_shadow.dirty(),m_eng ? m_eng->retries() : 0);
+			return s;
+		}
+		if(strcmp(cmd,"invalidate")==0){ m_shadow.invalidate(); return "OK"; }
+
+		for(int attempt=0; attempt<2; attempt++)
+		{
+			if(!open_device()){ return "ERR device not found"; }
+			xfer_engine& eng = *m_eng;
+			if(strcmp(cmd,"read")==0)
+			{
+				if(sscanf(rq.c_str(),"%*s %i %i",&adr,&len) != 2 || !range(adr,len)){ return "ERR usage: read <adr> <len>"; }
+				U8 buf[DAEMON_EE_SIZE];
+				if(m_shadow.read(eng,buf,adr,len)){ return "OK " + hex(buf,len); }
+			}
+			else if(strcmp(cmd,"write")==0)
+			{
+				U8 buf[DAEMON_EE_SIZE];
+				if(sscanf(rq.c_str(),"%*s %i %1024s",&adr,arg) != 2){ return "ERR usage: write <adr> <hex bytes>"; }
+				len = unhex(arg,buf,DAEMON_EE_SIZE);
+				if(len <= 0 || !range(adr,len)){ return "ERR bad data or range"; }
+				int changed = m_shadow.write(eng,buf,adr,len);
+				if(changed >= 0){ return "OK " + std::to_string(changed); }
+			}
+			else if(strcmp(cmd,"dump")==0)
+			{
+				if(sscanf(rq.c_str(),"%*s %1024s %i",arg,&len) < 1 || !range(0,len)){ return "ERR usage: dump <file> [len]"; }
+				U8 buf[DAEMON_EE_SIZE];
+				if(m_shadow.read(eng,buf,0,len))
+				{
+					FILE* pFile = fopen(arg,"wb");
+					if(!pFile){ return std::string("ERR unable to write file: ") + arg; }
+					size_t written = fwrite(buf,1,len,pFile);
+					fclose(pFile);
+					if(written != (size_t)len){ return "ERR short write"; }
+					return "OK " + std::to_string(len);
+				}
+			}
+			else if(strcmp(cmd,"load")==0)
+			{
+				if(sscanf(rq.c_str(),"%*s %1024s %i",arg,&len) < 1 || !range(0,len)){ return "ERR usage: load <file> [len]"; }
+				U8 buf[DAEMON_EE_SIZE];
+				FILE* pFile = fopen(arg,"rb");
+				if(!pFile){ return std::string("ERR unable to read file: ") + arg; }
+				size_t result = fread(buf,1,len,pFile);
+				fclose(pFile);
+				if((int)result < len){ return "ERR file too short"; }
+				int changed = m_shadow.write(eng,buf,0,len);
+				if(changed >= 0){ return "OK " + std::to_string(changed); }
+			}
+			else if(strcmp(cmd,"flush")==0 || strcmp(cmd,"quit")==0)
+			{
+				int written = m_shadow.flush(eng);
+				if(written >= 0)
+				{
+					if(cmd[0] == 'q'){ m_quit = true; }
+					return "OK " + std::to_string(written);
+				}
+			}
+			else
+			{
+				return std::string("ERR unknown request: ") + cmd;
+			}
+
+			//transfer failed, reopen and try again
+			ETRACE("Request failed, reopening device\n");
+			close_device();
+		}
+		return "ERR transfer failed";
+	}
+};
+
+//send one request line to a running daemon, and get the reply line
+inline bool daemon_request(const char* sock, const char* rq, std::string& rsp)
+{
+	sockaddr_un sa;
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if(strlen(sock) >= sizeof(sa.sun_path)){ return false; }
+	strcpy(sa.sun_path,sock);
+	int fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if(fd < 0){ return false; }
+	if(connect(fd,(sockaddr*)&sa,sizeof(sa)) != 0){ close(fd); return false; }
+	std::string line = rq;
+	line += "\n";
+	bool ok = send(fd,line.c_str(),line.size(),MSG_NOSIGNAL) == (ssize_t)line.size();
+	rsp.clear();
+	char buf[256];
+	while(ok)
+	{
+		ssize_t n = recv(fd,buf,sizeof(buf),0);
+		if(n <= 0){ ok = false; break; }
+		rsp.append(buf,n);
+		size_t eol = rsp.find('\n');
+		if(eol != std::string::npos){ rsp.erase(eol); break; }
+	}
+	close(fd);
+	return ok;
+}
+
+#endif
@@ -0,0 +1,69 @@
+//////////////////////////////////////////////////////////////////
+// 
+// Author:  12oClocker
+// License: GNU GPL v2 (see License.txt)
+// Date:    08-01-2020
+//
+// common types and trace macros shared by usb_app source files
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef __usb_defs_h_included__
+#define __usb_defs_h_included__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>               //float_t, double_t
+#include <unistd.h>             //usleep()
+#include <time.h>               //clock_gettime()
+
+//ints
+#define  U8 uint8_t
+#define U16 uint16_t
+#define U32 uint32_t
+#define U64 uint64_t
+#define  I8 int8_t
+#define I16 int16_t
+#define I32 int32_t
+#define I64 int64_t
+#define f32 float_t
+#define f64 double_t
+
+//delays
+#define delay_us(x)  usleep(x)
+#define delay_ms(x)  usleep((x*1000))
+#define delay_s(x)   sleep(x)
+
+//printf colors
+#define C_RED       "\033[0;31m"  //Red
+#define C_RED_BOLD  "\033[1;31m"  //Bold Red
+#define C_GRN       "\033[0;32m"  //Green
+#define C_GRN_BOLD  "\033[1;32m"  //Bold Green
+#define C_YEL       "\033[0;33m"  //Yellow
+#define C_YEL_BOLD  "\033[01;33m" //Bold Yellow
+#define C_BLU       "\033[0;34m"  //Blue
+#define C_BLU_BOLD  "\033[1;34m"  //Bold Blue
+#define C_MAG       "\033[0;35m"  //Magenta
+#define C_MAG_BOLD  "\033[1;35m"  //Bold Magenta
+#define C_CYAN      "\033[0;36m"  //Cyan
+#define C_CYAN_BOLD "\033[1;36m"  //Bold Cyan
+#define C_WHT       "\033[0;37m"  //White
+#define C_WHT_BOLD  "\033[1;37m"  //Bold White
+#define C_RESET     "\033[0m"     //Reset
+
+#ifdef DEBUG
+#define TRACE(...)     printf(__VA_ARGS__); fflush(stdout) //printf(x...) //windows method
+#define ETRACE(...)    printf(C_RED); printf(__VA_ARGS__); printf(C_RESET); fflush(stdout) //printf(x...) //windows method
+#define ERRTRACE(...)  printf(C_RED "\nFILE: %s\nLINE: %d\nFUNC: %s\nERROR: ",__FILE__,__LINE__,__func__); printf(__VA_ARGS__); printf("\n" C_RESET); fflush(stdout)
+#endif
+
+
+//time in milliseconds from a monotonic clock, used to measure transfer speed
+inline double time_ms()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+#endif
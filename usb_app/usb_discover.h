@@ -0,0 +1,290 @@
+//////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL v2 (see License.txt)
+// Date:    08-01-2020
+//
+// Hotplug device discovery cache
+//
+// A bus scan opens every vid/pid match and reads its strings before it
+// can decide, on a busy hub every connect paid that again. This keeps an
+// index of matching devices instead, keyed by bus-port path, with the
+// manufacturer, product and serial strings read once when the device
+// arrives. libusb hotplug events keep the index current, so opening a
+// device by its strings is a lookup.
+// Platforms without hotplug support fall back to one scan at start(),
+// and another scan when a lookup misses.
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef __usb_discover_h_included__
+#define __usb_discover_h_included__
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <libusb-1.0/libusb.h>
+#include "usb_defs.h"
+
+//bus-port path of a device, such as "1-2.3", stays the same while the device is plugged into the same port
+inline std::string hid_dev_path(libusb_device* dev)
+{
+	U8 ports[8];
+	char buf[64];
+	int n = libusb_get_port_numbers(dev,ports,sizeof(ports));
+	int len = snprintf(buf,sizeof(buf),"%d",libusb_get_bus_number(dev));
+	for(int i=0; i<n && len < (int)sizeof(buf); i++)
+	{ len += snprintf(buf+len,sizeof(buf)-len,"%c%d",i ? '.' : '-',ports[i]); }
+	return buf;
+}
+
+//one indexed device
+struct hid_dev_info
+{
+	libusb_device* dev;  //referenced while in the index
+	std::string path;    //bus-port path, the index key
+	std::string mfg;     //cached string descriptors, empty if the device has none
+	std::string prd;
+	std::string serial;
+	bool probed;         //strings have been read
+	double probe_ms;     //time taken to read the strings
+};
+
+class hid_discovery
+{
+public:
+	hid_discovery(libusb_context* ctx, U16 vid, U16 pid)
+	: m_ctx(ctx), m_vid(vid), m_pid(pid), m_hotplug(false), m_cb(0), m_run(false), m_scan_ms(0)
+	{}
+
+	~hid_discovery(){ stop(); }
+	hid_discovery(const hid_discovery&) = delete;
+	hid_discovery& operator=(const hid_discovery&) = delete;
+
+	//build the index, then keep it current with hotplug events
+	bool start()
+	{
+		if(m_run){ return true; }
+		double t0 = time_ms();
+		m_hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) != 0;
+		if(m_hotplug)
+		{
+			//enumerate flag delivers an arrived event for every device already plugged in, before register returns
+			int r = libusb_hotplug_register_callback(m_ctx,LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_ENUMERATE,m_vid,m_pid,LIBUSB_HOTPLUG_MATCH_ANY,hotplug_cb,this,&m_cb);
+			if(r != LIBUSB_SUCCESS){ ETRACE("Hotplug register error %s, scanning instead\n",libusb_error_name(r)); m_hotplug = false; }
+		}
+		if(!m_hotplug){ scan(); }
+		probe_pending();
+		m_scan_ms = time_ms() - t0;
+		if(m_hotplug)
+		{
+			m_run = true;
+			m_thread = std::thread(&hid_discovery::event_thread,this);
+		}
+		return true;
+	}
+
+	void stop()
+	{
+		if(m_run)
+		{
+			m_run = false;
+			m_thread.join();
+		}
+		if(m_hotplug)
+		{
+			libusb_hotplug_deregister_callback(m_ctx,m_cb);
+			m_hotplug = false;
+		}
+		std::lock_guard<std::mutex> lock(m_mtx);
+		for(size_t i=0; i<m_index.size(); i++){ libusb_unref_device(m_index[i].dev); }
+		m_index.clear();
+		for(size_t i=0; i<m_pending.size(); i++){ libusb_unref_device(m_pending[i]); }
+		m_pending.clear();
+	}
+
+	//time the first index build took, in ms
+	double scan_ms(){ return m_scan_ms; }
+	bool hotplug(){ return m_hotplug; }
+
+	//copy of the index
+	std::vector<hid_dev_info> devices()
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		return m_index;
+	}
+
+	//find a device by its strings, null or empty matches anything
+	//waits up to timeout_ms for a matching device to arrive
+	//returns a referenced device, release it with libusb_unref_device()
+	libusb_device* find(const char* mfg, const char* prd, const char* serial, int timeout_ms, hid_dev_info* info = 0)
+	{
+		double t_end = time_ms() + timeout_ms;
+		std::unique_lock<std::mutex> lock(m_mtx);
+		for(;;)
+		{
+			for(size_t i=0; i<m_index.size(); i++)
+			{
+				hid_dev_info& d = m_index[i];
+				if(!d.probed){ continue; }
+				if(!match(mfg,d.mfg) || !match(prd,d.prd) || !match(serial,d.serial)){ continue; }
+				if(info){ *info = d; }
+				return libusb_ref_device(d.dev);
+			}
+			double left = t_end - time_ms();
+			if(left <= 0){ return NULL; }
+			if(m_hotplug)
+			{
+				//wait for the event thread to index something new
+				m_cv.wait_for(lock,std::chrono::milliseconds((int)left + 1));
+			}
+			else
+			{
+				//no hotplug, rescan the bus
+				lock.unlock();
+				delay_ms(50);
+				scan();
+				probe_pending();
+				lock.lock();
+			}
+		}
+	}
+
+private:
+	libusb_context* m_ctx;
+	U16 m_vid;
+	U16 m_pid;
+	bool m_hotplug;
+	libusb_hotplug_callback_handle m_cb;
+	std::atomic<bool> m_run;
+	std::thread m_thread;
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	std::vector<hid_dev_info> m_index;    //probed devices
+	std::vector<libusb_device*> m_pending; //arrived, strings not read yet
+	double m_scan_ms;
+
+	static bool match(const char* want, const std::string& have)
+	{ return !want || !want[0] || have == want; }
+
+	//add every vid/pid match not already indexed to the pending list
+	void scan()
+	{
+		libusb_device** devs;
+		ssize_t cnt = libusb_get_device_list(m_ctx,&devs);
+		if(cnt < 0){ return; }//no usb devices found
+		std::lock_guard<std::mutex> lock(m_mtx);
+		for(ssize_t i=0; i<cnt; i++)
+		{
+			libusb_device_descriptor desc;
+			if(libusb_get_device_descriptor(devs[i],&desc) != 0){ continue; }
+			if(desc.idVendor != m_vid || desc.idProduct != m_pid){ continue; }
+			if(indexed(devs[i])){ continue; }
+			m_pending.push_back(libusb_ref_device(devs[i]));
+		}
+		libusb_free_device_list(devs,1);
+	}
+
+	//caller holds m_mtx
+	bool indexed(libusb_device* dev)
+	{
+		for(size_t i=0; i<m_index.size(); i++){ if(m_index[i].dev == dev){ return true; } }
+		for(size_t i=0; i<m_pending.size(); i++){ if(m_pending[i] == dev){ return true; } }
+		return false;
+	}
+
+	//read the strings of pending devices, this does usb i/o so it is never done in the hotplug callback
+	void probe_pending()
+	{
+		std::vector<libusb_device*> todo;
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			todo.swap(m_pending);
+		}
+		for(size_t i=0; i<todo.size(); i++)
+		{
+			hid_dev_info d;
+			d.dev = todo[i];
+			d.path = hid_dev_path(d.dev);
+			double t0 = time_ms();
+			d.probed = probe(d);
+			d.probe_ms = time_ms() - t0;
+			TRACE("Discovered %s [%s] [%s] [%s] in %.1f ms\n",d.path.c_str(),d.mfg.c_str(),d.prd.c_str(),d.serial.c_str(),d.probe_ms);
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_index.push_back(d);
+		}
+		if(todo.size()){ m_cv.notify_all(); }
+	}
+
+	//open device so we can read strings
+	static bool probe(hid_dev_info& d)
+	{
+		libusb_device_descriptor desc;
+		if(libusb_get_device_descriptor(d.dev,&desc) != 0){ return false; }
+		libusb_device_handle* devh = NULL;
+		int r = libusb_open(d.dev,&devh);
+		if(r != LIBUSB_SUCCESS || !devh){ ETRACE("%s %s\n",d.path.c_str(),libusb_error_name(r)); return false; }
+		d.mfg = get_string(devh,desc.iManufacturer);
+		d.prd = get_string(devh,desc.iProduct);
+		d.serial = get_string(devh,desc.iSerialNumber);
+		libusb_close(devh);
+		return true;
+	}
+
+	static std::string get_string(libusb_device_handle* devh, U8 idx)
+	{
+		if(idx == 0){ return ""; }
+		unsigned char strbuf[256];
+		int r = libusb_get_string_descriptor_ascii(devh,idx,strbuf,sizeof(strbuf));
+		if(r <= 0){ return ""; }
+		return std::string((char*)strbuf,r);
+	}
+
+	//hotplug events arrive here, and the strings of new devices are read
+	void event_thread()
+	{
+		while(m_run)
+		{
+			timeval tv = {0,100000};//100ms, so we notice m_run being cleared
+			libusb_handle_events_timeout_completed(m_ctx,&tv,NULL);
+			probe_pending();
+		}
+	}
+
+	//runs inside libusb event handling, possibly on an engine event thread, so only the lists are touched
+	static int LIBUSB_CALL hotplug_cb(libusb_context* ctx, libusb_device* dev, libusb_hotplug_event event, void* user_data)
+	{
+		hid_discovery* d = (hid_discovery*)user_data;
+		std::lock_guard<std::mutex> lock(d->m_mtx);
+		if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		{
+			if(!d->indexed(dev)){ d->m_pending.push_back(libusb_ref_device(dev)); }
+		}
+		else if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		{
+			for(size_t i=0; i<d->m_index.size(); i++)
+			{
+				if(d->m_index[i].dev != dev){ continue; }
+				TRACE("Removed %s\n",d->m_index[i].path.c_str());
+				libusb_unref_device(dev);
+				d->m_index.erase(d->m_index.begin()+i);
+				break;
+			}
+			for(size_t i=0; i<d->m_pending.size(); i++)
+			{
+				if(d->m_pending[i] != dev){ continue; }
+				libusb_unref_device(dev);
+				d->m_pending.erase(d->m_pending.begin()+i);
+				break;
+			}
+		}
+		return 0;//stay registered
+	}
+};
+
+#endif
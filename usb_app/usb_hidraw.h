@@ -0,0 +1,301 @@
+//////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL v2 (see License.txt)
+// Date:    08-01-2020
+//
+// hidraw backend
+//
+// Talks to /dev/hidrawN instead of libusb, so the kernel HID driver stays
+// attached and other tools on the host keep working.
+// One hidraw_poller thread waits on every open device with epoll and
+// hands IN reports to the engines, so receiving scales to dozens of
+// devices on one thread. OUT reports are written by the thread that sends
+// them, the kernel sends a hidraw write as one interrupt OUT transfer and
+// returns when it is done.
+// hidraw has no vendor control requests, block reads and writes use the
+// interrupt reports.
+//
+// -----------HIDRAW PERMISSIONS TO WORK WITHOUT SUDO------------
+// add to /etc/udev/rules.d/50-usb-permissions.rules
+// KERNEL=="hidraw*", ATTRS{idVendor}=="16c0", ATTRS{idProduct}=="05dc", MODE="0666"
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef __usb_hidraw_h_included__
+#define __usb_hidraw_h_included__
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <linux/hidraw.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include "usb_defs.h"
+#include "usb_xfer.h"
+
+#define HIDRAW_MAX_EVENTS  32
+
+//list /dev/hidrawN nodes of devices with a matching vid and pid
+inline int hidraw_list(U16 vid, U16 pid, std::vector<std::string>& found)
+{
+	DIR* dir = opendir("/dev");
+	if(!dir){ return 0; }
+	dirent* ent;
+	while((ent = readdir(dir)) != NULL)
+	{
+		if(strncmp(ent->d_name,"hidraw",6) != 0){ continue; }
+		std::string path = std::string("/dev/") + ent->d_name;
+		int fd = open(path.c_str(),O_RDWR | O_NONBLOCK);
+		if(fd < 0){ continue; }//no permission, or gone
+		hidraw_devinfo info;
+		if(ioctl(fd,HIDIOCGRAWINFO,&info) == 0 && (U16)info.vendor == vid && (U16)info.product == pid)
+		{ found.push_back(path); }
+		close(fd);
+	}
+	closedir(dir);
+	std::sort(found.begin(),found.end());
+	return (int)found.size();
+}
+
+//receives IN reports for every hidraw link on one thread
+class hidraw_poller
+{
+public:
+	//one open device, the poller calls it with each report read
+	class sink
+	{
+	public:
+		virtual ~sink(){}
+		virtual void on_report(const xfer_rpt& rpt) = 0;
+		virtual void on_error(int err) = 0;
+	};
+
+	hidraw_poller() : m_ep(-1), m_run(false) {}
+	~hidraw_poller(){ stop(); }
+	hidraw_poller(const hidraw_poller&) = delete;
+	hidraw_poller& operator=(const hidraw_poller&) = delete;
+
+	bool start()
+	{
+		if(m_run){ return true; }
+		m_ep = epoll_create1(EPOLL_CLOEXEC);
+		if(m_ep < 0){ ETRACE("epoll error %d\n",errno); return false; }
+		m_run = true;
+		m_thread = std::thread(&hidraw_poller::poll_thread,this);
+		return true;
+	}
+
+	void stop()
+	{
+		if(m_run)
+		{
+			m_run = false;
+			m_thread.join();
+		}
+		if(m_ep >= 0){ close(m_ep); m_ep = -1; }
+		m_sinks.clear();
+	}
+
+	//start delivering reports of fd to s
+	bool add(int fd, sink* s)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if(epoll_ctl(m_ep,EPOLL_CTL_ADD,fd,&ev) != 0){ ETRACE("epoll add error %d\n",errno); return false; }
+		m_sinks[fd] = s;
+		return true;
+	}
+
+	//stop delivering, when this returns s is not called again
+	void remove(int fd)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		epoll_ctl(m_ep,EPOLL_CTL_DEL,fd,NULL);
+		m_sinks.erase(fd);
+	}
+
+	int count()
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		return (int)m_sinks.size();
+	}
+
+private:
+	int m_ep;
+	std::atomic<bool> m_run;
+	std::thread m_thread;
+	std::mutex m_mtx;              //held while a sink is called, so remove() waits for it
+	std::map<int,sink*> m_sinks;
+
+	void poll_thread()
+	{
+		epoll_event ev[HIDRAW_MAX_EVENTS];
+		while(m_run)
+		{
+			int n = epoll_wait(m_ep,ev,HIDRAW_MAX_EVENTS,100);//100ms, so we notice m_run being cleared
+			for(int i=0; i<n; i++)
+			{
+				std::lock_guard<std::mutex> lock(m_mtx);
+				int fd = ev[i].data.fd;
+				std::map<int,sink*>::iterator it = m_sinks.find(fd);
+				if(it == m_sinks.end()){ continue; }//removed while we waited
+				if(ev[i].events & (EPOLLERR | EPOLLHUP))
+				{
+					ETRACE("RCV HIDRAW ERROR, device gone\n");
+					epoll_ctl(m_ep,EPOLL_CTL_DEL,fd,NULL);
+					it->second->on_error(-EIO);
+					continue;
+				}
+
+				//drain every report that is waiting
+				xfer_rpt rpt;
+				ssize_t r;
+				while((r = read(fd,rpt.d,XFER_RPT_LEN)) == XFER_RPT_LEN){ it->second->on_report(rpt); }
+				if(r < 0 && errno != EAGAIN && errno != EINTR)
+				{
+					ETRACE("RCV HIDRAW ERROR %d\n",errno);
+					epoll_ctl(m_ep,EPOLL_CTL_DEL,fd,NULL);
+					it->second->on_error(-errno);
+				}
+			}
+		}
+	}
+};
+
+//engine link over an open hidraw node
+class xfer_hidraw_link : public xfer_link, public hidraw_poller::sink
+{
+public:
+	xfer_hidraw_link(int fd, hidraw_poller& poller) : m_fd(fd), m_poller(poller), m_eng(0), m_err(0) {}
+	~xfer_hidraw_link(){ stop(); }
+
+	bool start(xfer_engine* eng)
+	{
+		if(m_eng){ return true; }
+		m_err = 0;
+		m_eng = eng;
+		if(!m_poller.add(m_fd,this)){ m_eng = 0; return false; }
+		return true;
+	}
+
+	void stop()
+	{
+		if(!m_eng){ return; }
+		m_poller.remove(m_fd);
+		m_eng = 0;
+	}
+
+	//report number 0 first, the device has no report ids
+	bool send(const xfer_rpt& rpt)
+	{
+		if(m_err){ return false; }
+		U8 buf[XFER_RPT_LEN+1];
+		buf[0] = 0;
+		memcpy(buf+1,rpt.d,XFER_RPT_LEN);
+		ssize_t r = write(m_fd,buf,sizeof(buf));
+		if(r != (ssize_t)sizeof(buf)){ ETRACE("HIDRAW XMT ERROR %d\n",errno); m_err = -EIO; return false; }
+		return true;
+	}
+
+	//writes return when the report has gone
+	bool flush(){ return m_err == 0; }
+
+	void on_report(const xfer_rpt& rpt){ m_eng->link_rx(rpt); }
+	void on_error(int err){ m_err = err; m_eng->link_err(err); }
+
+private:
+	int m_fd;
+	hidraw_poller& m_poller;
+	xfer_engine* m_eng;
+	std::atomic<int> m_err;
+};
+
+//one device opened through hidraw
+class hidraw_client : public xfer_dev
+{
+public:
+	hidraw_client(hidraw_poller& poller) : m_poller(poller), m_fd(-1) {}
+	~hidraw_client(){ disconnect(); }
+	hidraw_client(const hidraw_client&) = delete;
+	hidraw_client& operator=(const hidraw_client&) = delete;
+
+	bool open(const char* path)
+	{
+		if(m_fd >= 0){ return false; }
+		m_fd = ::open(path,O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if(m_fd < 0){ ETRACE("Failed to open %s, error %d\n",path,errno); return false; }
+		m_name = path;
+		TRACE("Opened %s\n",path);
+		return true;
+	}
+
+	void disconnect()
+	{
+		if(m_fd >= 0){ close(m_fd); m_fd = -1; }
+	}
+
+	const char* name(){ return m_name.c_str(); }
+	xfer_link* new_link(int depth){ return new xfer_hidraw_link(m_fd,m_poller); }
+
+	//proprietary read byte command for TinyAvr firmware, blocking
+	bool read_byte(U8* ret_byte, U8 adr)
+	{
+		xfer_rpt rq = {{XFER_CMD_READ,adr,0,0,0,0,0,0}};
+		if(!send(rq)){ return false; }
+
+		//wait for response, skip anything that is not ours
+		double t_end = time_ms() + 1000;
+		xfer_rpt rsp;
+		while(time_ms() < t_end)
+		{
+			pollfd pfd = {m_fd,POLLIN,0};
+			if(poll(&pfd,1,250) <= 0){ continue; }
+			if(read(m_fd,rsp.d,XFER_RPT_LEN) != XFER_RPT_LEN){ continue; }
+			if(rsp.d[0] != XFER_CMD_READ || rsp.d[1] != adr){ continue; }
+			*ret_byte = rsp.d[2];
+			return true;
+		}
+		ETRACE("RCV HIDRAW TIMEOUT ADR=%d\n",adr);
+		return false;
+	}
+
+	//proprietary write byte command for TinyAvr firmware, blocking, verified with a read
+	bool write_byte(U8* data_byte, U8 adr)
+	{
+		xfer_rpt rq = {{XFER_CMD_WRITE,adr,*data_byte,0,0,0,0,0}};
+		if(!send(rq)){ return false; }
+		U8 verify_byte = 0xFF;
+		if(!read_byte(&verify_byte,adr)){ return false; }
+		if(*data_byte != verify_byte){ ETRACE("HIDRAW XMT VERIFY ERROR\n"); return false; }
+		return true;
+	}
+
+private:
+	hidraw_poller& m_poller;
+	int m_fd;
+	std::string m_name;
+
+	bool send(const xfer_rpt& rpt)
+	{
+		U8 buf[XFER_RPT_LEN+1];
+		buf[0] = 0;//report number
+		memcpy(buf+1,rpt.d,XFER_RPT_LEN);
+		if(write(m_fd,buf,sizeof(buf)) != (ssize_t)sizeof(buf)){ ETRACE("HIDRAW XMT ERROR %d\n",errno); return false; }
+		return true;
+	}
+};
+
+#endif
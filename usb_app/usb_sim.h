@@ -0,0 +1,320 @@
+//////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL v2 (see License.txt)
+// Date:    08-01-2020
+//
+// Simulated TinyAvr device
+//
+// An in-process stand in for the firmware, so the host path can be
+// measured on any linux box. It answers the same 8 byte reports as
+// usbFunctionWriteOut() in usb.c, with the same response queue, so a
+// command that finds the queue full is held, and one more while a command
+// is held is lost, just like on the device.
+// The host polls both interrupt endpoints once per interval, every tick
+// the device thread...
+//   - hands the interrupt IN buffer to the host, if the device filled it
+//   - takes one OUT report and runs it through write_out()
+//   - runs send_to_host(), the usbPollSendtoHost() of the firmware
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef __usb_sim_h_included__
+#define __usb_sim_h_included__
+
+#include <string.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "usb_defs.h"
+#include "usb_xfer.h"
+
+#define SIM_EE_SIZE       256  //attiny1614 EEPROM
+#define SIM_INTERVAL_MS   8    //linux polls a low speed endpoint with bInterval 10 every 8ms
+#define SIM_RSP_CNT       8    //USB_RSP_CNT in usb.c
+#define SIM_EE_QUEUE      64   //USB_EE_CNT in usb.c
+
+class xfer_sim_link : public xfer_link
+{
+public:
+	xfer_sim_link(int depth, int interval_ms = SIM_INTERVAL_MS)
+	: m_depth(depth), m_interval_ms(interval_ms), m_eng(0), m_run(false), m_nonce(1), m_rsp_head(0), m_rsp_tail(0), m_rsp_full(0), m_rsp_lost(0), m_int_ready(false), m_blk_adr(0), m_blk_cnt(0), m_mem_adr(0), m_mem_cnt(0), m_frm_adr(0), m_frm_len(0), m_frm_pos(0)
+	{
+		if(m_interval_ms < 1){ m_interval_ms = 1; }
+		memset(m_ee,0xFF,sizeof(m_ee));
+		memset(m_held,0,sizeof(m_held));
+	}
+
+	~xfer_sim_link(){ stop(); }
+
+	//plug in, this is a usb reset, a new session starts
+	bool start(xfer_engine* eng)
+	{
+		if(m_run){ return true; }
+		m_eng = eng;
+		m_out.clear();
+		m_rsp_head = m_rsp_tail = 0;
+		m_held[0] = 0;
+		m_rsp_full = m_rsp_lost = 0;
+		m_int_ready = false;
+		m_blk_cnt = 0;
+		m_mem_cnt = 0;
+		m_frm_len = 0;
+		m_nonce = m_nonce * 5 + 1;
+		m_run = true;
+		m_thread = std::thread(&xfer_sim_link::device_thread,this);
+		return true;
+	}
+
+	void stop()
+	{
+		if(!m_thread.joinable()){ return; }
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			m_run = false;
+			m_cv.notify_all();
+		}
+		m_thread.join();
+		m_out.clear();
+	}
+
+	//queue one OUT report, up to depth are waiting for their poll interval
+	bool send(const xfer_rpt& rpt)
+	{
+		std::unique_lock<std::mutex> lock(m_mtx);
+		m_cv.wait(lock,[this]{ return (int)m_out.size() < m_depth || !m_run; });
+		if(!m_run){ return false; }
+		m_out.push_back(rpt);
+		return true;
+	}
+
+	bool flush()
+	{
+		std::unique_lock<std::mutex> lock(m_mtx);
+		m_cv.wait(lock,[this]{ return m_out.empty() || !m_run; });
+		return m_run;
+	}
+
+	//device eeprom, only touch it while the link is stopped
+	U8* eeprom(){ return m_ee; }
+
+private:
+	int m_depth;
+	int m_interval_ms;
+	xfer_engine* m_eng;
+	bool m_run;
+	std::thread m_thread;
+	std::mutex m_mtx;              //protects everything below
+	std::condition_variable m_cv;  //signaled when an OUT report is taken
+	std::deque<xfer_rpt> m_out;    //OUT reports the host submitted
+
+	//device state, same names as usb.c without the g_ prefix
+	U8 m_ee[SIM_EE_SIZE];
+	U16 m_nonce;
+	U8 m_rsp[SIM_RSP_CNT][XFER_RPT_LEN]; //g_RspBuf
+	U8 m_rsp_head;
+	U8 m_rsp_tail;
+	U8 m_held[XFER_RPT_LEN];       //g_HeldCmd
+	U16 m_rsp_full;
+	U16 m_rsp_lost;
+	U8 m_int[XFER_RPT_LEN];        //interrupt IN buffer, usbSetInterrupt() copies into it
+	bool m_int_ready;              //!usbInterruptIsReady()
+	U8 m_blk_adr;
+	U16 m_blk_cnt;
+	U16 m_mem_adr;
+	U16 m_mem_cnt;
+	U8 m_frm_buf[XFER_FRM_MAX];    //g_FrmBuf
+	U8 m_frm_adr;
+	U8 m_frm_len;
+	U8 m_frm_pos;
+
+	//one poll interval per tick
+	void device_thread()
+	{
+		double t_next = time_ms();
+		std::unique_lock<std::mutex> lock(m_mtx);
+		while(m_run)
+		{
+			t_next += m_interval_ms;
+			double wait = t_next - time_ms();
+			if(wait > 0){ m_cv.wait_for(lock,std::chrono::microseconds((long)(wait*1000))); }
+			if(!m_run){ break; }
+			if(time_ms() < t_next){ t_next -= m_interval_ms; continue; }//woken early by a send, not a tick
+
+			//IN token, host collects the interrupt buffer
+			if(m_int_ready)
+			{
+				xfer_rpt rpt;
+				memcpy(rpt.d,m_int,XFER_RPT_LEN);
+				m_int_ready = false;
+				lock.unlock();
+				m_eng->link_rx(rpt);
+				lock.lock();
+			}
+
+			//OUT token, one report per interval
+			if(!m_out.empty())
+			{
+				xfer_rpt rpt = m_out.front();
+				m_out.pop_front();
+				write_out(rpt.d);
+				m_cv.notify_all();
+			}
+
+			//main loop
+			send_to_host();
+		}
+	}
+
+	//usbPollSendtoHost()
+	void send_to_host()
+	{
+		if(m_int_ready){ return; }//previous data not sent yet
+		if(m_rsp_head != m_rsp_tail)
+		{
+			memcpy(m_int,m_rsp[m_rsp_tail % SIM_RSP_CNT],XFER_RPT_LEN);
+			m_int_ready = true;
+			m_rsp_tail++;
+			if(m_held[0] && run_command(m_held)){ m_held[0] = 0; }
+		}
+		else if(m_blk_cnt)
+		{
+			m_int[0] = XFER_CMD_BLOCK;
+			m_int[1] = m_blk_adr;
+			for(int i=0; i<XFER_BLK_DATA; i++)
+			{
+				if(m_blk_cnt){ m_int[2+i] = m_ee[m_blk_adr]; m_blk_adr++; m_blk_cnt--; }//U8 address wraps at 256
+				else         { m_int[2+i] = 0xFF; }
+			}
+			m_int_ready = true;
+		}
+		else if(m_mem_cnt)
+		{
+			m_int[0] = XFER_CMD_MEM;
+			m_int[1] = m_mem_adr & 0xFF;
+			for(int i=0; i<XFER_BLK_DATA; i++)
+			{
+				if(m_mem_cnt){ m_int[2+i] = mem_read(m_mem_adr); m_mem_adr++; m_mem_cnt--; }
+				else         { m_int[2+i] = 0xFF; }
+			}
+			m_int_ready = true;
+		}
+	}
+
+	//data space byte, only the EEPROM is simulated, flash is blank and everything else reads 0
+	U8 mem_read(U16 adr)
+	{
+		if(adr >= 0x1400 && adr < 0x1400 + SIM_EE_SIZE){ return m_ee[adr - 0x1400]; }
+		if(adr >= 0x8000){ return 0xFF; }
+		return 0;
+	}
+
+	//usbFunctionWriteOut()
+	void write_out(const U8* data)
+	{
+		if(m_held[0]){ m_rsp_lost++; return; }
+		if(!run_command(data)){ memcpy(m_held,data,XFER_RPT_LEN); m_rsp_full++; }
+	}
+
+	//usbFrameAdd()
+	void frame_add(const U8* data, int cnt, U8* rsp)
+	{
+		for(int i=0; i<cnt && m_frm_pos<m_frm_len; i++){ m_frm_buf[m_frm_pos++] = data[i]; }
+		if(m_frm_pos < m_frm_len){ return; }
+		U16 crc = crc16_usb(m_frm_buf,m_frm_len);
+		for(int i=0; i<m_frm_len; i++){ m_ee[(U8)(m_frm_adr+i)] = m_frm_buf[i]; }
+		rsp[0] = XFER_CMD_FRAME; rsp[1] = m_frm_adr; rsp[2] = m_frm_len; rsp[3] = crc & 0xFF; rsp[4] = crc >> 8;
+		m_frm_len = 0;
+	}
+
+	//usbRunCommand(), 0 when a response is needed and the queue is full
+	bool run_command(const U8* data)
+	{
+		U8 cmd = data[0];
+		U8 adr = data[1];
+		U8 val = data[2];
+		U8* rsp = 0;
+		if(cmd != XFER_CMD_FRAME_NEXT){ m_frm_len = 0; }
+		bool frm_end = (cmd == XFER_CMD_FRAME && val && val <= XFER_FRM_FIRST) || (cmd == XFER_CMD_FRAME_NEXT && m_frm_len && m_frm_len - m_frm_pos <= XFER_FRM_NEXT);
+		if(cmd == XFER_CMD_READ || cmd == XFER_CMD_CRC || cmd == XFER_CMD_RANGE_CRC || cmd == XFER_CMD_STATUS || cmd == XFER_CMD_QUEUE || cmd == XFER_CMD_FLOW || cmd == XFER_CMD_BOOT || frm_end)
+		{
+			if((U8)(m_rsp_head - m_rsp_tail) >= SIM_RSP_CNT){ return false; }
+			rsp = m_rsp[m_rsp_head % SIM_RSP_CNT];
+			memset(rsp,0,XFER_RPT_LEN);
+			rsp[0] = cmd;
+		}
+		switch(cmd)
+		{
+			case XFER_CMD_WRITE: m_ee[adr] = val; break;
+			case XFER_CMD_FRAME:
+			{
+				if(!val || val > XFER_FRM_MAX){ break; }
+				m_frm_adr = adr; m_frm_len = val; m_frm_pos = 0;
+				frame_add(&data[3],XFER_FRM_FIRST,rsp);
+				break;
+			}
+			case XFER_CMD_FRAME_NEXT: if(m_frm_len){ frame_add(&data[1],XFER_FRM_NEXT,rsp); } break;
+			case XFER_CMD_PACKED:
+			{
+				if(adr > XFER_PACK_PAIRS){ adr = XFER_PACK_PAIRS; }
+				for(int i=0; i<adr; i++){ m_ee[data[2+2*i]] = data[3+2*i]; }
+				break;
+			}
+			case XFER_CMD_DELTA:
+			{
+				U8 dd = val;
+				m_ee[adr] = data[3];
+				for(int i=1; i<XFER_DELTA_CNT && (dd & 3); i++, dd >>= 2)
+				{
+					adr += dd & 3;
+					m_ee[adr] = data[3+i];
+				}
+				break;
+			}
+			case XFER_CMD_READ: rsp[1] = adr; rsp[2] = m_ee[adr]; break;
+			case XFER_CMD_BLOCK: m_blk_adr = adr; m_blk_cnt = val ? val : 256; break;
+			case XFER_CMD_CRC:
+			{
+				int cnt = val ? val : 256;
+				if(cnt > SIM_EE_SIZE - adr){ cnt = SIM_EE_SIZE - adr; }
+				U16 crc = crc16_usb(&m_ee[adr],cnt);
+				rsp[1] = adr; rsp[2] = val; rsp[3] = crc & 0xFF; rsp[4] = crc >> 8;
+				break;
+			}
+			case XFER_CMD_STATUS:
+			{
+				rsp[1] = XFER_ST_READY; rsp[2] = m_nonce & 0xFF; rsp[3] = m_nonce >> 8; rsp[4] = 0;
+				break;
+			}
+			case XFER_CMD_QUEUE:
+			{
+				rsp[1] = SIM_RSP_CNT; rsp[2] = (U8)(m_rsp_head - m_rsp_tail); rsp[3] = m_held[0] ? 1 : 0;
+				rsp[4] = m_rsp_full & 0xFF; rsp[5] = m_rsp_full >> 8; rsp[6] = m_rsp_lost & 0xFF; rsp[7] = m_rsp_lost >> 8;
+				break;
+			}
+			case XFER_CMD_MEM: m_mem_adr = data[1] | (data[2] << 8); m_mem_cnt = data[3] | (data[4] << 8); break;
+			case XFER_CMD_RANGE_CRC: //done at once, flash is blank
+			{
+				int a = data[1] | (data[2] << 8);
+				int cnt = data[3] | (data[4] << 8);
+				memcpy(rsp,data,5);
+				if(data[5] != XFER_SPACE_EE && data[5] != XFER_SPACE_FLASH){ rsp[7] = XFER_SPACE_BAD; break; } //unknown space, no CRC
+				int size = data[5] == XFER_SPACE_FLASH ? XFER_FLASH_SIZE : SIM_EE_SIZE;
+				if(a >= size){ cnt = 0; }
+				else if(cnt > size - a){ cnt = size - a; }
+				std::vector<U8> blank(cnt,0xFF);
+				U16 crc = crc16_usb(data[5] == XFER_SPACE_FLASH || !cnt ? blank.data() : &m_ee[a],cnt); //past the end is no data, like the firmware clamp
+				rsp[5] = crc & 0xFF; rsp[6] = crc >> 8; rsp[7] = data[5];
+				break;
+			}
+			case XFER_CMD_FLOW: rsp[1] = SIM_EE_QUEUE; break; //writes are instant, nothing ever queues or stalls
+			case XFER_CMD_BOOT: rsp[1] = 0; break; //BOOTEND fuse, no bootloader
+		}
+		if(rsp){ m_rsp_head++; }
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,332 @@
+//////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL v2 (see License.txt)
+// Date:    08-01-2020
+//
+// Streaming telemetry capture
+//
+// 'T' starts the sampler on the device, which sends 'V' reports on both
+// interrupt IN endpoints (EP1 and EP3) in turn. Transfers stay submitted
+// on both, their callbacks push the reports into a lock-free single
+// producer, single consumer ring, and a writer thread takes them off,
+// puts them back in sequence order and writes the samples to a file.
+// Samples dropped on the device (its ring was full), reports missing in
+// the sequence and reports dropped because the host ring was full are
+// all counted, so a capture that keeps up reports zero for each.
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef __usb_stream_h_included__
+#define __usb_stream_h_included__
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <libusb-1.0/libusb.h>
+#include "usb_defs.h"
+#include "usb_xfer.h"
+
+#define STREAM_RING       1024 //host ring, reports, must be a power of 2
+#define STREAM_IN_CNT     4    //IN transfers kept submitted on each endpoint
+#define STREAM_REORDER    8    //reports held waiting for a missing one before it is counted lost
+#define STREAM_RATE       500  //default sample rate, Hz
+#define STREAM_RATE_MIN   153  //slowest rate every firmware build takes, its floor is (F_CPU/2)/65536+1 (153Hz at 20MHz)
+#define STREAM_RATE_MAX   10000 //fastest rate the firmware takes, USB_STR_MAX_HZ
+#define STREAM_DRAIN_MS   100  //reports still in flight after the stop response
+
+//single producer, single consumer ring of reports, no locks
+class stream_ring
+{
+public:
+	stream_ring() : m_head(0), m_tail(0) {}
+
+	//producer only, false when full
+	bool push(const xfer_rpt& rpt)
+	{
+		U32 h = m_head.load(std::memory_order_relaxed);
+		if(h - m_tail.load(std::memory_order_acquire) >= STREAM_RING){ return false; }
+		m_buf[h & (STREAM_RING-1)] = rpt;
+		m_head.store(h + 1,std::memory_order_release);
+		return true;
+	}
+
+	//consumer only, false when empty
+	bool pop(xfer_rpt& rpt)
+	{
+		U32 t = m_tail.load(std::memory_order_relaxed);
+		if(t == m_head.load(std::memory_order_acquire)){ return false; }
+		rpt = m_buf[t & (STREAM_RING-1)];
+		m_tail.store(t + 1,std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::atomic<U32> m_head;
+	std::atomic<U32> m_tail;
+	xfer_rpt m_buf[STREAM_RING];
+};
+
+struct stream_stats
+{
+	U32 reports;      //reports written
+	U32 samples;      //samples written
+	U32 lost;         //reports missing in the sequence
+	U32 ring_full;    //reports dropped, host ring was full
+	U32 dropped;      //samples dropped on the device
+	U32 dev_samples;  //samples the device sent, from the stop response
+	U32 dev_dropped;  //samples the device dropped, from the stop response
+	double ms;        //capture time
+};
+
+//puts reports from both endpoints back in sequence order and writes their samples
+class stream_writer
+{
+public:
+	stream_writer(FILE* f) : m_file(f), m_started(false), m_next(0), m_pending(0)
+	{
+		memset(m_have,0,sizeof(m_have));
+		memset(&m_st,0,sizeof(m_st));
+	}
+
+	void add(const xfer_rpt& rpt)
+	{
+		U8 seq = rpt.d[1];
+		if(!m_started){ m_started = true; m_next = seq; }
+		if((U8)(seq - m_next) >= 128 || m_have[seq]){ return; } //older than what was written, or a duplicate
+		m_rpt[seq] = rpt;
+		m_have[seq] = 1;
+		m_pending++;
+		emit();
+		while(m_pending > STREAM_REORDER)
+		{
+			m_next++; //give up on the missing report
+			m_st.lost++;
+			emit();
+		}
+	}
+
+	//write whatever is still held, gaps are counted lost
+	void finish()
+	{
+		while(m_pending)
+		{
+			if(!m_have[m_next]){ m_next++; m_st.lost++; continue; }
+			emit();
+		}
+	}
+
+	stream_stats& stats(){ return m_st; }
+
+private:
+	FILE* m_file;
+	bool m_started;
+	U8 m_next;      //sequence of the next report to write
+	int m_pending;  //reports held
+	U8 m_have[256];
+	xfer_rpt m_rpt[256];
+	stream_stats m_st;
+
+	void emit()
+	{
+		while(m_have[m_next])
+		{
+			xfer_rpt& r = m_rpt[m_next];
+			m_have[m_next] = 0;
+			m_pending--;
+			m_st.dropped += r.d[2];
+			if(m_file){ fwrite(&r.d[3],1,XFER_STR_SAMPLES,m_file); }
+			m_st.reports++;
+			m_st.samples += XFER_STR_SAMPLES;
+			m_next++;
+		}
+	}
+};
+
+//captures the stream of one device, the device must not be used by an engine at the same time
+class stream_capture
+{
+public:
+	stream_capture(libusb_context* ctx, libusb_device_handle* devh)
+	: m_ctx(ctx), m_devh(devh), m_run(false), m_write(false), m_in_busy(0), m_err(0), m_have_rsp(false), m_ring_full(0), m_writer(0), m_file(0), m_t0(0)
+	{
+		memset(m_in,0,sizeof(m_in));
+	}
+	~stream_capture(){ stop(0); }
+
+	//open file, start reading both endpoints and the writer, then start the device sampler
+	bool start(const char* file, int rate)
+	{
+		m_file = fopen(file,"wb");
+		if(!m_file){ ETRACE("Unable to write file: %s\n",file); return false; }
+		m_writer = new stream_writer(m_file);
+		m_ring_full = 0;
+		m_run = true;
+		m_thread = std::thread(&stream_capture::event_thread,this);
+		m_write = true;
+		m_wthread = std::thread(&stream_capture::write_thread,this);
+		const U8 eps[2] = {XFER_EP_IN,XFER_EP_IN3};
+		for(int e=0; e<2 && !m_err; e++)
+		{
+			for(int i=0; i<STREAM_IN_CNT; i++)
+			{
+				libusb_transfer* t = libusb_alloc_transfer(0);
+				if(!t){ stop(0); return false; }
+				int slot = e*STREAM_IN_CNT + i;
+				m_in[slot] = t;
+				libusb_fill_interrupt_transfer(t,m_devh,eps[e],m_in_buf[slot].d,XFER_RPT_LEN,in_cb,this,0);//no timeout, cancelled in stop()
+				std::lock_guard<std::mutex> lock(m_mtx);
+				int r = libusb_submit_transfer(t);
+				if(r != 0){ ETRACE("USB IN SUBMIT ERROR %s\n",libusb_error_name(r)); m_err = r; break; }
+				m_in_busy++;
+			}
+		}
+		if(m_err){ stop(0); return false; }
+
+		xfer_rpt rq = {{XFER_CMD_STREAM,1,(U8)(rate & 0xFF),(U8)(rate >> 8),0,0,0,0}};
+		xfer_rpt rsp;
+		if(!command(rq,rsp)){ stop(0); return false; }
+		m_t0 = time_ms();
+		return true;
+	}
+
+	//stop the device sampler, drain and close the file
+	bool stop(stream_stats* st)
+	{
+		if(!m_run){ return false; }
+		bool ok = false;
+		xfer_rpt rsp;
+		if(!m_err)
+		{
+			xfer_rpt rq = {{XFER_CMD_STREAM,0,0,0,0,0,0,0}};
+			ok = command(rq,rsp);
+			delay_ms(STREAM_DRAIN_MS);
+		}
+		double t1 = time_ms();
+		{
+			std::unique_lock<std::mutex> lock(m_mtx);
+			for(int i=0; i<2*STREAM_IN_CNT; i++){ if(m_in[i]){ libusb_cancel_transfer(m_in[i]); } }
+			m_cv.wait_for(lock,std::chrono::milliseconds(1000),[this]{ return m_in_busy == 0; });
+		}
+		m_run = false;
+		m_thread.join();
+		m_write = false;
+		m_wthread.join();
+		for(int i=0; i<2*STREAM_IN_CNT; i++){ if(m_in[i]){ libusb_free_transfer(m_in[i]); m_in[i] = 0; } }
+		m_writer->finish();
+		if(st)
+		{
+			*st = m_writer->stats();
+			st->ring_full = m_ring_full;
+			st->ms = t1 - m_t0;
+			if(ok)
+			{
+				st->dev_dropped = rsp.d[2] | (rsp.d[3] << 8);
+				st->dev_samples = rsp.d[4] | (rsp.d[5] << 8) | (rsp.d[6] << 16) | ((U32)rsp.d[7] << 24);
+			}
+		}
+		delete m_writer; m_writer = 0;
+		fclose(m_file); m_file = 0;
+		return ok;
+	}
+
+private:
+	libusb_context* m_ctx;
+	libusb_device_handle* m_devh;
+	std::atomic<bool> m_run;       //event thread runs
+	std::atomic<bool> m_write;     //writer thread runs
+	std::thread m_thread;
+	std::thread m_wthread;
+	std::mutex m_mtx;              //protects the transfers and the 'T' response
+	std::condition_variable m_cv;
+	int m_in_busy;
+	int m_err;
+	bool m_have_rsp;
+	xfer_rpt m_rsp;                //last 'T' response
+	std::atomic<U32> m_ring_full;
+	libusb_transfer* m_in[2*STREAM_IN_CNT];
+	xfer_rpt m_in_buf[2*STREAM_IN_CNT];
+	stream_ring m_ring;
+	stream_writer* m_writer;
+	FILE* m_file;
+	double m_t0;                   //time the device started sampling
+
+	//send a 'T' request and wait for its response, sent again on timeout
+	bool command(const xfer_rpt& rq, xfer_rpt& rsp)
+	{
+		for(int tries=0; tries<XFER_MAX_RETRY; tries++)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mtx);
+				m_have_rsp = false;
+			}
+			int xfer = 0;
+			int r = libusb_interrupt_transfer(m_devh,XFER_EP_OUT,(U8*)rq.d,XFER_RPT_LEN,&xfer,250);
+			if(r != 0 || xfer != XFER_RPT_LEN){ ETRACE("USB XMT ERROR %d, SENT %d\n",r,xfer); return false; }
+			std::unique_lock<std::mutex> lock(m_mtx);
+			if(!m_cv.wait_for(lock,std::chrono::milliseconds(250),[this,&rq]{ return m_err || (m_have_rsp && m_rsp.d[1] == rq.d[1]); })){ continue; }
+			if(m_err){ return false; }
+			rsp = m_rsp;
+			return true;
+		}
+		ETRACE("NO RESPONSE FOR CMD=%c\n",rq.d[0]);
+		return false;
+	}
+
+	//runs libusb callbacks until stop()
+	void event_thread()
+	{
+		while(m_run)
+		{
+			timeval tv = {0,100000};//100ms, so we notice m_run being cleared
+			libusb_handle_events_timeout_completed(m_ctx,&tv,NULL);
+		}
+	}
+
+	//takes reports off the ring, runs until stop() and the ring is empty
+	void write_thread()
+	{
+		xfer_rpt rpt;
+		for(;;)
+		{
+			if(m_ring.pop(rpt)){ m_writer->add(rpt); continue; }
+			if(!m_write){ break; }
+			delay_ms(1);
+		}
+	}
+
+	static void LIBUSB_CALL in_cb(libusb_transfer* t)
+	{
+		stream_capture* c = (stream_capture*)t->user_data;
+		if(t->status == LIBUSB_TRANSFER_COMPLETED && t->actual_length == XFER_RPT_LEN)
+		{
+			xfer_rpt rpt;
+			memcpy(rpt.d,t->buffer,XFER_RPT_LEN);
+			if(rpt.d[0] == XFER_STR_DATA)
+			{
+				if(!c->m_ring.push(rpt)){ c->m_ring_full++; }
+			}
+			else if(rpt.d[0] == XFER_CMD_STREAM)
+			{
+				std::lock_guard<std::mutex> lock(c->m_mtx);
+				c->m_rsp = rpt;
+				c->m_have_rsp = true;
+				c->m_cv.notify_all();
+			}
+		}
+		std::lock_guard<std::mutex> lock(c->m_mtx);
+		if(t->status != LIBUSB_TRANSFER_COMPLETED && t->status != LIBUSB_TRANSFER_CANCELLED && t->status != LIBUSB_TRANSFER_TIMED_OUT && !c->m_err)
+		{ ETRACE("RCV USB ERROR %d\n",t->status); c->m_err = LIBUSB_ERROR_IO; c->m_cv.notify_all(); }
+
+		//keep IN transfer on the wire until stop()
+		if(t->status != LIBUSB_TRANSFER_CANCELLED && !c->m_err && libusb_submit_transfer(t) == 0)
+		{ return; }
+		c->m_in_busy--;
+		c->m_cv.notify_all();
+	}
+};
+
+#endif
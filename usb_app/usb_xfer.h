@@ -0,0 +1,1018 @@
+//////////////////////////////////////////////////////////////////
+//
+// Author:  12oClocker
+// License: GNU GPL v2 (see License.txt)
+// Date:    08-01-2020
+//
+// Asynchronous pipelined transfer engine
+//
+// The blocking read_byte() and write_byte() calls keep only one
+// request on the wire, so every byte waits out a full poll interval.
+// This engine uses the libusb async API instead...
+//   - a preallocated pool of OUT transfers, up to "depth" requests in flight
+//   - IN transfers that are always submitted, so every poll interval can deliver a report
+//   - an event thread that runs the libusb callbacks
+// Responses are matched to requests by the address echo in byte1 of
+// the report, requests with no response after a timeout are sent again.
+// The reports travel over an xfer_link, xfer_usb_link is the libusb one,
+// so the same engine can run against a simulated device (usb_sim.h).
+//
+//////////////////////////////////////////////////////////////////
+
+#ifndef __usb_xfer_h_included__
+#define __usb_xfer_h_included__
+
+#include <string.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <libusb-1.0/libusb.h>
+#include "usb_defs.h"
+
+//report commands, see usbFunctionWriteOut() in usb.c
+#define XFER_CMD_READ     'R'
+#define XFER_CMD_WRITE    'W'
+#define XFER_CMD_BLOCK    'B'
+#define XFER_CMD_CRC      'C'
+#define XFER_CMD_STATUS   'S'
+#define XFER_CMD_QUEUE    'Q'
+#define XFER_CMD_FLOW     'N'
+#define XFER_CMD_RANGE_CRC 'K' //CRC16 of any EEPROM or flash range, 16 bit address and count
+#define XFER_SPACE_EE     0    //'K' memory spaces
+#define XFER_SPACE_FLASH  1
+#define XFER_SPACE_BAD    0xFF //'K' response space, the device does not know the requested space
+#define XFER_FLASH_SIZE   16384 //attiny1614 flash
+#define XFER_CMD_MEM      'M'  //memory read, 16 bit data space address and count, streamed like 'B'
+#define XFER_CMD_BOOT     'J'  //reset into the USB bootloader, see usb_boot.h
+#define XFER_CMD_STREAM   'T'  //start or stop streaming telemetry, see usb_stream.h
+#define XFER_STR_DATA     'V'  //streaming report, sequence, dropped samples, XFER_STR_SAMPLES samples
+#define XFER_STR_SAMPLES  5
+#define XFER_CMD_GPIO     'G'  //subscribe to pin changes, PORTA and PORTB pin masks
+#define XFER_GPIO_EVENT   'E'  //unsolicited pin change report, see xfer_gpio
+#define XFER_CMD_OSC      'O'  //oscillator calibration stats, forget the kept value, reconnect, see xfer_osc
+#define XFER_OSC_STATS    0    //'O' operations
+#define XFER_OSC_FORGET   1
+#define XFER_OSC_FORGET_RECONNECT 2
+#define XFER_OSC_RECONNECT 3
+#define XFER_CMD_DRIFT    'H'  //oscillator drift tracker state and history, see xfer_drift
+#define XFER_DRIFT_BLK    6    //history entries per 'H' report
+#define XFER_CMD_TASK     'Z'  //scheduler stats of one task, see xfer_task
+#define XFER_CMD_POLLS    'L'  //gaps between usbPoll() calls on the device, see xfer_polls
+#define XFER_POLLS_READ   0    //'L' operations
+#define XFER_POLLS_CLEAR  1
+#define XFER_POLLS_ALARM  2    //clear and set the alarm threshold
+#define XFER_POLLS_BINS   16   //histogram bins, bin 0 is under a TCA0 tick, bin n holds 2^(n-1) up to 2^n ticks, the last one everything longer
+#define XFER_POLLS_BLK    2    //bins per 'L' report
+#define XFER_CMD_PACKED   'P'  //up to 3 address/value write pairs
+#define XFER_CMD_DELTA    'D'  //up to 5 writes, address steps of 1 to 3
+#define XFER_PACK_PAIRS   3
+#define XFER_DELTA_CNT    5
+#define XFER_DELTA_MAX    3
+#define XFER_CMD_FRAME    'F'  //framed write start, the device responds when the frame is complete
+#define XFER_CMD_FRAME_NEXT '+' //framed write continuation
+#define XFER_FRM_MAX      32   //largest frame, one EEPROM page
+#define XFER_FRM_FIRST    5    //data bytes in the start report
+#define XFER_FRM_NEXT     7    //data bytes in each continuation report
+#define XFER_ST_READY     0x03 //status flags, oscillator calibrated and EEPROM not busy
+#define XFER_ST_OSC_OFF   0x04 //status flag, the trimmed oscillator is outside what the USB receiver tolerates
+#define XFER_ST_POLL_LATE 0x08 //status flag, usbPoll() came later than the 'L' alarm threshold at least once
+#define XFER_RPT_LEN      8   //8 bytes is max for low speed usb
+#define XFER_BLK_DATA     6   //data bytes per block report
+#define XFER_EP_OUT       0x02 //EP OUT 0x02 = Endpoint Type 0x00 + Endpoint Number 2
+#define XFER_EP_IN        0x81 //EP IN 0x81 = Endpoint Type 0x80 + Endpoint Number 1
+#define XFER_EP_IN3       0x82 //EP IN 0x82 = Endpoint Type 0x80 + Endpoint Number 2, streaming reports only
+#define XFER_IN_CNT       2    //IN transfers kept submitted
+#define XFER_MAX_RETRY    8    //times a request is sent again before we give up
+#define XFER_MAX_DEPTH    64   //max OUT requests in flight
+#define XFER_RQ_EE_READ   0x01 //vendor control request, read EEPROM block, see usbFunctionSetup() in usb.c
+#define XFER_RQ_EE_WRITE  0x02 //vendor control request, write EEPROM block
+#define XFER_CTL_MAX      256  //largest control transfer block
+
+//one 8 byte report
+struct xfer_rpt
+{
+	U8 d[XFER_RPT_LEN];
+};
+
+//device response queue, see 'Q' in usb.c
+struct xfer_qstats
+{
+	int size; //entries
+	int used; //entries waiting to be sent
+	int held; //a command is waiting for a free entry
+	int full; //times a command found the queue full
+	int lost; //commands dropped because one was already held
+};
+
+//device flow control, see 'N' in usb.c
+struct xfer_flowstats
+{
+	int ee_size;   //EEPROM write queue entries
+	int ee_peak;   //most EEPROM writes ever queued
+	int rsp_peak;  //most responses ever queued
+	int stalls;    //times the device NAKed requests because a queue was full
+	int stall_ms;  //time spent NAKing
+};
+
+//'G' subscription, or one 'E' pin change report
+struct xfer_gpio
+{
+	U8 mask_a;      //subscribed pins, 'G' only
+	U8 mask_b;
+	U8 pins_a;      //pin state
+	U8 pins_b;
+	U8 chg_a;       //pins that changed since the last report, 'E' only
+	U8 chg_b;
+	U16 ticks;      //device time of the first change, 'E' only
+	int changes;    //changes merged into this report, 'E' only
+	int ticks_ms;   //device ticks per ms, 'G' only
+};
+
+//'O' response, the counts are since the previous 'O'
+struct xfer_osc
+{
+	int cal;        //CLKCTRL_OSC20MCALIBA in use
+	int factory;    //value before the first calibration
+	int from;       //first value tried by the last calibration, 0 = factory, 1 = kept in USERROW, 2 = last USB reset
+	int steps;      //frame measurements by the last calibration, 1 = the first value was confirmed
+	int total;      //frame measurements by every calibration
+	double ms;      //time spent calibrating, interrupts are off meanwhile
+};
+
+//'H' responses, the device follows its oscillator against the USB frames and steps CAL20M when it drifts
+struct xfer_drift
+{
+	int cal;                //CLKCTRL_OSC20MCALIBA in use
+	int nudges;             //CAL20M steps made since power up
+	int cycles;             //CPU cycles per frame
+	double err;             //filtered frame length error, CPU cycles, positive when the clock is fast
+	std::vector<int> hist;  //error about once a second, CPU cycles, oldest first
+};
+
+//'Z' response, one task of the firmware scheduler (sched.c)
+struct xfer_task
+{
+	int over;       //runs longer than the budget
+	int skip;       //runs dropped, the task fell a whole period behind
+	int worst;      //longest run, CPU cycles
+	int budget;     //declared worst case, CPU cycles, 0 = no such task
+};
+
+//'L' responses, the time between usbPoll() calls on the device, in TCA0 ticks
+struct xfer_polls
+{
+	int worst;              //longest gap, ticks
+	int site;               //what ran longest during it, USB_SITE_xxx in usb.h, 0x80 and up is a scheduler task
+	int alarms;             //gaps past the threshold, saturates at 255
+	int ticks_ms;           //TCA0 ticks per ms
+	int alarm_ms;           //threshold, 0 = firmware built without USB_POLL_STATS
+	std::vector<U32> hist;  //XFER_POLLS_BINS counts, saturate at 0xFFFFFF
+};
+
+//CRC16 the firmware computes with usbCrc16 (poly 0xA001, init 0xFFFF, inverted)
+//pass the previous result as crc to continue over more data, 0 is the CRC of no data
+inline U16 crc16_usb(const U8* data, int len, U16 crc = 0)
+{
+	crc = ~crc;
+	for(int i=0; i<len; i++)
+	{
+		crc ^= data[i];
+		for(int b=0; b<8; b++){ crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1); }
+	}
+	return ~crc;
+}
+
+//progress callback, done and total are in bytes
+typedef void (*xfer_progress_fn)(int done, int total);
+
+class xfer_engine;
+
+//transport under the engine, moves 8 byte reports to and from the device
+class xfer_link
+{
+public:
+	virtual ~xfer_link(){}
+
+	//start moving reports, received IN reports and errors are passed to eng
+	virtual bool start(xfer_engine* eng) = 0;
+
+	//stop moving reports, anything still queued is dropped
+	virtual void stop() = 0;
+
+	//queue one OUT report, blocks while the link is full
+	virtual bool send(const xfer_rpt& rpt) = 0;
+
+	//wait until every queued OUT report has left the host
+	virtual bool flush() = 0;
+};
+
+//a connected device, the transport it sits on is hidden behind this
+class xfer_dev
+{
+public:
+	virtual ~xfer_dev(){}
+
+	//name to tell devices apart in output, such as the bus-port path
+	virtual const char* name() = 0;
+
+	//new link for an engine, the engine takes ownership
+	virtual xfer_link* new_link(int depth) = 0;
+
+	//blocking one byte read and verified write, the slow path the engine is measured against
+	virtual bool read_byte(U8* ret_byte, U8 adr) = 0;
+	virtual bool write_byte(U8* data_byte, U8 adr) = 0;
+
+	//EEPROM block over a vendor control transfer, -1 or false when the transport has none
+	virtual int ctl_read(U8* buf, int adr, int len){ return -1; }
+	virtual bool ctl_write(const U8* buf, int adr, int len){ return false; }
+};
+
+class xfer_engine
+{
+public:
+	//libusb device, the engine owns the link
+	xfer_engine(libusb_context* ctx, libusb_device_handle* devh, int depth)
+	: m_link(0), m_own_link(true), m_depth(depth), m_err(0), m_retries(0), m_progress(0)
+	{
+		init_depth();
+		m_link = new_usb_link(ctx,devh,m_depth);
+	}
+
+	//any other link, such as a simulated device, the caller owns the link unless own is set
+	xfer_engine(xfer_link* link, int depth, bool own = false)
+	: m_link(link), m_own_link(own), m_depth(depth), m_err(0), m_retries(0), m_progress(0)
+	{
+		init_depth();
+	}
+
+	~xfer_engine()
+	{
+		stop();
+		if(m_own_link){ delete m_link; }
+	}
+
+	//start the link
+	bool start()
+	{
+		m_err = 0;
+		m_rx.clear();
+		return m_link->start(this);
+	}
+
+	//stop the link, drop anything received
+	void stop()
+	{
+		m_link->stop();
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_rx.clear();
+	}
+
+	//called by the link with each received IN report
+	void link_rx(const xfer_rpt& rpt)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_rx.push_back(rpt);
+		m_cv.notify_all();
+	}
+
+	//called by the link when a transfer fails, the engine stops working
+	void link_err(int err)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		if(!m_err){ m_err = err; }
+		m_cv.notify_all();
+	}
+
+	int depth(){ return m_depth; }
+
+	//show progress while reading or writing
+	void set_progress(xfer_progress_fn fn){ m_progress = fn; }
+
+	//number of requests that were sent again because no response came back
+	int retries(){ return m_retries; }
+
+	//read len bytes starting at adr, one 'R' request per byte, up to depth requests in flight
+	bool read(U8* buf, int adr, int len)
+	{
+		//request state per byte
+		enum { ST_PENDING, ST_INFLIGHT, ST_DONE };
+		std::vector<U8>     state(len,ST_PENDING);
+		std::vector<U8>     tries(len,0);
+		std::vector<double> sent(len,0);
+		int done = 0;
+		int next = 0; //lowest pending index, requests are sent in address order
+
+		while(done < len)
+		{
+			if(m_err){ return false; }
+
+			//fill the pipeline
+			double now = time_ms();
+			int inflight = 0;
+			for(int i=0; i<len; i++)
+			{
+				if(state[i] != ST_INFLIGHT){ continue; }
+				if(now - sent[i] > m_timeout_ms){ state[i] = ST_PENDING; if(i < next){ next = i; } m_retries++; continue; }//response lost, send again
+				inflight++;
+			}
+			while(inflight < m_depth && next < len)
+			{
+				if(state[next] != ST_PENDING){ next++; continue; }
+				if(tries[next]++ >= XFER_MAX_RETRY){ ETRACE("NO RESPONSE FOR ADR=%d\n",adr+next); return false; }
+				xfer_rpt rpt = {{XFER_CMD_READ,(U8)(adr+next),0,0,0,0,0,0}};
+				if(!submit_out(rpt)){ return false; }
+				state[next] = ST_INFLIGHT;
+				sent[next] = time_ms();
+				inflight++;
+				next++;
+			}
+
+			//match responses by address echo
+			//wait for the first one only, then take what is there and refill the pipeline
+			xfer_rpt rsp;
+			int wait_ms = 20;
+			while(pop_in(rsp,wait_ms))
+			{
+				wait_ms = 0;
+				if(rsp.d[0] != XFER_CMD_READ){ continue; }//stale response
+				int i = (U8)(rsp.d[1] - adr);
+				if(i >= len || state[i] == ST_DONE){ continue; }//duplicate
+				buf[i] = rsp.d[2];
+				state[i] = ST_DONE;
+				done++;
+				if(m_progress){ m_progress(done,len); }
+			}
+		}
+		return true;
+	}
+
+	//write len bytes starting at adr, packed 5 bytes per 'D' request, up to depth requests in flight
+	//the device does not respond to writes, a write is done once its OUT transfer completes
+	bool write(const U8* buf, int adr, int len)
+	{
+		std::vector<U8> adrs(len);
+		for(int i=0; i<len; i++){ adrs[i] = (U8)(adr+i); }
+		return write_pairs(adrs.data(),buf,len);
+	}
+
+	//write n scattered bytes, val[i] goes to adr[i], in order
+	//runs with address steps of 1 to 3 go 5 per 'D' request, anything else 3 per 'P' request
+	bool write_pairs(const U8* adr, const U8* val, int n)
+	{
+		for(int i=0; i<n; )
+		{
+			//how far does a delta run reach
+			int k = 1;
+			while(i+k < n && k < XFER_DELTA_CNT && (U8)(adr[i+k] - adr[i+k-1]) >= 1 && (U8)(adr[i+k] - adr[i+k-1]) <= XFER_DELTA_MAX){ k++; }
+			xfer_rpt rpt = {{0,0,0,0,0,0,0,0}};
+			if(k > XFER_PACK_PAIRS)
+			{
+				rpt.d[0] = XFER_CMD_DELTA;
+				rpt.d[1] = adr[i];
+				for(int j=0; j<k; j++)
+				{
+					if(j){ rpt.d[2] |= (U8)(adr[i+j] - adr[i+j-1]) << (2*(j-1)); }
+					rpt.d[3+j] = val[i+j];
+				}
+			}
+			else if(n - i == 1)
+			{
+				k = 1;
+				rpt.d[0] = XFER_CMD_WRITE;
+				rpt.d[1] = adr[i];
+				rpt.d[2] = val[i];
+			}
+			else
+			{
+				k = (n - i < XFER_PACK_PAIRS) ? n - i : XFER_PACK_PAIRS;
+				rpt.d[0] = XFER_CMD_PACKED;
+				rpt.d[1] = k;
+				for(int j=0; j<k; j++){ rpt.d[2+2*j] = adr[i+j]; rpt.d[3+2*j] = val[i+j]; }
+			}
+			if(!submit_out(rpt)){ return false; }//blocks while depth requests are in flight
+			i += k;
+			if(m_progress){ m_progress(i,n); }
+		}
+		return flush();
+	}
+
+	//read len bytes starting at adr with one 'B' request, any reports that
+	//went missing are filled in with 'R' requests
+	bool read_block(U8* buf, int adr, int len)
+	{
+		std::vector<U8> have(len,0);
+		int done = 0;
+
+		//throw away stale responses from an earlier session
+		xfer_rpt rsp;
+		while(pop_in(rsp,0)){}
+
+		xfer_rpt rpt = {{XFER_CMD_BLOCK,(U8)adr,(U8)len,0,0,0,0,0}};//len 256 is sent as 0
+		if(!submit_out(rpt)){ return false; }
+
+		//collect reports until all bytes arrived, or the stream stalls
+		double last = time_ms();
+		while(done < len && time_ms() - last < m_timeout_ms)
+		{
+			if(m_err){ return false; }
+			if(!pop_in(rsp,20)){ continue; }
+			if(rsp.d[0] != XFER_CMD_BLOCK){ continue; }//stale response
+			last = time_ms();
+			int i = (U8)(rsp.d[1] - adr);
+			for(int n=0; n<XFER_BLK_DATA && i+n < len; n++)
+			{
+				if(have[i+n]){ continue; }
+				buf[i+n] = rsp.d[2+n];
+				have[i+n] = 1;
+				done++;
+			}
+			if(m_progress){ m_progress(done,len); }
+		}
+
+		//fill holes one byte at a time
+		for(int i=0; i<len; i++)
+		{
+			if(have[i]){ continue; }
+			int n = 1;
+			while(i+n < len && !have[i+n]){ n++; }
+			m_retries += n;
+			if(!read(&buf[i],adr+i,n)){ return false; }
+			i += n;
+		}
+		return true;
+	}
+
+	//read len bytes of the data space starting at adr with 'M' requests
+	//reports carry the low address byte, they arrive in order, so a report is placed at the first
+	//offset past the last one that has the same low byte, holes are asked for again
+	bool read_mem(U8* buf, int adr, int len)
+	{
+		std::vector<U8> have(len,0);
+		int done = 0;
+		xfer_rpt rsp;
+		while(pop_in(rsp,0)){}//throw away stale responses
+		for(int pass=0; pass<XFER_MAX_RETRY && done < len; pass++)
+		{
+			//one request from the first hole to the last
+			int first = 0;
+			while(have[first]){ first++; }
+			int last = len - 1;
+			while(have[last]){ last--; }
+			if(pass){ m_retries += last + 1 - first; }
+			int a = adr + first;
+			int n = last + 1 - first;
+			xfer_rpt rpt = {{XFER_CMD_MEM,(U8)a,(U8)(a >> 8),(U8)n,(U8)(n >> 8),0,0,0}};
+			if(!submit_out(rpt)){ return false; }
+
+			//collect reports until the stream is done, or stalls
+			int pos = 0;//offset in the request of the next report we expect
+			double t_last = time_ms();
+			while(pos < n && time_ms() - t_last < m_timeout_ms)
+			{
+				if(m_err){ return false; }
+				if(!pop_in(rsp,20)){ continue; }
+				if(rsp.d[0] != XFER_CMD_MEM){ continue; }//stale response
+				t_last = time_ms();
+				int i = pos + (U8)(rsp.d[1] - (U8)(a + pos));
+				for(int k=0; k<XFER_BLK_DATA && i+k < n; k++)
+				{
+					if(have[first+i+k]){ continue; }
+					buf[first+i+k] = rsp.d[2+k];
+					have[first+i+k] = 1;
+					done++;
+				}
+				pos = i + XFER_BLK_DATA;
+				if(m_progress){ m_progress(done,len); }
+			}
+		}
+		if(done < len){ ETRACE("USB RCV MEMORY READ ERROR\n"); return false; }
+		return true;
+	}
+
+	//send one request and wait for its response, the first echo_len bytes of
+	//the response must match the request, the request is sent again on timeout
+	bool command(const xfer_rpt& rq, xfer_rpt& rsp, int echo_len, int max_tries = XFER_MAX_RETRY)
+	{
+		for(int tries=0; tries<max_tries; tries++)
+		{
+			if(tries){ m_retries++; }
+			if(!submit_out(rq)){ return false; }
+			double t0 = time_ms();
+			while(time_ms() - t0 < m_timeout_ms)
+			{
+				if(m_err){ return false; }
+				if(!pop_in(rsp,20)){ continue; }
+				if(memcmp(rsp.d,rq.d,echo_len) == 0){ return true; }//anything else is a stale response
+			}
+		}
+		ETRACE("NO RESPONSE FOR CMD=%c\n",rq.d[0]);
+		return false;
+	}
+
+	//poll the device status until it reports ready, replaces a fixed sleep before the first transfer
+	//stale responses from an earlier session are thrown away, nonce changes on every USB reset
+	bool wait_ready(U16* ret_nonce, int timeout_ms = 2000)
+	{
+		xfer_rpt rsp;
+		while(pop_in(rsp,0)){}
+		double t0 = time_ms();
+		while(time_ms() - t0 < timeout_ms)
+		{
+			xfer_rpt rq = {{XFER_CMD_STATUS,0,0,0,0,0,0,0}};
+			if(!submit_out(rq)){ return false; }
+			double t1 = time_ms();
+			while(time_ms() - t1 < 50)
+			{
+				if(m_err){ return false; }
+				if(!pop_in(rsp,10) || rsp.d[0] != XFER_CMD_STATUS){ continue; }
+				if((rsp.d[1] & XFER_ST_READY) != XFER_ST_READY){ break; }//not ready yet, ask again
+				if(ret_nonce){ *ret_nonce = rsp.d[2] | (rsp.d[3] << 8); }
+				if(rsp.d[1] & XFER_ST_OSC_OFF){ ETRACE("DEVICE OSCILLATOR IS OFF, CAL20M %d, EXPECT RETRIES\n",rsp.d[4]); }
+				if(rsp.d[1] & XFER_ST_POLL_LATE){ ETRACE("DEVICE MISSED ITS usbPoll() DEADLINE, SEE -polls\n"); }
+				return true;
+			}
+		}
+		ETRACE("DEVICE NOT READY\n");
+		return false;
+	}
+
+	//device response queue stats, firmware without a queue does not answer
+	bool queue_stats(xfer_qstats* q, int max_tries = XFER_MAX_RETRY)
+	{
+		xfer_rpt rq = {{XFER_CMD_QUEUE,0,0,0,0,0,0,0}};
+		xfer_rpt rsp;
+		if(!command(rq,rsp,1,max_tries)){ return false; }
+		q->size = rsp.d[1];
+		q->used = rsp.d[2];
+		q->held = rsp.d[3];
+		q->full = rsp.d[4] | (rsp.d[5] << 8);
+		q->lost = rsp.d[6] | (rsp.d[7] << 8);
+		return true;
+	}
+
+	bool flow_stats(xfer_flowstats* f, int max_tries = XFER_MAX_RETRY)
+	{
+		xfer_rpt rq = {{XFER_CMD_FLOW,0,0,0,0,0,0,0}};
+		xfer_rpt rsp;
+		if(!command(rq,rsp,1,max_tries)){ return false; }
+		f->ee_size = rsp.d[1];
+		f->ee_peak = rsp.d[2];
+		f->rsp_peak = rsp.d[3];
+		f->stalls = rsp.d[4] | (rsp.d[5] << 8);
+		f->stall_ms = rsp.d[6] | (rsp.d[7] << 8);
+		return true;
+	}
+
+	//ask the app to reset into the bootloader, returns the BOOTEND fuse, 0 if there is no bootloader
+	bool jump_boot(U8* bootend, int max_tries = XFER_MAX_RETRY)
+	{
+		xfer_rpt rq = {{XFER_CMD_BOOT,'B','O','O','T',0,0,0}};
+		xfer_rpt rsp;
+		if(!command(rq,rsp,1,max_tries)){ return false; }
+		*bootend = rsp.d[1];
+		return true;
+	}
+
+	//oscillator calibration stats, op is XFER_OSC_xxx, the device leaves the bus after the response for the reconnect ops
+	bool osc(U8 op, xfer_osc* o, int max_tries = XFER_MAX_RETRY)
+	{
+		xfer_rpt rq = {{XFER_CMD_OSC,op,0,0,0,0,0,0}};
+		xfer_rpt rsp;
+		if(!command(rq,rsp,1,max_tries)){ return false; }
+		o->cal = rsp.d[1]; o->factory = rsp.d[2]; o->from = rsp.d[3]; o->steps = rsp.d[4]; o->total = rsp.d[5];
+		o->ms = (rsp.d[6] | (rsp.d[7] << 8)) / 10.0;
+		return true;
+	}
+
+	//oscillator drift tracker state and its history, responses echo the block number, a late one for another block is skipped
+	bool drift(xfer_drift* d, int max_tries = XFER_MAX_RETRY)
+	{
+		xfer_rpt rq = {{XFER_CMD_DRIFT,0,0,0,0,0,0,0}};
+		xfer_rpt rsp;
+		if(!command(rq,rsp,2,max_tries)){ return false; }
+		d->cal = rsp.d[2]; d->nudges = rsp.d[3];
+		d->err = (I16)(rsp.d[4] | (rsp.d[5] << 8)) / 16.0;
+		d->cycles = rsp.d[6] * 100;
+		d->hist.clear();
+		int cnt = rsp.d[7];
+		for(int n=1; (n-1)*XFER_DRIFT_BLK < cnt; n++)
+		{
+			xfer_rpt hq = {{XFER_CMD_DRIFT,(U8)n,0,0,0,0,0,0}};
+			if(!command(hq,rsp,2,max_tries)){ return false; }
+			for(int i=0; i<XFER_DRIFT_BLK && (int)d->hist.size() < cnt; i++){ d->hist.push_back((I8)rsp.d[2+i]); }
+		}
+		return true;
+	}
+
+	//scheduler stats of task i, t->budget is 0 past the end of the task table, the response echoes i
+	bool task_stats(int i, xfer_task* t, int max_tries = XFER_MAX_RETRY)
+	{
+		xfer_rpt rq = {{XFER_CMD_TASK,(U8)i,0,0,0,0,0,0}};
+		xfer_rpt rsp;
+		if(!command(rq,rsp,2,max_tries)){ return false; }
+		t->over = rsp.d[2]; t->skip = rsp.d[3];
+		t->worst = rsp.d[4] | (rsp.d[5] << 8);
+		t->budget = rsp.d[6] | (rsp.d[7] << 8);
+		return true;
+	}
+
+	//usbPoll() gap histogram, op (XFER_POLLS_xxx) clears it and with XFER_POLLS_ALARM sets the threshold to alarm_ms
+	//each response is taken before the clear it carries, nothing recorded between a read and its clear is lost
+	bool polls(xfer_polls* p, U8 op = XFER_POLLS_READ, int alarm_ms = 0, int max_tries = XFER_MAX_RETRY)
+	{
+		xfer_rpt rq = {{XFER_CMD_POLLS,0,op,(U8)alarm_ms,0,0,0,0}};
+		xfer_rpt rsp;
+		if(!command(rq,rsp,2,max_tries)){ return false; }
+		p->worst = rsp.d[2] | (rsp.d[3] << 8);
+		p->site = rsp.d[4]; p->alarms = rsp.d[5];
+		p->ticks_ms = rsp.d[6]; p->alarm_ms = rsp.d[7];
+		p->hist.clear();
+		for(int n=1; p->alarm_ms && (n-1)*XFER_POLLS_BLK < XFER_POLLS_BINS; n++)
+		{
+			xfer_rpt hq = {{XFER_CMD_POLLS,(U8)n,op,0,0,0,0,0}};
+			if(!command(hq,rsp,2,max_tries)){ return false; }
+			for(int i=0; i<XFER_POLLS_BLK; i++){ p->hist.push_back(rsp.d[2+i*3] | (rsp.d[3+i*3] << 8) | (rsp.d[4+i*3] << 16)); }
+		}
+		return true;
+	}
+
+	//watch pins for changes, the device sends an 'E' report when one changes, 0 and 0 stops
+	//the USB pins are removed from mask_a, g gets the masks the device took and the pin state
+	bool gpio_subscribe(U8 mask_a, U8 mask_b, xfer_gpio* g, int max_tries = XFER_MAX_RETRY)
+	{
+		xfer_rpt rq = {{XFER_CMD_GPIO,mask_a,mask_b,0,0,0,0,0}};
+		xfer_rpt rsp;
+		if(!command(rq,rsp,1,max_tries)){ return false; }
+		memset(g,0,sizeof(*g));
+		g->mask_a = rsp.d[1]; g->mask_b = rsp.d[2];
+		g->pins_a = rsp.d[3]; g->pins_b = rsp.d[4];
+		g->ticks_ms = rsp.d[5];
+		return true;
+	}
+
+	//wait for the next 'E' report, anything else received meanwhile is dropped
+	bool gpio_event(xfer_gpio* g, int timeout_ms)
+	{
+		double t0 = time_ms();
+		xfer_rpt rpt;
+		for(;;)
+		{
+			int left = timeout_ms - (int)(time_ms() - t0);
+			if(left <= 0 || m_err){ return false; }
+			if(!pop_in(rpt,left) || rpt.d[0] != XFER_GPIO_EVENT){ continue; }
+			memset(g,0,sizeof(*g));
+			g->pins_a = rpt.d[1]; g->pins_b = rpt.d[2];
+			g->chg_a = rpt.d[3]; g->chg_b = rpt.d[4];
+			g->ticks = rpt.d[5] | (rpt.d[6] << 8);
+			g->changes = rpt.d[7];
+			return true;
+		}
+	}
+
+	//keep no more requests in flight than the device can queue responses for
+	void limit_depth(int depth)
+	{
+		if(depth < 1 || depth >= m_depth){ return; }
+		m_depth = depth;
+		init_depth();
+	}
+
+	//CRC16 of len bytes starting at adr, computed by the device
+	bool crc(U16* ret_crc, int adr, int len)
+	{
+		xfer_rpt rq = {{XFER_CMD_CRC,(U8)adr,(U8)len,0,0,0,0,0}};//len 256 is sent as 0
+		xfer_rpt rsp;
+		if(!command(rq,rsp,3)){ return false; }
+		*ret_crc = rsp.d[3] | (rsp.d[4] << 8);
+		return true;
+	}
+
+	//write len bytes starting at adr as page frames, one start and up to 4 continuation reports per page
+	//the device answers each frame with the CRC of what it received, frames that do not match or
+	//get no answer are sent again, up to XFER_MAX_RETRY passes
+	bool write_frames(const U8* buf, int adr, int len)
+	{
+		//split at page boundaries, so every frame is one page write on the device
+		std::vector<int> todo;
+		for(int i=0; i<len; )
+		{
+			todo.push_back(i);
+			i += XFER_FRM_MAX - ((adr + i) % XFER_FRM_MAX);
+		}
+		xfer_rpt rsp;
+		while(pop_in(rsp,0)){}//throw away stale responses
+		for(int pass=0; pass<XFER_MAX_RETRY && todo.size(); pass++)
+		{
+			if(pass){ m_retries += todo.size(); }
+			for(size_t f=0; f<todo.size(); f++)
+			{
+				int i = todo[f];
+				int n = frame_len(adr,i,len);
+				xfer_rpt rpt = {{XFER_CMD_FRAME,(U8)(adr+i),(U8)n,0,0,0,0,0}};
+				int k = 0;
+				for(; k<n && k<XFER_FRM_FIRST; k++){ rpt.d[3+k] = buf[i+k]; }
+				if(!submit_out(rpt)){ return false; }
+				while(k < n)
+				{
+					xfer_rpt next = {{XFER_CMD_FRAME_NEXT,0,0,0,0,0,0,0}};
+					for(int j=0; j<XFER_FRM_NEXT && k<n; j++, k++){ next.d[1+j] = buf[i+k]; }
+					if(!submit_out(next)){ return false; }
+				}
+			}
+			if(!flush()){ return false; }
+
+			//collect the answers, a frame is done when its CRC matches
+			std::vector<int> left = todo;
+			double t0 = time_ms();
+			while(left.size() && time_ms() - t0 < m_timeout_ms)
+			{
+				if(m_err){ return false; }
+				if(!pop_in(rsp,20) || rsp.d[0] != XFER_CMD_FRAME){ continue; }
+				for(size_t f=0; f<left.size(); f++)
+				{
+					int i = left[f];
+					int n = frame_len(adr,i,len);
+					if(rsp.d[1] != (U8)(adr+i) || rsp.d[2] != n){ continue; }
+					U16 crc_dev = rsp.d[3] | (rsp.d[4] << 8);
+					if(crc_dev == crc16_usb(&buf[i],n)){ left.erase(left.begin()+f); }
+					else{ ETRACE("FRAME CRC MISMATCH ADR=%d LEN=%d\n",adr+i,n); }
+					break;
+				}
+			}
+			todo = left;
+			if(m_progress)
+			{
+				int done = len;
+				for(size_t f=0; f<todo.size(); f++){ done -= frame_len(adr,todo[f],len); }
+				m_progress(done,len);
+			}
+		}
+		if(todo.size()){ ETRACE("USB XMT FRAME ERROR\n"); return false; }
+		return true;
+	}
+
+	//CRC16 of len bytes at adr of a memory space, computed on the device in chunks between usbPoll() calls
+	bool range_crc(U16* ret_crc, int space, int adr, int len)
+	{
+		xfer_rpt rq = {{XFER_CMD_RANGE_CRC,(U8)adr,(U8)(adr >> 8),(U8)len,(U8)(len >> 8),(U8)space,0,0}};
+		xfer_rpt rsp;
+		if(!command(rq,rsp,5)){ return false; }
+		if(rsp.d[7] != space){ ETRACE("DEVICE HAS NO MEMORY SPACE %d\n",space); return false; }
+		*ret_crc = rsp.d[5] | (rsp.d[6] << 8);
+		return true;
+	}
+
+	//write len bytes starting at adr, then verify the whole range with one device CRC
+	//chunks that do not match are written again, up to XFER_MAX_RETRY passes
+	bool write_verify(const U8* buf, int adr, int len, int chunk = 32)
+	{
+		if(!write_frames(buf,adr,len)){ return false; }
+		for(int pass=0; pass<XFER_MAX_RETRY; pass++)
+		{
+			U16 crc_dev = 0;
+			if(!crc(&crc_dev,adr,len)){ return false; }
+			if(crc_dev == crc16_usb(buf,len)){ return true; }
+
+			//find and re-send the chunks that do not match
+			for(int i=0; i<len; i+=chunk)
+			{
+				int n = (len - i < chunk) ? len - i : chunk;
+				if(!crc(&crc_dev,adr+i,n)){ return false; }
+				if(crc_dev == crc16_usb(&buf[i],n)){ continue; }
+				ETRACE("CRC MISMATCH ADR=%d LEN=%d, writing again\n",adr+i,n);
+				m_retries += n;
+				if(!write(&buf[i],adr+i,n)){ return false; }
+			}
+		}
+		ETRACE("USB XMT VERIFY ERROR\n");
+		return false;
+	}
+
+	//wait until every OUT request has left the host
+	bool flush()
+	{
+		return m_link->flush() && m_err == 0;
+	}
+
+	//length of the frame that starts at offset i of a write of len bytes at adr
+	static int frame_len(int adr, int i, int len)
+	{
+		int n = XFER_FRM_MAX - ((adr + i) % XFER_FRM_MAX);
+		return (n < len - i) ? n : len - i;
+	}
+
+	//queue one OUT report, blocks while depth requests are in flight
+	bool submit_out(const xfer_rpt& rpt)
+	{
+		if(m_err){ return false; }
+		if(!m_link->send(rpt)){ link_err(LIBUSB_ERROR_IO); return false; }
+		return true;
+	}
+
+	//pop one received IN report, wait up to timeout_ms for it
+	bool pop_in(xfer_rpt& rpt, int timeout_ms)
+	{
+		std::unique_lock<std::mutex> lock(m_mtx);
+		if(!m_cv.wait_for(lock,std::chrono::milliseconds(timeout_ms),[this]{ return !m_rx.empty() || m_err; })){ return false; }
+		if(m_rx.empty()){ return false; }
+		rpt = m_rx.front();
+		m_rx.pop_front();
+		return true;
+	}
+
+private:
+	xfer_link* m_link;
+	bool m_own_link;
+	int m_depth;
+	int m_timeout_ms;
+	std::mutex m_mtx;              //protects everything below
+	std::condition_variable m_cv;  //signaled when a report arrives or the link fails
+	int m_err;                     //first transfer error, the engine stops working once set
+	int m_retries;
+	xfer_progress_fn m_progress;
+	std::deque<xfer_rpt> m_rx;     //received IN reports
+
+	void init_depth()
+	{
+		if(m_depth < 1){ m_depth = 1; }
+		if(m_depth > XFER_MAX_DEPTH){ m_depth = XFER_MAX_DEPTH; }
+		//a request waits for every request queued in front of it, give the device 2 poll intervals per request
+		m_timeout_ms = 100 + m_depth * 20;
+	}
+
+	static xfer_link* new_usb_link(libusb_context* ctx, libusb_device_handle* devh, int depth);
+};
+
+//libusb link, a pool of OUT transfers and IN transfers that are always submitted
+class xfer_usb_link : public xfer_link
+{
+public:
+	xfer_usb_link(libusb_context* ctx, libusb_device_handle* devh, int depth)
+	: m_ctx(ctx), m_devh(devh), m_depth(depth), m_eng(0), m_run(false), m_err(0), m_out_busy(0), m_in_busy(0)
+	{}
+
+	~xfer_usb_link(){ stop(); }
+
+	//allocate transfers, submit IN transfers and start event thread
+	bool start(xfer_engine* eng)
+	{
+		if(m_run){ return true; }
+		m_eng = eng;
+		m_err = 0;
+		m_out_free.clear();
+		for(int i=0; i<m_depth; i++)
+		{
+			libusb_transfer* t = libusb_alloc_transfer(0);
+			if(!t){ stop(); return false; }
+			m_out_pool.push_back(t);
+			m_out_free.push_back(t);
+		}
+		for(int i=0; i<XFER_IN_CNT; i++)
+		{
+			libusb_transfer* t = libusb_alloc_transfer(0);
+			if(!t){ stop(); return false; }
+			m_in_pool.push_back(t);
+		}
+
+		//event thread must run before anything is submitted, callbacks are called from it
+		m_run = true;
+		m_thread = std::thread(&xfer_usb_link::event_thread,this);
+
+		for(size_t i=0; i<m_in_pool.size(); i++)
+		{
+			libusb_transfer* t = m_in_pool[i];
+			libusb_fill_interrupt_transfer(t,m_devh,XFER_EP_IN,m_in_buf[i].d,XFER_RPT_LEN,in_cb,this,0);//no timeout, cancelled in stop()
+			std::lock_guard<std::mutex> lock(m_mtx);
+			int r = libusb_submit_transfer(t);
+			if(r != 0){ ETRACE("USB IN SUBMIT ERROR %s\n",libusb_error_name(r)); m_err = r; break; }
+			m_in_busy++;
+		}
+		if(m_err){ stop(); return false; }
+		return true;
+	}
+
+	//cancel transfers, wait for their callbacks, free them and stop event thread
+	void stop()
+	{
+		if(m_thread.joinable())
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mtx);
+				for(size_t i=0; i<m_in_pool.size(); i++){ libusb_cancel_transfer(m_in_pool[i]); }
+				for(size_t i=0; i<m_out_pool.size(); i++){ libusb_cancel_transfer(m_out_pool[i]); }
+				//callbacks still run on the event thread, wait until every transfer is back
+				m_cv.wait_for(lock,std::chrono::milliseconds(1000),[this]{ return m_in_busy == 0 && m_out_busy == 0; });
+			}
+			m_run = false;
+			m_thread.join();
+		}
+		m_run = false;
+		for(size_t i=0; i<m_in_pool.size(); i++){ libusb_free_transfer(m_in_pool[i]); }
+		for(size_t i=0; i<m_out_pool.size(); i++){ libusb_free_transfer(m_out_pool[i]); }
+		m_in_pool.clear();
+		m_out_pool.clear();
+		m_out_free.clear();
+		m_in_busy = 0;
+		m_out_busy = 0;
+	}
+
+	//submit one OUT transfer, blocks on the free pool
+	bool send(const xfer_rpt& rpt)
+	{
+		std::unique_lock<std::mutex> lock(m_mtx);
+		m_cv.wait(lock,[this]{ return !m_out_free.empty() || m_err; });
+		if(m_err){ return false; }
+		libusb_transfer* t = m_out_free.back();
+		m_out_free.pop_back();
+		int slot = 0;
+		while(m_out_pool[slot] != t){ slot++; }
+		memcpy(m_out_buf[slot].d,rpt.d,XFER_RPT_LEN);
+		libusb_fill_interrupt_transfer(t,m_devh,XFER_EP_OUT,m_out_buf[slot].d,XFER_RPT_LEN,out_cb,this,250);//timeout in 250ms
+		int r = libusb_submit_transfer(t);
+		if(r != 0){ ETRACE("USB XMT SUBMIT ERROR %s\n",libusb_error_name(r)); m_out_free.push_back(t); m_err = r; return false; }
+		m_out_busy++;
+		return true;
+	}
+
+	bool flush()
+	{
+		std::unique_lock<std::mutex> lock(m_mtx);
+		m_cv.wait(lock,[this]{ return m_out_busy == 0 || m_err; });
+		return m_err == 0;
+	}
+
+private:
+	libusb_context* m_ctx;         //several links may share one context, each runs its own event thread
+	libusb_device_handle* m_devh;
+	int m_depth;
+	xfer_engine* m_eng;
+	std::atomic<bool> m_run;
+	std::thread m_thread;
+	std::mutex m_mtx;              //protects everything below, and the transfers
+	std::condition_variable m_cv;  //signaled when a transfer completes
+	int m_err;                     //first transfer error
+	int m_out_busy;                //OUT transfers submitted
+	int m_in_busy;                 //IN transfers submitted
+	std::vector<libusb_transfer*> m_out_pool;
+	std::vector<libusb_transfer*> m_out_free;
+	std::vector<libusb_transfer*> m_in_pool;
+	xfer_rpt m_out_buf[XFER_MAX_DEPTH];
+	xfer_rpt m_in_buf[XFER_IN_CNT];
+
+	//runs libusb callbacks until stop()
+	void event_thread()
+	{
+		while(m_run)
+		{
+			timeval tv = {0,100000};//100ms, so we notice m_run being cleared
+			libusb_handle_events_timeout_completed(m_ctx,&tv,NULL);
+		}
+	}
+
+	//caller holds m_mtx, the engine lock is always taken after the link lock
+	void fail(int err)
+	{
+		if(m_err){ return; }
+		m_err = err;
+		m_eng->link_err(err);
+	}
+
+	static void LIBUSB_CALL out_cb(libusb_transfer* t)
+	{
+		xfer_usb_link* l = (xfer_usb_link*)t->user_data;
+		std::lock_guard<std::mutex> lock(l->m_mtx);
+		l->m_out_busy--;
+		l->m_out_free.push_back(t);
+		if(t->status != LIBUSB_TRANSFER_COMPLETED && t->status != LIBUSB_TRANSFER_CANCELLED && !l->m_err)
+		{ ETRACE("USB XMT ERROR %d\n",t->status); l->fail(LIBUSB_ERROR_IO); }
+		l->m_cv.notify_all();
+	}
+
+	static void LIBUSB_CALL in_cb(libusb_transfer* t)
+	{
+		xfer_usb_link* l = (xfer_usb_link*)t->user_data;
+		std::lock_guard<std::mutex> lock(l->m_mtx);
+		if(t->status == LIBUSB_TRANSFER_COMPLETED && t->actual_length == XFER_RPT_LEN)
+		{
+			xfer_rpt rpt;
+			memcpy(rpt.d,t->buffer,XFER_RPT_LEN);
+			l->m_eng->link_rx(rpt);
+		}
+		else if(t->status != LIBUSB_TRANSFER_CANCELLED && t->status != LIBUSB_TRANSFER_TIMED_OUT && !l->m_err)
+		{ ETRACE("RCV USB ERROR %d\n",t->status); l->fail(LIBUSB_ERROR_IO); }
+
+		//keep IN transfer on the wire until stop()
+		if(t->status != LIBUSB_TRANSFER_CANCELLED && !l->m_err && libusb_submit_transfer(t) == 0)
+		{ return; }
+		l->m_in_busy--;
+		l->m_cv.notify_all();
+	}
+};
+
+inline xfer_link* xfer_engine::new_usb_link(libusb_context* ctx, libusb_device_handle* devh, int depth)
+{ return new xfer_usb_link(ctx,devh,depth); }
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef __usb_osc_h_included__
+#define __usb_osc_h_included__
+
+//internal oscillator trim against the USB frame length, shared by the app (usb.c) and the bootloader (boot/boot.c)
+//call with interrupts disabled, usbMeasureFrameLength() counts CPU cycles
+//
+//each measurement takes a USB frame (1ms) with interrupts off, so the search is kept short...
+//  - the value found on the last USB reset is tried first, the host resets the device several times while enumerating
+//  - after a power up the value kept in USERROW is tried first, the app stores it (usbPollOscSave in usb.c)
+//  - one measurement confirms either, otherwise a secant search within a shrinking bracket runs from there
+//  - with nothing known it starts at the factory value
+
+#include "usbdrv.h"
+#include "defines.h"
+#include <avr/io.h>
+
+#define USB_OSC_TARGET   ((I16)(1499 * (double)F_CPU / 10.5e6 + 0.5)) //usbMeasureFrameLength() at F_CPU, 2356 for 16.5MHz, 1827 for 12.8MHz, 2855 for 20MHz
+#if F_CPU == 20000000
+#define USB_OSC_BOUND_DIV 400 //0.25%, the 20MHz receiver (usbdrvasm20.inc) does not resync inside a packet, a quarter bit over the longest one
+#else
+#define USB_OSC_BOUND_DIV 100 //1%, what the 12.8MHz and 16.5MHz receivers tolerate
+#endif
+#define USB_OSC_BOUND    (USB_OSC_TARGET / USB_OSC_BOUND_DIV) //further off than this the receiver loses bits
+#define USB_OSC_TOL      (USB_OSC_BOUND < USB_OSC_TARGET / 200 ? USB_OSC_BOUND : USB_OSC_TARGET / 200) //0.5% (about half a CAL20M step) or the bound, a known value this close is kept
+#define USB_OSC_CAL_MAX  0x3F //CAL20M is 6 bits
+#define USB_OSC_MAX_TRY  10   //measurements before the best one so far is taken, about 4 from the factory value
+#define USB_OSC_UROW     (USER_SIGNATURES_START + USER_SIGNATURES_SIZE - 4) //last 4 USERROW bytes... cal, ~cal, target lo, target hi
+#define USB_OSC_FACTORY  0    //where the first value tried came from
+#define USB_OSC_CACHE    1
+#define USB_OSC_RAM      2
+
+typedef struct
+{
+	U8 init;    //factory value read
+	U8 factory; //CLKCTRL_OSC20MCALIBA before the first calibration, the factory value (in the app, the bootloader's value when it ran first)
+	U8 good;    //cal is known good, tried first on the next USB reset
+	U8 cal;     //value in use
+	U8 from;    //USB_OSC_xxx, where the first value tried came from
+	U8 steps;   //measurements made by the last calibration
+	I16 err;    //distance from USB_OSC_TARGET the last calibration ended at, negative when slow
+} usb_osc_t;
+static usb_osc_t g_Osc; //each image (app, bootloader) has its own
+
+//calibration value kept in USERROW, -1 if none (or kept for another F_CPU)
+static inline I16 usb_osc_cached()
+{
+	volatile U8* p = (volatile U8*)USB_OSC_UROW;
+	if(p[0] != (U8)~p[1] || p[0] > USB_OSC_CAL_MAX || p[2] != (USB_OSC_TARGET & 0xFF) || p[3] != (USB_OSC_TARGET >> 8)){ return -1; }
+	return p[0];
+}
+
+//set cal and measure, result is the distance from the target, negative when the clock is slow
+static inline I16 usb_osc_try(U8 cal)
+{
+	_PROTECTED_WRITE(CLKCTRL_OSC20MCALIBA,cal);
+	g_Osc.steps++;
+	return usbMeasureFrameLength() - USB_OSC_TARGET;
+}
+
+static inline I16 usb_osc_abs(I16 v){ return v < 0 ? -v : v; }
+
+//calibrate internal oscillator to 16.5MHz, 12.8MHz or 20MHz
+// https://www.silabs.com/community/interface/knowledge-base.entry.html/2004/03/15/usb_clock_tolerance-gVai
+// http://vusb.wikidot.com/examples
+static inline void usb_calibrate_osc()
+{
+	if(!g_Osc.init){ g_Osc.init = 1; g_Osc.factory = CLKCTRL_OSC20MCALIBA; }
+	g_Osc.steps = 0;
+
+	//first guess
+	U8 x = g_Osc.factory;
+	g_Osc.from = USB_OSC_FACTORY;
+	I16 c = usb_osc_cached();
+	if(g_Osc.good){ x = g_Osc.cal; g_Osc.from = USB_OSC_RAM; }
+	else if(c >= 0){ x = c; g_Osc.from = USB_OSC_CACHE; }
+	I16 f = usb_osc_try(x);
+	if(g_Osc.from != USB_OSC_FACTORY && usb_osc_abs(f) <= USB_OSC_TOL){ g_Osc.cal = x; g_Osc.err = f; g_Osc.good = 1; return; } //confirmed
+
+	//the frame length rises with cal, keep a bracket lo..hi around the target, lo is slow and hi is fast
+	//the next guess is the secant through the last two measurements, halfway when that is outside the bracket
+	U8  lo = 0, hi = USB_OSC_CAL_MAX;
+	U8  best = x;
+	I16 best_f = f;
+	U8  px = x;
+	I16 pf = f;
+	U8  have_p = 0;
+	while(f && g_Osc.steps < USB_OSC_MAX_TRY)
+	{
+		if(f < 0){ lo = x; } else { hi = x; }
+		if(hi - lo <= 1){ break; } //best is one of the two
+		I16 nx = x;
+		if(have_p && f != pf){ nx = x - (I32)f * ((I16)x - px) / (f - pf); }
+		if(nx == x){ nx = f < 0 ? x + 1 : x - 1; } //neighbour, gives the first slope
+		if(nx <= lo || nx >= hi){ nx = (lo + hi) / 2; }
+		px = x; pf = f; have_p = 1;
+		x = nx;
+		f = usb_osc_try(x);
+		if(usb_osc_abs(f) < usb_osc_abs(best_f)){ best_f = f; best = x; }
+	}
+	_PROTECTED_WRITE(CLKCTRL_OSC20MCALIBA,best);
+	g_Osc.cal = best;
+	g_Osc.err = best_f;
+	g_Osc.good = usb_osc_abs(best_f) <= USB_OSC_BOUND; //not worth trying first next time
+}
+
+#endif
@@ -68,6 +68,18 @@ section at the end of this file).
  * Since F_CPU should be defined to your actual clock rate anyway, you should
  * not need to modify this setting.
  */
+#ifndef USB_EXT_CLK
+#define USB_EXT_CLK             0 //1 = clock on the EXTCLK pin, compile.sh sets it from CFG_EXT_CLK
+#endif
+#if !USB_EXT_CLK && (F_CPU == 12800000 || F_CPU == 16500000 || F_CPU == 20000000)
+#define USB_OSC_TRIM            1 //internal oscillator trimmed against the USB frames (usb_osc.h), 16MHz fuse for 12.8MHz and 16.5MHz, 20MHz fuse for 20MHz
+#else
+#define USB_OSC_TRIM            0 //external clock, nothing to trim
+#endif
+/* The 20 MHz receiver is written for a crystal, trimmed it has the most cycles
+ * to spare, but the trim must stay within USB_OSC_BOUND (usb_osc.h), the SOF
+ * drift tracker in usb.c keeps it there.
+ */
 #define USB_CFG_CHECK_CRC       0
 /* Define this to 1 if you want that the driver checks integrity of incoming
  * data packets (CRC checks). CRC checks cost quite a bit of code size and are
@@ -140,12 +152,12 @@ section at the end of this file).
  * The value is in milliamperes. [It will be divided by two since USB
  * communicates power requirements in units of 2 mA.]
  */
-#define USB_CFG_IMPLEMENT_FN_WRITE      0
+#define USB_CFG_IMPLEMENT_FN_WRITE      1                                             //changed to 1, default was 0
 /* Set this to 1 if you want usbFunctionWrite() to be called for control-out
  * transfers. Set it to 0 if you don't need it and want to save a couple of
  * bytes.
  */
-#define USB_CFG_IMPLEMENT_FN_READ       0
+#define USB_CFG_IMPLEMENT_FN_READ       1                                             //changed to 1, default was 0
 /* Set this to 1 if you need to send control replies which are generated
  * "on the fly" when usbFunctionRead() is called. If you only want to send
  * data from a static buffer, set it to 0 and return the data from
@@ -157,7 +169,7 @@ section at the end of this file).
  * interrupt/bulk data sent to any endpoint other than 0. The endpoint number
  * can be found in 'usbRxToken'.
  */
-#define USB_CFG_HAVE_FLOWCONTROL        0
+#define USB_CFG_HAVE_FLOWCONTROL        1                                             //changed to 1, default was 0 (NAK the host while our queues are full)
 /* Define this to 1 if you want flowcontrol over USB data. See the definition
  * of the macros usbDisableAllRequests() and usbEnableAllRequests() in
  * usbdrv.h.
@@ -167,7 +179,7 @@ section at the end of this file).
  * where the driver's constants (descriptors) are located. Or in other words:
  * Define this to 1 for boot loaders on the ATMega128.
  */
-#define USB_CFG_LONG_TRANSFERS          0
+#define USB_CFG_LONG_TRANSFERS          1                                             //changed to 1, default was 0 (256 byte EEPROM blocks)
 /* Define this to 1 if you want to send/receive blocks of more than 254 bytes
  * in a single control-in or control-out transfer. Note that the capability
  * for long transfers increases the driver size.
@@ -192,7 +204,7 @@ extern void usbHadReset(void);
 /* This macro (if defined) is executed when a USB SET_ADDRESS request was
  * received.
  */
-#define USB_COUNT_SOF                   0
+#define USB_COUNT_SOF                   1                                             //changed to 1, the oscillator drift tracker in usb.c uses it
 /* define this macro to 1 if you need the global variable "usbSofCount" which
  * counts SOF packets. This feature requires that the hardware interrupt is
  * connected to D- instead of D+.
@@ -216,6 +228,15 @@ extern void usbHadReset(void);
  * Please note that Start Of Frame detection works only if D- is wired to the
  * interrupt, not D+. THIS IS DIFFERENT THAN MOST EXAMPLES!
  */
+#ifdef __ASSEMBLER__
+.macro usbSofHook
+    lds     YL, TCB1_CNTL       ;TCB1 counts CPU cycles, low byte first, the read latches the high byte
+    sts     usbSofTicks, YL
+    lds     YL, TCB1_CNTH
+    sts     usbSofTicks+1, YL
+.endm
+#endif
+#define USB_SOF_HOOK                    usbSofHook                                    //store TCB1 at every SOF for the drift tracker (usbPollSof in usb.c)
 #define USB_CFG_CHECK_DATA_TOGGLING     0
 /* define this macro to 1 if you want to filter out duplicate data packets
  * sent by the host. Duplicates occur only as a consequence of communication
@@ -367,7 +388,7 @@ extern void usbHadReset(void);
  */
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
-#define USB_CFG_DESCR_PROPS_CONFIGURATION           USB_PROP_LENGTH( 41 ) //using custom usbDescriptorHidReport in usb_desc.h
+#define USB_CFG_DESCR_PROPS_CONFIGURATION           USB_PROP_LENGTH( 48 ) //using custom usbDescriptorConfiguration in usb.c, 2 IN and 1 OUT endpoint
 #define USB_CFG_DESCR_PROPS_STRINGS                 0
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
@@ -404,13 +425,14 @@ extern void usbHadReset(void);
 /* #define USB_INTR_VECTOR         INT0_vect */
 
 //This is for TinyAvr0 TinyAvr1 series ... If any SOF logic is used, ISR must be wired to D-, and triggered on falling edge
-#define USB_INTR_CFG 			0		             //pin change control register
-#define USB_INTR_CFG_SET 		0                    //bits to set   for setting up USB_INTR_CFG
+//USB_COUNT_SOF is used, so the ISR is on D- (PORTA PIN1), the old D+ setup was PORTA_PIN2CTRL, bit 1 (rising edge) and VPORT_INT2_bp
+#define USB_INTR_CFG 			PORTA_PIN1CTRL       //pin change control register (PORTA PIN1)
+#define USB_INTR_CFG_SET 		0x01                 //bits to set   for setting up USB_INTR_CFG, 0x01 equals PORT_ISC_BOTHEDGES_gc, USB_INTR_ENABLE_BIT makes it falling
 #define USB_INTR_CFG_CLR 		0			         //bits to clear for setting up USB_INTR_CFG
-#define USB_INTR_ENABLE 		PORTA_PIN2CTRL       //interrupt register for detecting USB events (PORTA PIN2)
-#define USB_INTR_ENABLE_BIT 	1                    //setting bit 1 equals 0x02 equals PORT_ISC_RISING_gc, If SOF logic NOT used, ISR must be wired to D+, and triggered on rising edge
+#define USB_INTR_ENABLE 		PORTA_PIN1CTRL       //interrupt register for detecting USB events (PORTA PIN1)
+#define USB_INTR_ENABLE_BIT 	1                    //setting bit 1 with USB_INTR_CFG_SET equals 0x03 equals PORT_ISC_FALLING_gc
 #define USB_INTR_PENDING 		VPORTA_INTFLAGS		 //flag for detecting if pin ISR occured (must be VPORT so in legacy IO space)
-#define USB_INTR_PENDING_BIT 	VPORT_INT2_bp        //bit position to check if pin ISR occured (PORTA PIN2)
+#define USB_INTR_PENDING_BIT 	VPORT_INT1_bp        //bit position to check if pin ISR occured (PORTA PIN1)
 #define USB_INTR_VECTOR 		PORTA_PORT_vect      //the interrupt ISR name for the pin change interrupt
 
 
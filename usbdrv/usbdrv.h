@@ -331,6 +331,13 @@ extern unsigned usbCrc16Append(unsigned data, uchar len);
  * the 2 bytes CRC (lowbyte first) in the 'data' buffer after reading 'len'
  * bytes.
  */
+extern unsigned usbCrc16Continue(unsigned data, uchar len, unsigned crc);
+#define usbCrc16Continue(data, len, crc)    usbCrc16Continue((unsigned)(data), len, crc)
+/* This function continues a usbCrc16() over 'len' more bytes, 'crc' is the
+ * value returned by the previous usbCrc16() or usbCrc16Continue() call. Use
+ * it to checksum more than 255 bytes, or to split a long checksum into
+ * chunks between usbPoll() calls.
+ */
 #if USB_CFG_HAVE_MEASURE_FRAME_LENGTH
 extern unsigned usbMeasureFrameLength(void);
 /* This function MUST be called IMMEDIATELY AFTER USB reset and measures 1/7 of